@@ -14,6 +14,23 @@
 
 #import "prefix_sum.h"
 
+#import "image_stream.h"
+
+#import "luma_convert.h"
+
+#import "frame_encoder.h"
+#import "block_checksum.h"
+#import "block_size_select.h"
+#import "frame_header.h"
+#import "segmented_scan.h"
+#import "block_class.h"
+#import "stripe_driver.h"
+#import "sum_pyramid.h"
+#import "delta_histogram.h"
+#import "scan_strategy.h"
+#import "frame_arena.h"
+#import "scan_roofline.h"
+
 #import "Util.h"
 
 @interface EmptyAppTests : XCTestCase
@@ -3338,5 +3355,954 @@
   XCTAssert([renderedArr isEqualToArray:expectedRenderedArr]);
 }
 
-@end
+// Stream a bottom up 24 bit TGA with a partial block on the right
+// and bottom edges and compare to splitting the grayscale image.
+
+- (void)testImageStreamTGAIntoBlocks {
+  const int width = 13;
+  const int height = 7;
+  const int blockSize = 4;
+  
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+  const int numBlockBytes = numBlocksInWidth * numBlocksInHeight * blockSize * blockSize;
+  
+  NSMutableData *tgaData = [NSMutableData dataWithLength:18];
+  uint8_t *header = (uint8_t *) tgaData.mutableBytes;
+  header[2] = 2;
+  header[12] = width;
+  header[14] = height;
+  header[16] = 24;
+  
+  NSMutableData *grayData = [NSMutableData dataWithLength:width*height];
+  uint8_t *grayPtr = (uint8_t *) grayData.mutableBytes;
+  
+  // Rows are written bottom to top, each pixel is gray so B = G = R
+  
+  for ( int fileRow = 0; fileRow < height; fileRow++ ) {
+    int row = height - 1 - fileRow;
+    for ( int col = 0; col < width; col++ ) {
+      uint8_t v = (uint8_t) ((row * width) + col + 1);
+      uint8_t bgr[3] = { v, v, v };
+      [tgaData appendBytes:bgr length:3];
+      grayPtr[(row * width) + col] = v;
+    }
+  }
+  
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"stream_test.tga"];
+  [tgaData writeToFile:path atomically:TRUE];
+  
+  NSMutableData *expectedData = [NSMutableData dataWithLength:numBlockBytes];
+  
+  [Util splitIntoBlocksOfSize:blockSize
+                      inBytes:grayPtr
+                     outBytes:(uint8_t *) expectedData.mutableBytes
+                        width:width
+                       height:height
+             numBlocksInWidth:numBlocksInWidth
+            numBlocksInHeight:numBlocksInHeight
+                    zeroValue:0];
+  
+  for (int useMmap = 0; useMmap < 2; useMmap++) {
+    ImageStream stream;
+    int status = ImageStream_openTGA(&stream, [path UTF8String], useMmap);
+    XCTAssert(status == 0);
+    XCTAssert(stream.width == width);
+    XCTAssert(stream.height == height);
+    
+    NSMutableData *blockData = [NSMutableData dataWithLength:numBlockBytes];
+    status = ImageStream_splitIntoBlocks(&stream, blockSize, (uint8_t *) blockData.mutableBytes, 0);
+    XCTAssert(status == 0);
+    
+    ImageStream_close(&stream);
+    
+    XCTAssert([blockData isEqualToData:expectedData]);
+  }
+}
+
+// A raw file shorter than width * height bytes, or non positive
+// dimensions, must fail to open instead of reading past the file.
+
+- (void)testImageStreamRawRejectsShortFile {
+  NSMutableData *rawData = [NSMutableData dataWithLength:100];
+
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"stream_short.raw"];
+  [rawData writeToFile:path atomically:TRUE];
+
+  for (int useMmap = 0; useMmap < 2; useMmap++) {
+    ImageStream stream;
+    int status = ImageStream_openRaw(&stream, [path UTF8String], 20, 20, useMmap);
+    XCTAssert(status == -1);
+
+    status = ImageStream_openRaw(&stream, [path UTF8String], 0, 20, useMmap);
+    XCTAssert(status == -1);
+
+    status = ImageStream_openRaw(&stream, [path UTF8String], 10, 10, useMmap);
+    XCTAssert(status == 0);
+    ImageStream_close(&stream);
+  }
+}
+
+// Vector BGRA to luma conversion must match the scalar formula exactly,
+// and fused conversion into blocks must match convert then split.
+
+- (void)testLumaConvertBGRAFusedIntoBlocks {
+  const int width = 37;
+  const int height = 21;
+  const int blockSize = 8;
+  
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+  const int numBlockBytes = numBlocksInWidth * numBlocksInHeight * blockSize * blockSize;
+  
+  NSMutableData *pixelsData = [NSMutableData dataWithLength:width*height*sizeof(uint32_t)];
+  uint8_t *pixelsPtr = (uint8_t *) pixelsData.mutableBytes;
+  
+  for ( int i = 0; i < (width * height * 4); i++ ) {
+    pixelsPtr[i] = (uint8_t) ((i * 31) ^ (i >> 3));
+  }
+  
+  LumaWeights weights = LumaWeights_BT709();
+  
+  NSMutableData *lumaData = [NSMutableData dataWithLength:width*height];
+  uint8_t *lumaPtr = (uint8_t *) lumaData.mutableBytes;
+  
+  LumaConvert_BGRA8ToY8(pixelsPtr, width*height, weights, lumaPtr);
+  
+  for ( int i = 0; i < (width * height); i++ ) {
+    uint8_t *p = pixelsPtr + (i * 4);
+    int expected = ((weights.r * p[2]) + (weights.g * p[1]) + (weights.b * p[0]) + 128) >> 8;
+    XCTAssert(lumaPtr[i] == expected);
+  }
+  
+  NSMutableData *expectedData = [NSMutableData dataWithLength:numBlockBytes];
+  
+  [Util splitIntoBlocksOfSize:blockSize
+                      inBytes:lumaPtr
+                     outBytes:(uint8_t *) expectedData.mutableBytes
+                        width:width
+                       height:height
+             numBlocksInWidth:numBlocksInWidth
+            numBlocksInHeight:numBlocksInHeight
+                    zeroValue:0];
+  
+  NSMutableData *blockData = [NSMutableData dataWithLength:numBlockBytes];
+  
+  LumaConvert_BGRA8FrameToBlocks(pixelsPtr, width, height, width*4, weights,
+                                 blockSize, (uint8_t *) blockData.mutableBytes, 0);
+  
+  XCTAssert([blockData isEqualToData:expectedData]);
+}
+
+
+// Whole frame delta encoding must match the per block delta definition
+// and decode back to the original bytes for any number of threads.
+
+- (void)testFrameEncoderDeltasRoundTrip {
+  const int blockSize = 8;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBlocks = 37;
+  const int numBytes = numBlocks * numBytesInBlock;
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int i = 0; i < numBytes; i++ ) {
+    inPtr[i] = (uint8_t) ((i * 7) ^ (i >> 4));
+  }
+  
+  for (int useInit = 0; useInit < 2; useInit++) {
+    for (int numThreads = 1; numThreads <= 8; numThreads++) {
+      NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+      NSMutableData *initData = [NSMutableData dataWithLength:numBlocks];
+      NSMutableData *decodedData = [NSMutableData dataWithLength:numBytes];
+      
+      uint8_t *deltasPtr = (uint8_t *) deltasData.mutableBytes;
+      uint8_t *initPtr = useInit ? (uint8_t *) initData.mutableBytes : NULL;
+      
+      FrameEncoder_encodeDeltas(inPtr, deltasPtr, numBytesInBlock, numBlocks, initPtr, numThreads);
+      
+      // First block
+      
+      if (useInit) {
+        XCTAssert(deltasPtr[0] == 0);
+        XCTAssert(initPtr[0] == inPtr[0]);
+      } else {
+        XCTAssert(deltasPtr[0] == inPtr[0]);
+      }
+      
+      for ( int i = 1; i < numBytesInBlock; i++ ) {
+        uint8_t expected = (uint8_t) (inPtr[i] - inPtr[i-1]);
+        XCTAssert(deltasPtr[i] == expected);
+      }
+      
+      FrameEncoder_decodeDeltas(deltasPtr, (uint8_t *) decodedData.mutableBytes, numBytesInBlock, numBlocks, initPtr, numThreads);
+      
+      XCTAssert([decodedData isEqualToData:inData]);
+    }
+  }
+}
+
+
+// Stripe checksums must match the CRC32C check value, verify a clean
+// decode and report a stripe that contains a corrupted delta byte.
+
+- (void)testFrameEncoderChecksumsDetectCorruption {
+  {
+    const char *checkStr = "123456789";
+    uint32_t crc = BlockChecksum_crc32c((const uint8_t *) checkStr, (int) strlen(checkStr));
+    XCTAssert(crc == 0xE3069283);
+  }
+  
+  const int blockSize = 8;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBlocks = 37;
+  const int numBlocksInStripe = 5;
+  const int numBytes = numBlocks * numBytesInBlock;
+  const int numStripes = BlockChecksum_numStripes(numBlocks, numBlocksInStripe);
+  
+  XCTAssert(numStripes == 8);
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int i = 0; i < numBytes; i++ ) {
+    inPtr[i] = (uint8_t) ((i * 13) ^ (i >> 3));
+  }
+  
+  NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+  NSMutableData *decodedData = [NSMutableData dataWithLength:numBytes];
+  NSMutableData *checksumData = [NSMutableData dataWithLength:numStripes*sizeof(uint32_t)];
+  
+  uint8_t *deltasPtr = (uint8_t *) deltasData.mutableBytes;
+  uint8_t *decodedPtr = (uint8_t *) decodedData.mutableBytes;
+  uint32_t *checksumPtr = (uint32_t *) checksumData.mutableBytes;
+  
+  FrameEncoder_encodeDeltasWithChecksums(inPtr, deltasPtr, numBytesInBlock, numBlocks, NULL,
+                                         numBlocksInStripe, checksumPtr, 4);
+  
+  int numFailed = FrameEncoder_decodeDeltasVerified(deltasPtr, decodedPtr, numBytesInBlock, numBlocks, NULL, NULL,
+                                                    numBlocksInStripe, checksumPtr, 4);
+  XCTAssert(numFailed == 0);
+  XCTAssert([decodedData isEqualToData:inData]);
+  XCTAssert(FrameEncoder_verifyChecksums(decodedPtr, numBytesInBlock, numBlocks, numBlocksInStripe, checksumPtr) == -1);
+  
+  // Flip one bit in block 12, which is in stripe 2
+  
+  deltasPtr[(12 * numBytesInBlock) + 3] ^= 0x1;
+  
+  numFailed = FrameEncoder_decodeDeltasVerified(deltasPtr, decodedPtr, numBytesInBlock, numBlocks, NULL, NULL,
+                                                numBlocksInStripe, checksumPtr, 4);
+  XCTAssert(numFailed == 1);
+  XCTAssert(FrameEncoder_verifyChecksums(decodedPtr, numBytesInBlock, numBlocks, numBlocksInStripe, checksumPtr) == 2);
+}
+
+
+// The block size cost model histogram must match the deltas actually
+// generated for each candidate size, a flat frame must select the
+// largest block, and the chosen size must round trip through the header.
 
+- (void)testBlockSizeSelectMatchesEncodedDeltas {
+  const int width = 75;
+  const int height = 43;
+  
+  NSMutableData *imageData = [NSMutableData dataWithLength:width*height];
+  uint8_t *imagePtr = (uint8_t *) imageData.mutableBytes;
+  
+  for ( int row = 0; row < height; row++ ) {
+    for ( int col = 0; col < width; col++ ) {
+      imagePtr[(row * width) + col] = (col < 40) ? 100 : (uint8_t) ((col * row * 31) ^ (col >> 1));
+    }
+  }
+  
+  for ( int sizei = 0; sizei < BLOCK_SIZE_SELECT_NUM_SIZES; sizei++ ) {
+    const int blockSize = BlockSizeSelect_sizeForIndex(sizei);
+    const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+    const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+    const int numBlocks = numBlocksInWidth * numBlocksInHeight;
+    const int numBytes = numBlocks * blockSize * blockSize;
+    
+    NSMutableData *blockData = [NSMutableData dataWithLength:numBytes];
+    NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+    NSMutableData *initData = [NSMutableData dataWithLength:numBlocks];
+    
+    [Util splitIntoBlocksOfSize:blockSize
+                        inBytes:imagePtr
+                       outBytes:(uint8_t *) blockData.mutableBytes
+                          width:width
+                         height:height
+               numBlocksInWidth:numBlocksInWidth
+              numBlocksInHeight:numBlocksInHeight
+                      zeroValue:0];
+    
+    FrameEncoder_encodeDeltas((const uint8_t *) blockData.bytes, (uint8_t *) deltasData.mutableBytes,
+                              blockSize * blockSize, numBlocks, (uint8_t *) initData.mutableBytes, 1);
+    
+    uint32_t expectedHistogram[256];
+    memset(expectedHistogram, 0, sizeof(expectedHistogram));
+    
+    const uint8_t *deltasPtr = (const uint8_t *) deltasData.bytes;
+    for ( int i = 0; i < numBytes; i++ ) {
+      expectedHistogram[deltasPtr[i]] += 1;
+    }
+    
+    uint32_t histogram[256];
+    BlockSizeSelect_deltaHistogram(imagePtr, width, height, blockSize, 1, histogram);
+    
+    XCTAssert(memcmp(histogram, expectedHistogram, sizeof(histogram)) == 0);
+  }
+  
+  // A constant frame has zero entropy for every size, so per block
+  // overhead decides and the largest block wins.
+  
+  {
+    memset(imagePtr, 42, width*height);
+    
+    BlockSizeCalibration calibration;
+    for ( int sizei = 0; sizei < BLOCK_SIZE_SELECT_NUM_SIZES; sizei++ ) {
+      calibration.decodeNsPerBlock[sizei] = 1.0;
+    }
+    
+    BlockSizeSelectParams params = BlockSizeSelect_defaultParams();
+    
+    int blockSize = BlockSizeSelect_chooseForFrame(imagePtr, width, height, &params, &calibration, NULL);
+    XCTAssert(blockSize == 32);
+    
+    FrameHeader header;
+    header.width = width;
+    header.height = height;
+    header.blockSize = blockSize;
+    header.flags = FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS;
+    
+    uint8_t headerBytes[FRAME_HEADER_NUM_BYTES];
+    FrameHeader_write(&header, headerBytes);
+    
+    FrameHeader readHeader;
+    int status = FrameHeader_read(headerBytes, FRAME_HEADER_NUM_BYTES, &readHeader);
+    XCTAssert(status == 0);
+    XCTAssert(readHeader.blockSize == 32);
+    XCTAssert(readHeader.width == width);
+    XCTAssert(readHeader.height == height);
+    XCTAssert(FrameHeader_numBlocksInWidth(&readHeader) == 3);
+    XCTAssert(FrameHeader_numBlocksInHeight(&readHeader) == 2);
+    
+    // A 64x64 block size is never written, so it must not be read
+    headerBytes[5] = 6;
+    status = FrameHeader_read(headerBytes, FRAME_HEADER_NUM_BYTES, &readHeader);
+    XCTAssert(status == -1);
+    
+    // 65536 x 65536 of 2x2 blocks is 2^32 bytes, more than an int holds
+    headerBytes[5] = 1;
+    FrameHeader_writeUInt32(headerBytes + 8, 65536);
+    FrameHeader_writeUInt32(headerBytes + 12, 65536);
+    status = FrameHeader_read(headerBytes, FRAME_HEADER_NUM_BYTES, &readHeader);
+    XCTAssert(status == -1);
+  }
+}
+
+
+// Segmented scans given as head flags, offsets or a fixed length must
+// match a serial scan that restarts at each head, for any thread count.
+
+- (void)testSegmentedScanMatchesSerial {
+  const int numBytes = 1000;
+  const int numFlagBytes = (numBytes + 7) / 8;
+  
+  uint8_t inBytes[numBytes];
+  uint8_t outBytes[numBytes];
+  uint8_t expectedBytes[numBytes];
+  uint8_t headFlags[numFlagBytes];
+  int segmentOffsets[numBytes+1];
+  
+  for ( int i = 0; i < numBytes; i++ ) {
+    inBytes[i] = (uint8_t) ((i * 29) ^ (i >> 2));
+  }
+  
+  // Ragged segments of 1 to 40 bytes
+  
+  int numSegments = 0;
+  
+  for ( int offset = 0; offset < numBytes; ) {
+    segmentOffsets[numSegments++] = offset;
+    offset += 1 + ((offset * 7) % 40);
+  }
+  segmentOffsets[numSegments] = numBytes;
+  
+  SegmentedScan_offsetsToHeadFlags(segmentOffsets, numSegments, headFlags, numFlagBytes);
+  
+  for (int isExclusive = 0; isExclusive < 2; isExclusive++) {
+    for ( int segmenti = 0; segmenti < numSegments; segmenti++ ) {
+      const int offset = segmentOffsets[segmenti];
+      const int len = segmentOffsets[segmenti+1] - offset;
+      
+      if (isExclusive) {
+        PrefixSum_exclusive(inBytes + offset, len, expectedBytes + offset, len);
+      } else {
+        PrefixSum_inclusive(inBytes + offset, len, expectedBytes + offset, len);
+      }
+    }
+    
+    for (int numThreads = 1; numThreads <= 8; numThreads++) {
+      memset(outBytes, 0, numBytes);
+      SegmentedScan_headFlags(inBytes, outBytes, headFlags, numBytes, isExclusive, numThreads);
+      XCTAssert(memcmp(outBytes, expectedBytes, numBytes) == 0);
+      
+      memset(outBytes, 0, numBytes);
+      SegmentedScan_offsets(inBytes, outBytes, segmentOffsets, numSegments, isExclusive, numThreads);
+      XCTAssert(memcmp(outBytes, expectedBytes, numBytes) == 0);
+    }
+  }
+  
+  // Fixed 8 byte segments match PrefixSum_inclusive on each block
+  
+  SegmentedScan_fixed(inBytes, outBytes, 992, 8, 0, 4);
+  
+  for ( int offset = 0; offset < 992; offset += 8 ) {
+    PrefixSum_inclusive(inBytes + offset, 8, expectedBytes + offset, 8);
+  }
+  
+  XCTAssert(memcmp(outBytes, expectedBytes, 992) == 0);
+}
+
+
+// Zero, constant and general blocks must be classified correctly and
+// a classified decode that fills flat blocks must match the input.
+
+- (void)testBlockClassFillsFlatBlocks {
+  const int blockSize = 8;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBlocks = 31;
+  const int numBytes = numBlocks * numBytesInBlock;
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int blocki = 0; blocki < numBlocks; blocki++ ) {
+    uint8_t *blockPtr = inPtr + (blocki * numBytesInBlock);
+    
+    for ( int i = 0; i < numBytesInBlock; i++ ) {
+      if ((blocki % 3) == 0) {
+        blockPtr[i] = 0;
+      } else if ((blocki % 3) == 1) {
+        blockPtr[i] = 200;
+      } else {
+        // Only the last byte differs
+        blockPtr[i] = (i == (numBytesInBlock - 1)) ? 1 : 0;
+      }
+    }
+  }
+  
+  NSMutableData *classData = [NSMutableData dataWithLength:BlockClass_numBitmapBytes(numBlocks)];
+  uint8_t *classPtr = (uint8_t *) classData.mutableBytes;
+  
+  BlockClass_classifyFrame(inPtr, numBytesInBlock, numBlocks, classPtr, 4);
+  
+  int counts[3];
+  BlockClass_counts(classPtr, numBlocks, counts);
+  XCTAssert(counts[BLOCK_CLASS_ZERO] == 11);
+  XCTAssert(counts[BLOCK_CLASS_CONSTANT] == 10);
+  XCTAssert(counts[BLOCK_CLASS_GENERAL] == 10);
+  
+  XCTAssert(BlockClass_get(classPtr, 0) == BLOCK_CLASS_ZERO);
+  XCTAssert(BlockClass_get(classPtr, 1) == BLOCK_CLASS_CONSTANT);
+  XCTAssert(BlockClass_get(classPtr, 2) == BLOCK_CLASS_GENERAL);
+  
+  for (int useInit = 0; useInit < 2; useInit++) {
+    NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+    NSMutableData *initData = [NSMutableData dataWithLength:numBlocks];
+    NSMutableData *decodedData = [NSMutableData dataWithLength:numBytes];
+    
+    uint8_t *initPtr = useInit ? (uint8_t *) initData.mutableBytes : NULL;
+    
+    FrameEncoder_encodeDeltas(inPtr, (uint8_t *) deltasData.mutableBytes, numBytesInBlock, numBlocks, initPtr, 2);
+    
+    FrameEncoder_decodeDeltasClassified((const uint8_t *) deltasData.bytes, (uint8_t *) decodedData.mutableBytes,
+                                        numBytesInBlock, numBlocks, initPtr, classPtr, 2);
+    
+    XCTAssert([decodedData isEqualToData:inData]);
+  }
+}
+
+
+// An image wider than 4096 streamed through small double buffered bands
+// must decode band by band with StripeDecoder to the whole frame block
+// order bytes, with each band verified against its block row checksums.
+
+- (void)testStripeDriverEncodesBandsOfWideImage {
+  const int width = 5003;
+  const int height = 77;
+  const int blockSize = 8;
+  
+  NSMutableData *imageData = [NSMutableData dataWithLength:width*height];
+  uint8_t *imagePtr = (uint8_t *) imageData.mutableBytes;
+  
+  for ( int i = 0; i < (width * height); i++ ) {
+    imagePtr[i] = (uint8_t) ((i * 7) ^ (i >> 9));
+  }
+  
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"stripe_test.raw"];
+  [imageData writeToFile:path atomically:TRUE];
+  
+  ImageStream stream;
+  int status = ImageStream_openRaw(&stream, [path UTF8String], width, height, 1);
+  XCTAssert(status == 0);
+  
+  // Working set fits the 2 input bands and the band of deltas, each
+  // 2 rows of blocks
+  
+  StripeDriver driver;
+  const int numBlockRowBytes = BlockSplit_blockRowNumBytes(blockSize, (width + blockSize - 1) / blockSize);
+  status = StripeDriver_init(&driver, &stream, blockSize, numBlockRowBytes * 2 * STRIPE_DRIVER_NUM_BAND_BUFFERS, 0);
+  XCTAssert(status == 0);
+  XCTAssert(driver.numBlockRowsInBand == 2);
+  XCTAssert(driver.numBands == 5);
+  
+  FILE *outFile = tmpfile();
+  
+  StripeEncoder encoder;
+  status = StripeEncoder_init(&encoder, &driver, outFile, 2);
+  XCTAssert(status == 0);
+  
+  status = StripeDriver_run(&driver, StripeEncoder_encodeBand, &encoder);
+  XCTAssert(status == 0);
+  
+  // Whole frame block order bytes
+  
+  const int numBlocksInWidth = driver.numBlocksInWidth;
+  const int numBlocksInHeight = driver.numBlocksInHeight;
+  NSMutableData *expectedData = [NSMutableData dataWithLength:numBlocksInWidth*numBlocksInHeight*blockSize*blockSize];
+  
+  [Util splitIntoBlocksOfSize:blockSize
+                      inBytes:imagePtr
+                     outBytes:(uint8_t *) expectedData.mutableBytes
+                        width:width
+                       height:height
+             numBlocksInWidth:numBlocksInWidth
+            numBlocksInHeight:numBlocksInHeight
+                    zeroValue:0];
+  
+  rewind(outFile);
+  
+  StripeDecoder decoder;
+  status = StripeDecoder_init(&decoder, outFile, 2);
+  XCTAssert(status == 0);
+  XCTAssert(decoder.header.width == width);
+  XCTAssert(decoder.header.height == height);
+  XCTAssert(decoder.header.blockSize == blockSize);
+  XCTAssert((decoder.header.flags & FRAME_HEADER_FLAG_STRIPED) != 0);
+  XCTAssert(decoder.numBlockRowsInBand == 2);
+  XCTAssert(decoder.numBands == driver.numBands);
+  
+  const uint8_t *expectedPtr = (const uint8_t *) expectedData.bytes;
+  const uint8_t *bandBytes;
+  int firstBlockRowi;
+  int numBlockRows;
+  int numBands = 0;
+  
+  while ((status = StripeDecoder_decodeBand(&decoder, &bandBytes, &firstBlockRowi, &numBlockRows)) == 1) {
+    XCTAssert(firstBlockRowi == (numBands * 2));
+    XCTAssert(numBlockRows == StripeDriver_numBlockRowsInBand(&driver, numBands));
+    
+    const int cmp = memcmp(bandBytes, expectedPtr + (firstBlockRowi * numBlockRowBytes), numBlockRows * numBlockRowBytes);
+    XCTAssert(cmp == 0);
+    
+    numBands += 1;
+  }
+  
+  XCTAssert(status == 0);
+  XCTAssert(numBands == driver.numBands);
+  
+  StripeDecoder_free(&decoder);
+  fclose(outFile);
+  StripeEncoder_free(&encoder);
+  StripeDriver_free(&driver);
+  ImageStream_close(&stream);
+}
+
+// Sub-block totals filled during decode must match totals summed
+// directly from the original bytes, and a constant block must produce
+// its value as the mean at every level.
+
+- (void)testSumPyramidFilledDuringDecode {
+  const int blockSize = 8;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBlocksInWidth = 5;
+  const int numBlocksInHeight = 3;
+  const int numBlocks = numBlocksInWidth * numBlocksInHeight;
+  const int numBytes = numBlocks * numBytesInBlock;
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int blocki = 0; blocki < numBlocks; blocki++ ) {
+    uint8_t *blockPtr = inPtr + (blocki * numBytesInBlock);
+    
+    for ( int i = 0; i < numBytesInBlock; i++ ) {
+      blockPtr[i] = ((blocki % 2) == 0) ? 77 : (uint8_t) ((i * 13) + blocki);
+    }
+  }
+  
+  NSMutableData *classData = [NSMutableData dataWithLength:BlockClass_numBitmapBytes(numBlocks)];
+  uint8_t *classPtr = (uint8_t *) classData.mutableBytes;
+  BlockClass_classifyFrame(inPtr, numBytesInBlock, numBlocks, classPtr, 2);
+  
+  NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+  NSMutableData *decodedData = [NSMutableData dataWithLength:numBytes];
+  
+  FrameEncoder_encodeDeltas(inPtr, (uint8_t *) deltasData.mutableBytes, numBytesInBlock, numBlocks, NULL, 2);
+  
+  SumPyramid pyramid;
+  int status = SumPyramid_init(&pyramid, blockSize, numBlocksInWidth, numBlocksInHeight);
+  XCTAssert(status == 0);
+  XCTAssert(pyramid.numLevels == 3);
+  
+  FrameEncoder_decodeDeltasWithPyramid((const uint8_t *) deltasData.bytes, (uint8_t *) decodedData.mutableBytes,
+                                       numBytesInBlock, numBlocks, NULL, classPtr, &pyramid, 2);
+  
+  XCTAssert([decodedData isEqualToData:inData]);
+  
+  for ( int level = 1; level <= pyramid.numLevels; level++ ) {
+    const int side = 1 << level;
+    const int numInBlock = blockSize / side;
+    
+    for ( int y = 0; y < pyramid.levelHeight[level]; y++ ) {
+      for ( int x = 0; x < pyramid.levelWidth[level]; x++ ) {
+        const int blocki = ((y / numInBlock) * numBlocksInWidth) + (x / numInBlock);
+        const uint8_t *blockPtr = inPtr + (blocki * numBytesInBlock);
+        const int startX = (x % numInBlock) * side;
+        const int startY = (y % numInBlock) * side;
+        
+        uint32_t total = 0;
+        for ( int row = startY; row < (startY + side); row++ ) {
+          for ( int col = startX; col < (startX + side); col++ ) {
+            total += blockPtr[(row * blockSize) + col];
+          }
+        }
+        
+        XCTAssert(SumPyramid_total(&pyramid, level, x, y) == total);
+      }
+    }
+  }
+  
+  // Block 0 is constant, the mean of the whole block is the value
+  
+  XCTAssert(SumPyramid_blockTotal(&pyramid, 0) == (77 * numBytesInBlock));
+  
+  uint8_t thumbnail[numBlocks];
+  SumPyramid_meanImage(&pyramid, pyramid.numLevels, thumbnail);
+  XCTAssert(thumbnail[0] == 77);
+  XCTAssert(thumbnail[2] == 77);
+  
+  SumPyramid_free(&pyramid);
+}
+
+// An edge block of a 5x3 image is zero padded to 8x8, the means must
+// only count image pixels and a square of only padding has a zero mean.
+
+- (void)testSumPyramidEdgeMeansCountOnlyImagePixels {
+  const int blockSize = 8;
+  const int width = 5;
+  const int height = 3;
+  
+  uint8_t imageBytes[width * height];
+  memset(imageBytes, 100, sizeof(imageBytes));
+  
+  uint8_t blockBytes[blockSize * blockSize];
+  
+  [Util splitIntoBlocksOfSize:blockSize
+                      inBytes:imageBytes
+                     outBytes:blockBytes
+                        width:width
+                       height:height
+             numBlocksInWidth:1
+            numBlocksInHeight:1
+                    zeroValue:0];
+  
+  SumPyramid pyramid;
+  int status = SumPyramid_init(&pyramid, blockSize, 1, 1);
+  XCTAssert(status == 0);
+  SumPyramid_setImageSize(&pyramid, width, height);
+  
+  SumPyramid_addFrame(&pyramid, blockBytes, 1);
+  
+  XCTAssert(SumPyramid_blockTotal(&pyramid, 0) == (100 * width * height));
+  XCTAssert(SumPyramid_mean(&pyramid, 3, 0, 0) == 100);
+  
+  // Level 1 square (2,1) covers the single pixel (4,2)
+  XCTAssert(SumPyramid_mean(&pyramid, 1, 2, 1) == 100);
+  XCTAssert(SumPyramid_mean(&pyramid, 1, 3, 0) == 0);
+  
+  uint8_t meanBytes[4 * 4];
+  SumPyramid_meanImage(&pyramid, 1, meanBytes);
+  XCTAssert(meanBytes[0] == 100);
+  XCTAssert(meanBytes[(1 * 4) + 2] == 100);
+  XCTAssert(meanBytes[(2 * 4) + 0] == 0);
+  
+  SumPyramid_free(&pyramid);
+}
+
+// Histograms collected during the delta encode must match counts of
+// the encoded deltas, and the deltas and checksums must be the same
+// as the plain checksum encoder generates.
+
+- (void)testDeltaHistogramCountsEncodedDeltas {
+  const int blockSize = 4;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBlocksInRegion = 6;
+  const int numBlocks = 40;
+  const int numBytes = numBlocks * numBytesInBlock;
+  const int numRegions = BlockChecksum_numStripes(numBlocks, numBlocksInRegion);
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int i = 0; i < numBytes; i++ ) {
+    inPtr[i] = (uint8_t) ((i * 3) + ((i % 5) == 0 ? 40 : 0));
+  }
+  
+  NSMutableData *expectedDeltasData = [NSMutableData dataWithLength:numBytes];
+  NSMutableData *expectedChecksumData = [NSMutableData dataWithLength:numRegions*sizeof(uint32_t)];
+  
+  FrameEncoder_encodeDeltasWithChecksums(inPtr, (uint8_t *) expectedDeltasData.mutableBytes, numBytesInBlock, numBlocks, NULL,
+                                         numBlocksInRegion, (uint32_t *) expectedChecksumData.mutableBytes, 1);
+  
+  const uint8_t *expectedPtr = (const uint8_t *) expectedDeltasData.bytes;
+  
+  for ( int numThreads = 1; numThreads <= 4; numThreads++ ) {
+    NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+    NSMutableData *checksumData = [NSMutableData dataWithLength:numRegions*sizeof(uint32_t)];
+    NSMutableData *regionData = [NSMutableData dataWithLength:numRegions*DELTA_HISTOGRAM_NUM_BINS*sizeof(uint32_t)];
+    uint32_t frameHistogram[DELTA_HISTOGRAM_NUM_BINS];
+    
+    int status = DeltaHistogram_encodeDeltas(inPtr, (uint8_t *) deltasData.mutableBytes, numBytesInBlock, numBlocks, NULL,
+                                             numBlocksInRegion, frameHistogram, (uint32_t *) regionData.mutableBytes,
+                                             (uint32_t *) checksumData.mutableBytes, numThreads);
+    XCTAssert(status == 0);
+    XCTAssert([deltasData isEqualToData:expectedDeltasData]);
+    XCTAssert([checksumData isEqualToData:expectedChecksumData]);
+    
+    uint32_t expectedFrame[DELTA_HISTOGRAM_NUM_BINS];
+    memset(expectedFrame, 0, sizeof(expectedFrame));
+    
+    for ( int regioni = 0; regioni < numRegions; regioni++ ) {
+      uint32_t expectedRegion[DELTA_HISTOGRAM_NUM_BINS];
+      memset(expectedRegion, 0, sizeof(expectedRegion));
+      
+      const int startByte = regioni * numBlocksInRegion * numBytesInBlock;
+      const int endByte = MIN(numBytes, startByte + (numBlocksInRegion * numBytesInBlock));
+      
+      for ( int i = startByte; i < endByte; i++ ) {
+        expectedRegion[expectedPtr[i]] += 1;
+        expectedFrame[expectedPtr[i]] += 1;
+      }
+      
+      const uint32_t *regionPtr = ((const uint32_t *) regionData.bytes) + (regioni * DELTA_HISTOGRAM_NUM_BINS);
+      XCTAssert(memcmp(regionPtr, expectedRegion, sizeof(expectedRegion)) == 0);
+    }
+    
+    XCTAssert(memcmp(frameHistogram, expectedFrame, sizeof(expectedFrame)) == 0);
+  }
+}
+
+// Every scan strategy must decode the same bytes as the serial prefix
+// sum, and a tuned profile must load back with the same entries.
+
+- (void)testScanStrategiesMatchSerial {
+  const int blockSizes[] = { 2, 4, 8, 16, 32 };
+  const int numBlocks = 37;
+  
+  for ( int sizei = 0; sizei < 5; sizei++ ) {
+    const int numBytesInBlock = blockSizes[sizei] * blockSizes[sizei];
+    const int numBytes = numBytesInBlock * numBlocks;
+    
+    NSMutableData *deltasData = [NSMutableData dataWithLength:numBytes];
+    uint8_t *deltasPtr = (uint8_t *) deltasData.mutableBytes;
+    
+    for ( int i = 0; i < numBytes; i++ ) {
+      deltasPtr[i] = (uint8_t) ((i * 7) ^ (i >> 3));
+    }
+    
+    NSMutableData *expectedData = [NSMutableData dataWithLength:numBytes];
+    
+    for ( int blocki = 0; blocki < numBlocks; blocki++ ) {
+      PrefixSum_inclusive(deltasPtr + (blocki * numBytesInBlock), numBytesInBlock,
+                          ((uint8_t *) expectedData.mutableBytes) + (blocki * numBytesInBlock), numBytesInBlock);
+    }
+    
+    for ( int strategy = 0; strategy < SCAN_STRATEGY_NUM_STRATEGIES; strategy++ ) {
+      for ( int numThreads = 1; numThreads <= 3; numThreads++ ) {
+        NSMutableData *decodedData = [NSMutableData dataWithLength:numBytes];
+        
+        int status = ScanStrategy_run(strategy, deltasPtr, (uint8_t *) decodedData.mutableBytes, numBytesInBlock, numBlocks, numThreads);
+        XCTAssert(status == 0);
+        XCTAssert([decodedData isEqualToData:expectedData], @"%s", ScanStrategy_name(strategy));
+      }
+    }
+  }
+  
+  ScanStrategyProfile profile;
+  ScanStrategy_initProfile(&profile);
+  
+  int strategy = ScanStrategy_select(&profile, 64, 1000, 2);
+  XCTAssert(strategy >= 0 && strategy < SCAN_STRATEGY_NUM_STRATEGIES);
+  XCTAssert(profile.numEntries == 1);
+  
+  // Same block size and a similar block count reuse the entry
+  XCTAssert(ScanStrategy_select(&profile, 64, 1020, 2) == strategy);
+  XCTAssert(profile.numEntries == 1);
+  
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"scan_strategy_profile.txt"];
+  XCTAssert(ScanStrategy_saveProfile(&profile, [path UTF8String]) == 0);
+  
+  ScanStrategyProfile loaded;
+  XCTAssert(ScanStrategy_loadProfile(&loaded, [path UTF8String]) == 0);
+  XCTAssert(loaded.numEntries == 1);
+  XCTAssert(ScanStrategy_findEntry(&loaded, 64, 1000, 2)->strategy == strategy);
+}
+
+// Buffers must be 64 byte aligned and a released buffer must be
+// reused by the next request that fits in it.
+
+- (void)testFrameArenaRecyclesAlignedBuffers {
+  FrameArena arena;
+  int status = FrameArena_init(&arena, 0);
+  XCTAssert(status == 0);
+  
+  const size_t numFrameBytes = FrameArena_numFrameBytes(8, 240, 135);
+  
+  uint8_t *frame1 = FrameArena_alloc(&arena, numFrameBytes);
+  uint8_t *small1 = FrameArena_alloc(&arena, 100);
+  XCTAssert(frame1 != NULL && small1 != NULL);
+  XCTAssert((((uintptr_t) frame1) % FRAME_ARENA_ALIGNMENT) == 0);
+  XCTAssert((((uintptr_t) small1) % FRAME_ARENA_ALIGNMENT) == 0);
+  
+  FrameArena_release(&arena, frame1);
+  
+  uint8_t *frame2 = FrameArena_alloc(&arena, numFrameBytes);
+  XCTAssert(frame2 == frame1);
+  XCTAssert(arena.numAllocated == 2);
+  XCTAssert(arena.numReused == 1);
+  
+  FrameArena_release(&arena, frame2);
+  FrameArena_release(&arena, small1);
+  FrameArena_free(&arena);
+  
+  // Deltas generated into arena buffers decode to the input
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:1000];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int i = 0; i < 1000; i++ ) {
+    inPtr[i] = (uint8_t) ((i * 5) + (i >> 4));
+  }
+  
+  NSData *deltas = [Util frameArenaDataWithLength:1000];
+  XCTAssert((((uintptr_t) deltas.bytes) % FRAME_ARENA_ALIGNMENT) == 0);
+  FrameEncoder_encodeBlockRange(inPtr, (uint8_t *) deltas.bytes, 1000, 0, 1, NULL);
+  
+  NSData *decoded = [Util frameArenaDataWithLength:1000];
+  XCTAssert(decoded.bytes != deltas.bytes);
+  FrameEncoder_decodeBlockRange((const uint8_t *) deltas.bytes, (uint8_t *) decoded.bytes, 1000, 0, 1, NULL);
+  XCTAssert([decoded isEqualToData:inData]);
+  
+  // Data handed out by Util wraps the arena pointer itself, so the same
+  // aligned bytes come back once the data has been deallocated.
+  
+  const uint8_t *recycledPtr = NULL;
+  
+  @autoreleasepool {
+    NSData *recycled = [Util frameArenaDataWithLength:4096];
+    recycledPtr = (const uint8_t *) recycled.bytes;
+    XCTAssert((((uintptr_t) recycledPtr) % FRAME_ARENA_ALIGNMENT) == 0);
+    recycled = nil;
+  }
+  
+  @autoreleasepool {
+    NSData *reused = [Util frameArenaDataWithLength:4096];
+    XCTAssert((const uint8_t *) reused.bytes == recycledPtr);
+    reused = nil;
+  }
+}
+
+// The CPU schedule must produce the exclusive prefix sum of each block,
+// and the modeled shader reads must produce the inclusive sum on the
+// final sweep, so the counts describe the passes that actually run.
+
+- (void)testScanRooflineScheduleMatchesPrefixSum {
+  const int blockSize = 8;
+  const int width = blockSize * 6;
+  const int height = blockSize * 4;
+  const int numBytesInBlock = blockSize * blockSize;
+  const int numBytes = width * height;
+  
+  NSMutableData *inData = [NSMutableData dataWithLength:numBytes];
+  uint8_t *inPtr = (uint8_t *) inData.mutableBytes;
+  
+  for ( int i = 0; i < numBytes; i++ ) {
+    inPtr[i] = (uint8_t) ((i * 7) ^ (i >> 3));
+  }
+  
+  NSMutableData *exclusiveData = [NSMutableData dataWithLength:numBytes];
+  NSMutableData *inclusiveData = [NSMutableData dataWithLength:numBytes];
+  
+  for ( int blocki = 0; blocki < (numBytes / numBytesInBlock); blocki++ ) {
+    PrefixSum_exclusive(inPtr + (blocki * numBytesInBlock), numBytesInBlock,
+                        ((uint8_t *) exclusiveData.mutableBytes) + (blocki * numBytesInBlock), numBytesInBlock);
+    PrefixSum_inclusive(inPtr + (blocki * numBytesInBlock), numBytesInBlock,
+                        ((uint8_t *) inclusiveData.mutableBytes) + (blocki * numBytesInBlock), numBytesInBlock);
+  }
+  
+  ScanRooflineSchedule schedule;
+  int status = ScanRoofline_buildSchedule(&schedule, width, height, blockSize, 0, 0);
+  XCTAssert(status == 0);
+  
+  // 8x8 reduces through 5 levels, then 5 sweeps and the final sweep
+  XCTAssert(schedule.numLevels == 11);
+  
+  NSMutableData *outData = [NSMutableData dataWithLength:numBytes];
+  status = ScanRoofline_timeCPUSchedule(&schedule, inPtr, (uint8_t *) outData.mutableBytes, 1);
+  XCTAssert(status == 0);
+  XCTAssert([outData isEqualToData:exclusiveData]);
+  
+  status = ScanRoofline_buildSchedule(&schedule, width, height, blockSize, 1, 0);
+  XCTAssert(status == 0);
+  
+  // Run the GPU schedule with the reads each fragment makes
+  
+  NSMutableArray *buffers = [NSMutableArray array];
+  
+  for ( int i = 0; i < schedule.numBuffers; i++ ) {
+    [buffers addObject:[NSMutableData dataWithLength:schedule.bufferWidth[i] * schedule.bufferHeight[i]]];
+  }
+  
+  memcpy(((NSMutableData *) buffers[SCAN_ROOFLINE_BUFFER_INPUT]).mutableBytes, inPtr, numBytes);
+  
+  for ( int li = 0; li < schedule.numLevels; li++ ) {
+    const ScanRooflineLevel *rl = &schedule.levels[li];
+    const int outWidth = schedule.bufferWidth[rl->outBuffer];
+    uint8_t *outPtr = (uint8_t *) ((NSMutableData *) buffers[rl->outBuffer]).mutableBytes;
+    
+    XCTAssert(rl->numReads >= rl->numFragments);
+    XCTAssert(rl->trafficBytes >= rl->bytesWritten);
+    
+    for ( int y = 0; y < schedule.bufferHeight[rl->outBuffer]; y++ ) {
+      for ( int x = 0; x < outWidth; x++ ) {
+        ScanRooflineRead reads[3];
+        int numReads = ScanRoofline_fragmentReads(&schedule, rl, x, y, reads);
+        
+        uint8_t sum = 0;
+        
+        for ( int i = 0; i < numReads; i++ ) {
+          const uint8_t *readPtr = (const uint8_t *) ((NSMutableData *) buffers[reads[i].buffer]).bytes;
+          sum += readPtr[(reads[i].y * schedule.bufferWidth[reads[i].buffer]) + reads[i].x];
+        }
+        
+        outPtr[(y * outWidth) + x] = sum;
+      }
+    }
+  }
+  
+  XCTAssert([buffers[SCAN_ROOFLINE_BUFFER_OUTPUT] isEqualToData:inclusiveData]);
+}
+
+@end
@@ -0,0 +1,1376 @@
+//
+//  mpsd.c
+//
+//  MIT Licensed
+//
+//  Command line encoder and decoder for block delta frames, built only
+//  on the portable C headers in Shared so that it runs on Linux without
+//  Metal. Frames are written as a FrameHeader followed by the block
+//  order deltas and the optional sections the header flags describe.
+//  Encoding with -s writes a striped frame through StripeDriver, so
+//  that both encode and decode hold only a band of block rows.
+//
+//  mpsd encode [options] in.tga|in.raw out.mpsd
+//  mpsd decode [options] in.mpsd out.tga|out.raw
+//  mpsd verify [options] in.tga|in.raw
+//  mpsd bench  [options] in.tga|in.raw
+//  mpsd roofline [options] in.tga|in.raw
+//
+//  Every command prints the time and throughput of each stage, roofline
+//  prints the scan_roofline.h report for the encoded frame instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "image_stream.h"
+#include "block_split.h"
+#include "frame_header.h"
+#include "frame_encoder.h"
+#include "block_class.h"
+#include "block_size_select.h"
+#include "delta_histogram.h"
+#include "scan_strategy.h"
+#include "frame_arena.h"
+#include "scan_roofline.h"
+#include "stripe_driver.h"
+#include "sum_pyramid.h"
+
+// Decode with FrameEncoder, checksums are verified as each row of
+// blocks is decoded and zero and constant blocks are filled.
+#define MPSD_KERNEL_FRAME -1
+// Decode with the tuned scan strategy for the frame geometry
+#define MPSD_KERNEL_AUTO -2
+
+#define MPSD_MAX_STAGES 32
+
+typedef struct {
+  int numThreads;
+  // Zero selects the block size for each frame
+  int blockSize;
+  int kernel;
+  int useBlockInitBytes;
+  // Dimensions of a raw input image
+  int width;
+  int height;
+  int useHugePages;
+  int numRepeats;
+  const char *profilePath;
+  int isQuiet;
+  // Encode in bands of block rows with StripeDriver
+  int isStriped;
+  // Decode with a sum pyramid and write the block means here
+  const char *thumbnailPath;
+} MpsdOptions;
+
+typedef struct {
+  const char *name;
+  double ns;
+  double numBytes;
+  int count;
+} MpsdStage;
+
+typedef struct {
+  int numStages;
+  MpsdStage stages[MPSD_MAX_STAGES];
+} MpsdReport;
+
+// An encoded frame, the buffers are owned by the frame
+
+typedef struct {
+  FrameHeader header;
+  int numBlocksInWidth;
+  int numBlocksInHeight;
+  int numBlocks;
+  int numBytesInBlock;
+  int numBytes;
+  uint8_t *deltas;
+  uint8_t *blockInitBytes;
+  uint32_t *checksums;
+  uint8_t *blockClasses;
+} MpsdFrame;
+
+static FrameArena arena;
+
+static
+void Mpsd_addStage(MpsdReport *report, const char *name, double ns, double numBytes)
+{
+  for ( int i = 0; i < report->numStages; i++ ) {
+    MpsdStage *stage = &report->stages[i];
+
+    if (strcmp(stage->name, name) == 0) {
+      stage->ns += ns;
+      stage->numBytes += numBytes;
+      stage->count += 1;
+      return;
+    }
+  }
+
+  if (report->numStages < MPSD_MAX_STAGES) {
+    MpsdStage *stage = &report->stages[report->numStages++];
+    stage->name = name;
+    stage->ns = ns;
+    stage->numBytes = numBytes;
+    stage->count = 1;
+  }
+}
+
+static
+void Mpsd_printReport(const MpsdReport *report, const MpsdOptions *options)
+{
+  if (options->isQuiet) {
+    return;
+  }
+
+  fprintf(stderr, "%-24s %6s %10s %10s\n", "stage", "runs", "ms/run", "MB/s");
+
+  for ( int i = 0; i < report->numStages; i++ ) {
+    const MpsdStage *stage = &report->stages[i];
+    const double msPerRun = (stage->ns / stage->count) / 1.0e6;
+    const double mbPerSec = (stage->ns > 0.0) ? ((stage->numBytes / (1024.0 * 1024.0)) / (stage->ns / 1.0e9)) : 0.0;
+
+    fprintf(stderr, "%-24s %6d %10.3f %10.1f\n", stage->name, stage->count, msPerRun, mbPerSec);
+  }
+}
+
+static
+void Mpsd_freeFrame(MpsdFrame *frame)
+{
+  FrameArena_release(&arena, frame->deltas);
+  free(frame->blockInitBytes);
+  free(frame->checksums);
+  free(frame->blockClasses);
+  memset(frame, 0, sizeof(MpsdFrame));
+}
+
+static
+int Mpsd_hasSuffix(const char *path, const char *suffix)
+{
+  const size_t pathLen = strlen(path);
+  const size_t suffixLen = strlen(suffix);
+  return (pathLen >= suffixLen) && (strcasecmp(path + pathLen - suffixLen, suffix) == 0);
+}
+
+// Open a TGA image by extension, anything else is raw 8 bit gray
+
+static
+int Mpsd_openImage(ImageStream *stream, const char *path, const MpsdOptions *options)
+{
+  if (Mpsd_hasSuffix(path, ".tga")) {
+    return ImageStream_openTGA(stream, path, 1);
+  }
+
+  if (options->width <= 0 || options->height <= 0) {
+    fprintf(stderr, "raw input \"%s\" needs -W width and -H height\n", path);
+    return -1;
+  }
+
+  return ImageStream_openRaw(stream, path, options->width, options->height, 1);
+}
+
+// Read the grayscale image in image order, only needed to select
+// a block size since encoding streams rows straight into blocks.
+
+static
+uint8_t* Mpsd_readGrayImage(ImageStream *stream)
+{
+  uint8_t *imageBytes = FrameArena_alloc(&arena, (size_t) stream->width * stream->height);
+
+  if (imageBytes == NULL) {
+    return NULL;
+  }
+
+  for ( int rowi = 0; rowi < stream->height; rowi++ ) {
+    const uint8_t *rowPtr = ImageStream_readGrayRow(stream, rowi);
+
+    if (rowPtr == NULL) {
+      FrameArena_release(&arena, imageBytes);
+      return NULL;
+    }
+
+    memcpy(imageBytes + ((size_t) rowi * stream->width), rowPtr, stream->width);
+  }
+
+  return imageBytes;
+}
+
+// Split, classify, and delta encode an image. blockBytes is set to the
+// block order bytes before deltas when not NULL, the caller releases it.
+
+static
+int Mpsd_encode(ImageStream *stream,
+                const MpsdOptions *options,
+                MpsdFrame *frame,
+                uint8_t **blockBytesPtr,
+                MpsdReport *report)
+{
+  memset(frame, 0, sizeof(MpsdFrame));
+
+  const double numImageBytes = (double) stream->width * stream->height;
+
+  int blockSize = options->blockSize;
+
+  if (blockSize == 0) {
+    double startNs = BlockSizeSelect_nowNs();
+
+    uint8_t *imageBytes = Mpsd_readGrayImage(stream);
+
+    if (imageBytes == NULL) {
+      return -1;
+    }
+
+    BlockSizeCalibration calibration;
+
+    if (BlockSizeSelect_calibrate(&calibration, 3) != 0) {
+      FrameArena_release(&arena, imageBytes);
+      return -1;
+    }
+
+    BlockSizeSelectParams params = BlockSizeSelect_defaultParams();
+    params.numDecodeLanes = options->numThreads;
+    params.useBlockInitBytes = options->useBlockInitBytes;
+
+    blockSize = BlockSizeSelect_chooseForFrame(imageBytes, stream->width, stream->height, &params, &calibration, NULL);
+
+    FrameArena_release(&arena, imageBytes);
+
+    Mpsd_addStage(report, "select block size", BlockSizeSelect_nowNs() - startNs, numImageBytes);
+  }
+
+  frame->header.width = stream->width;
+  frame->header.height = stream->height;
+  frame->header.blockSize = blockSize;
+  frame->header.flags = FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS | FRAME_HEADER_FLAG_BLOCK_CLASS_BITMAP;
+
+  if (options->useBlockInitBytes) {
+    frame->header.flags |= FRAME_HEADER_FLAG_BLOCK_INIT_BYTES;
+  }
+
+  if (FrameHeader_numBlockBytes(&frame->header) > INT_MAX) {
+    fprintf(stderr, "%d x %d is too large to encode as one frame, use -s\n", stream->width, stream->height);
+    return -1;
+  }
+
+  frame->numBlocksInWidth = FrameHeader_numBlocksInWidth(&frame->header);
+  frame->numBlocksInHeight = FrameHeader_numBlocksInHeight(&frame->header);
+  frame->numBlocks = frame->numBlocksInWidth * frame->numBlocksInHeight;
+  frame->numBytesInBlock = blockSize * blockSize;
+  frame->numBytes = frame->numBlocks * frame->numBytesInBlock;
+
+  uint8_t *blockBytes = FrameArena_alloc(&arena, frame->numBytes);
+  frame->deltas = FrameArena_alloc(&arena, frame->numBytes);
+  frame->checksums = (uint32_t *) malloc(frame->numBlocksInHeight * sizeof(uint32_t));
+  frame->blockClasses = (uint8_t *) malloc(BlockClass_numBitmapBytes(frame->numBlocks));
+
+  if (options->useBlockInitBytes) {
+    frame->blockInitBytes = (uint8_t *) malloc(frame->numBlocks);
+  }
+
+  if (blockBytes == NULL || frame->deltas == NULL || frame->checksums == NULL || frame->blockClasses == NULL ||
+      (options->useBlockInitBytes && frame->blockInitBytes == NULL)) {
+    fprintf(stderr, "could not allocate buffers for %d blocks\n", frame->numBlocks);
+    FrameArena_release(&arena, blockBytes);
+    Mpsd_freeFrame(frame);
+    return -1;
+  }
+
+  double startNs = BlockSizeSelect_nowNs();
+
+  if (ImageStream_splitIntoBlocks(stream, blockSize, blockBytes, 0) != 0) {
+    FrameArena_release(&arena, blockBytes);
+    Mpsd_freeFrame(frame);
+    return -1;
+  }
+
+  Mpsd_addStage(report, "read and split", BlockSizeSelect_nowNs() - startNs, numImageBytes);
+
+  startNs = BlockSizeSelect_nowNs();
+
+  BlockClass_classifyFrame(blockBytes, frame->numBytesInBlock, frame->numBlocks, frame->blockClasses, options->numThreads);
+
+  Mpsd_addStage(report, "classify", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  startNs = BlockSizeSelect_nowNs();
+
+  uint32_t histogram[DELTA_HISTOGRAM_NUM_BINS];
+
+  int status = DeltaHistogram_encodeDeltas(blockBytes, frame->deltas, frame->numBytesInBlock, frame->numBlocks,
+                                           frame->blockInitBytes, frame->numBlocksInWidth, histogram, NULL,
+                                           frame->checksums, options->numThreads);
+
+  Mpsd_addStage(report, "encode deltas", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  if (status != 0) {
+    FrameArena_release(&arena, blockBytes);
+    Mpsd_freeFrame(frame);
+    return -1;
+  }
+
+  if (!options->isQuiet && report->stages[0].count == 1) {
+    int counts[3];
+    BlockClass_counts(frame->blockClasses, frame->numBlocks, counts);
+    fprintf(stderr, "%d x %d, %d x %d blocks, %.3f bits per delta, %d zero %d constant %d general blocks\n",
+            frame->header.width, frame->header.height, blockSize, blockSize, BlockSizeSelect_entropy(histogram),
+            counts[BLOCK_CLASS_ZERO], counts[BLOCK_CLASS_CONSTANT], counts[BLOCK_CLASS_GENERAL]);
+  }
+
+  if (blockBytesPtr != NULL) {
+    *blockBytesPtr = blockBytes;
+  } else {
+    FrameArena_release(&arena, blockBytes);
+  }
+
+  return 0;
+}
+
+static
+int Mpsd_writeAll(FILE *fp, const void *bytes, size_t numBytes)
+{
+  return (fwrite(bytes, 1, numBytes, fp) == numBytes) ? 0 : -1;
+}
+
+static
+int Mpsd_readAll(FILE *fp, void *bytes, size_t numBytes)
+{
+  return (fread(bytes, 1, numBytes, fp) == numBytes) ? 0 : -1;
+}
+
+// Header, deltas, init bytes, checksums, then the class bitmap
+
+static
+int Mpsd_writeFrame(const char *path, const MpsdFrame *frame, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  FILE *fp = fopen(path, "wb");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for writing\n", path);
+    return -1;
+  }
+
+  uint8_t headerBytes[FRAME_HEADER_NUM_BYTES];
+  FrameHeader_write(&frame->header, headerBytes);
+
+  int status = Mpsd_writeAll(fp, headerBytes, sizeof(headerBytes));
+
+  if (status == 0) {
+    status = Mpsd_writeAll(fp, frame->deltas, frame->numBytes);
+  }
+
+  if (status == 0 && (frame->header.flags & FRAME_HEADER_FLAG_BLOCK_INIT_BYTES)) {
+    status = Mpsd_writeAll(fp, frame->blockInitBytes, frame->numBlocks);
+  }
+
+  for ( int i = 0; status == 0 && i < frame->numBlocksInHeight; i++ ) {
+    uint8_t checksumBytes[sizeof(uint32_t)];
+    FrameHeader_writeUInt32(checksumBytes, frame->checksums[i]);
+    status = Mpsd_writeAll(fp, checksumBytes, sizeof(checksumBytes));
+  }
+
+  if (status == 0) {
+    status = Mpsd_writeAll(fp, frame->blockClasses, BlockClass_numBitmapBytes(frame->numBlocks));
+  }
+
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+
+  if (status != 0) {
+    fprintf(stderr, "could not write \"%s\"\n", path);
+    return -1;
+  }
+
+  Mpsd_addStage(report, "write frame", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  return 0;
+}
+
+static
+int Mpsd_readFrame(const char *path, MpsdFrame *frame, MpsdReport *report)
+{
+  memset(frame, 0, sizeof(MpsdFrame));
+
+  double startNs = BlockSizeSelect_nowNs();
+
+  FILE *fp = fopen(path, "rb");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for reading\n", path);
+    return -1;
+  }
+
+  uint8_t headerBytes[FRAME_HEADER_NUM_BYTES];
+
+  if (Mpsd_readAll(fp, headerBytes, sizeof(headerBytes)) != 0 ||
+      FrameHeader_read(headerBytes, sizeof(headerBytes), &frame->header) != 0) {
+    fprintf(stderr, "could not read frame header from \"%s\"\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  const uint32_t requiredFlags = FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS | FRAME_HEADER_FLAG_BLOCK_CLASS_BITMAP;
+
+  if ((frame->header.flags & requiredFlags) != requiredFlags) {
+    fprintf(stderr, "\"%s\" has no block row checksums or class bitmap\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  // The header is untrusted, so sizes are checked in 64 bits and the
+  // file must hold every section before any buffer is allocated.
+
+  const int64_t numBytes = FrameHeader_numBlockBytes(&frame->header);
+
+  if (numBytes > INT_MAX) {
+    fprintf(stderr, "\"%s\" is too large to decode\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  frame->numBlocksInWidth = FrameHeader_numBlocksInWidth(&frame->header);
+  frame->numBlocksInHeight = FrameHeader_numBlocksInHeight(&frame->header);
+  frame->numBlocks = frame->numBlocksInWidth * frame->numBlocksInHeight;
+  frame->numBytesInBlock = frame->header.blockSize * frame->header.blockSize;
+  frame->numBytes = (int) numBytes;
+
+  const int hasInitBytes = (frame->header.flags & FRAME_HEADER_FLAG_BLOCK_INIT_BYTES) != 0;
+
+  const int64_t numFileBytes = (int64_t) FRAME_HEADER_NUM_BYTES + numBytes +
+                               (hasInitBytes ? frame->numBlocks : 0) +
+                               ((int64_t) frame->numBlocksInHeight * sizeof(uint32_t)) +
+                               BlockClass_numBitmapBytes(frame->numBlocks);
+
+  struct stat st;
+
+  if (fstat(fileno(fp), &st) != 0 || (int64_t) st.st_size < numFileBytes) {
+    fprintf(stderr, "\"%s\" is truncated\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  frame->deltas = FrameArena_alloc(&arena, frame->numBytes);
+  frame->checksums = (uint32_t *) malloc(frame->numBlocksInHeight * sizeof(uint32_t));
+  frame->blockClasses = (uint8_t *) malloc(BlockClass_numBitmapBytes(frame->numBlocks));
+
+  if (hasInitBytes) {
+    frame->blockInitBytes = (uint8_t *) malloc(frame->numBlocks);
+  }
+
+  int status = 0;
+
+  if (frame->deltas == NULL || frame->checksums == NULL || frame->blockClasses == NULL ||
+      (hasInitBytes && frame->blockInitBytes == NULL)) {
+    fprintf(stderr, "could not allocate buffers for %d blocks\n", frame->numBlocks);
+    status = -1;
+  }
+
+  if (status == 0) {
+    status = Mpsd_readAll(fp, frame->deltas, frame->numBytes);
+  }
+
+  if (status == 0 && hasInitBytes) {
+    status = Mpsd_readAll(fp, frame->blockInitBytes, frame->numBlocks);
+  }
+
+  for ( int i = 0; status == 0 && i < frame->numBlocksInHeight; i++ ) {
+    uint8_t checksumBytes[sizeof(uint32_t)];
+    status = Mpsd_readAll(fp, checksumBytes, sizeof(checksumBytes));
+    frame->checksums[i] = FrameHeader_readUInt32(checksumBytes);
+  }
+
+  if (status == 0) {
+    status = Mpsd_readAll(fp, frame->blockClasses, BlockClass_numBitmapBytes(frame->numBlocks));
+  }
+
+  fclose(fp);
+
+  if (status != 0) {
+    fprintf(stderr, "\"%s\" is truncated\n", path);
+    Mpsd_freeFrame(frame);
+    return -1;
+  }
+
+  Mpsd_addStage(report, "read frame", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  return 0;
+}
+
+static
+const char* Mpsd_kernelName(int kernel)
+{
+  if (kernel == MPSD_KERNEL_FRAME) {
+    return "frame";
+  } else if (kernel == MPSD_KERNEL_AUTO) {
+    return "auto";
+  } else {
+    return ScanStrategy_name(kernel);
+  }
+}
+
+// Default tuning profile path for -k auto when -p is not given, in
+// $XDG_CACHE_HOME or else $HOME/.cache, which is created if needed.
+// Returns 0 on success or -1 when neither variable is set.
+
+static
+int Mpsd_defaultProfilePath(char *path, size_t numBytes)
+{
+  const char *cacheDir = getenv("XDG_CACHE_HOME");
+  int numChars;
+
+  if (cacheDir != NULL && cacheDir[0] != '\0') {
+    numChars = snprintf(path, numBytes, "%s", cacheDir);
+  } else {
+    const char *homeDir = getenv("HOME");
+
+    if (homeDir == NULL || homeDir[0] == '\0') {
+      return -1;
+    }
+
+    numChars = snprintf(path, numBytes, "%s/.cache", homeDir);
+  }
+
+  if (numChars < 0 || (size_t) numChars >= numBytes) {
+    return -1;
+  }
+
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  numChars = snprintf(path + numChars, numBytes - numChars, "/mpsd_profile.txt");
+
+  return (numChars < 0 || (size_t) numChars >= numBytes) ? -1 : 0;
+}
+
+// Returns the scan strategy for the frame geometry from the profile,
+// tuning and saving the profile when the geometry is new.
+
+static
+int Mpsd_autoKernel(const MpsdFrame *frame, const MpsdOptions *options, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  ScanStrategyProfile profile;
+  ScanStrategy_initProfile(&profile);
+
+  if (options->profilePath != NULL) {
+    ScanStrategy_loadProfile(&profile, options->profilePath);
+  }
+
+  const int numEntries = profile.numEntries;
+
+  int strategy = ScanStrategy_select(&profile, frame->numBytesInBlock, frame->numBlocks, options->numThreads);
+
+  if (options->profilePath != NULL && profile.numEntries != numEntries) {
+    ScanStrategy_saveProfile(&profile, options->profilePath);
+  }
+
+  Mpsd_addStage(report, "select kernel", BlockSizeSelect_nowNs() - startNs, 0);
+
+  if (!options->isQuiet) {
+    fprintf(stderr, "kernel %s\n", ScanStrategy_name(strategy));
+  }
+
+  return strategy;
+}
+
+// Decode into outBytes and verify the block row checksums. Returns 0
+// on success or -1 if decoding failed or a checksum did not match.
+
+static
+int Mpsd_decode(const MpsdFrame *frame, int kernel, uint8_t *outBytes, const MpsdOptions *options, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  if (kernel == MPSD_KERNEL_FRAME) {
+    int numFailed = FrameEncoder_decodeDeltasVerified(frame->deltas, outBytes, frame->numBytesInBlock, frame->numBlocks,
+                                                      frame->blockInitBytes, frame->blockClasses, frame->numBlocksInWidth,
+                                                      frame->checksums, options->numThreads);
+
+    Mpsd_addStage(report, "decode frame+verify", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+    if (numFailed != 0) {
+      fprintf(stderr, "%d block rows failed checksum verification\n", numFailed);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (ScanStrategy_run(kernel, frame->deltas, outBytes, frame->numBytesInBlock, frame->numBlocks, options->numThreads) != 0) {
+    return -1;
+  }
+
+  if (frame->blockInitBytes != NULL) {
+    // The first delta of each block is zero, so the init byte is
+    // added to every byte of the scanned block.
+
+    for ( int blocki = 0; blocki < frame->numBlocks; blocki++ ) {
+      uint8_t *blockPtr = outBytes + (blocki * frame->numBytesInBlock);
+      const uint8_t initByte = frame->blockInitBytes[blocki];
+
+      for ( int i = 0; i < frame->numBytesInBlock; i++ ) {
+        blockPtr[i] += initByte;
+      }
+    }
+  }
+
+  // Stage names must outlive the report, so use the static strategy name
+
+  Mpsd_addStage(report, ScanStrategy_name(kernel), BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  startNs = BlockSizeSelect_nowNs();
+
+  int stripei = FrameEncoder_verifyChecksums(outBytes, frame->numBytesInBlock, frame->numBlocks,
+                                             frame->numBlocksInWidth, frame->checksums);
+
+  Mpsd_addStage(report, "verify checksums", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  if (stripei != -1) {
+    fprintf(stderr, "block row %d failed checksum verification\n", stripei);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Decode with the sum pyramid filled from each block as it decodes,
+// then verify the block row checksums.
+
+static
+int Mpsd_decodeWithPyramid(const MpsdFrame *frame, uint8_t *outBytes, SumPyramid *pyramid,
+                           const MpsdOptions *options, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  FrameEncoder_decodeDeltasWithPyramid(frame->deltas, outBytes, frame->numBytesInBlock, frame->numBlocks,
+                                       frame->blockInitBytes, frame->blockClasses, pyramid, options->numThreads);
+
+  Mpsd_addStage(report, "decode frame+pyramid", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  startNs = BlockSizeSelect_nowNs();
+
+  int stripei = FrameEncoder_verifyChecksums(outBytes, frame->numBytesInBlock, frame->numBlocks,
+                                             frame->numBlocksInWidth, frame->checksums);
+
+  Mpsd_addStage(report, "verify checksums", BlockSizeSelect_nowNs() - startNs, frame->numBytes);
+
+  if (stripei != -1) {
+    fprintf(stderr, "block row %d failed checksum verification\n", stripei);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Open a gray TGA or raw image for writing and write the TGA header
+
+static
+FILE* Mpsd_createImage(const char *path, int width, int height)
+{
+  if (Mpsd_hasSuffix(path, ".tga") && (width > 0xFFFF || height > 0xFFFF)) {
+    fprintf(stderr, "%d x %d is too large for a TGA image\n", width, height);
+    return NULL;
+  }
+
+  FILE *fp = fopen(path, "wb");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for writing\n", path);
+    return NULL;
+  }
+
+  if (Mpsd_hasSuffix(path, ".tga")) {
+    // Uncompressed 8 bit gray, rows stored top to bottom
+    uint8_t header[18];
+    memset(header, 0, sizeof(header));
+    header[2] = 3;
+    header[12] = (uint8_t) (width & 0xFF);
+    header[13] = (uint8_t) ((width >> 8) & 0xFF);
+    header[14] = (uint8_t) (height & 0xFF);
+    header[15] = (uint8_t) ((height >> 8) & 0xFF);
+    header[16] = 8;
+    header[17] = 0x20;
+
+    if (Mpsd_writeAll(fp, header, sizeof(header)) != 0) {
+      fprintf(stderr, "could not write \"%s\"\n", path);
+      fclose(fp);
+      return NULL;
+    }
+  }
+
+  return fp;
+}
+
+// Flatten numBlockRows rows of blocks starting at firstBlockRowi and
+// write the image rows they cover, rows past the image height are padding.
+
+static
+int Mpsd_writeBlockRows(FILE *fp,
+                        const FrameHeader *header,
+                        const uint8_t *blockBytes,
+                        int firstBlockRowi,
+                        int numBlockRows,
+                        uint8_t *rowBytes)
+{
+  const int width = header->width;
+  const int blockSize = header->blockSize;
+  const int numBlocksInWidth = FrameHeader_numBlocksInWidth(header);
+  const int numBlockRowBytes = BlockSplit_blockRowNumBytes(blockSize, numBlocksInWidth);
+
+  const int firstRowi = firstBlockRowi * blockSize;
+  int endRowi = firstRowi + (numBlockRows * blockSize);
+
+  if (endRowi > (int) header->height) {
+    endRowi = header->height;
+  }
+
+  for ( int rowi = firstRowi; rowi < endRowi; rowi++ ) {
+    const uint8_t *blockRowBytes = blockBytes + ((size_t) ((rowi - firstRowi) / blockSize) * numBlockRowBytes);
+    BlockSplit_flattenRow(blockRowBytes, width, blockSize, numBlocksInWidth, rowi % blockSize, rowBytes);
+
+    if (Mpsd_writeAll(fp, rowBytes, width) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Flatten block order bytes and write a gray TGA or raw image
+
+static
+int Mpsd_writeImage(const char *path, const MpsdFrame *frame, const uint8_t *blockBytes, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  const int width = frame->header.width;
+  const int height = frame->header.height;
+
+  FILE *fp = Mpsd_createImage(path, width, height);
+
+  if (fp == NULL) {
+    return -1;
+  }
+
+  uint8_t *rowBytes = (uint8_t *) malloc(width);
+
+  int status = (rowBytes != NULL) ? 0 : -1;
+
+  if (status == 0) {
+    status = Mpsd_writeBlockRows(fp, &frame->header, blockBytes, 0, frame->numBlocksInHeight, rowBytes);
+  }
+
+  free(rowBytes);
+
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+
+  if (status != 0) {
+    fprintf(stderr, "could not write \"%s\"\n", path);
+    return -1;
+  }
+
+  Mpsd_addStage(report, "flatten and write", BlockSizeSelect_nowNs() - startNs, (double) width * height);
+
+  return 0;
+}
+
+// Write the mean of each block as an image with one pixel per block,
+// cropped to the blocks that cover the image.
+
+static
+int Mpsd_writeThumbnail(const char *path, const SumPyramid *pyramid, MpsdReport *report)
+{
+  double startNs = BlockSizeSelect_nowNs();
+
+  const int level = pyramid->numLevels;
+  const int levelWidth = pyramid->levelWidth[level];
+  const int levelHeight = pyramid->levelHeight[level];
+
+  FILE *fp = Mpsd_createImage(path, levelWidth, levelHeight);
+
+  if (fp == NULL) {
+    return -1;
+  }
+
+  uint8_t *meanBytes = (uint8_t *) malloc((size_t) levelWidth * levelHeight);
+
+  int status = (meanBytes != NULL) ? 0 : -1;
+
+  if (status == 0) {
+    SumPyramid_meanImage(pyramid, level, meanBytes);
+    status = Mpsd_writeAll(fp, meanBytes, (size_t) levelWidth * levelHeight);
+  }
+
+  free(meanBytes);
+
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+
+  if (status != 0) {
+    fprintf(stderr, "could not write \"%s\"\n", path);
+    return -1;
+  }
+
+  Mpsd_addStage(report, "write thumbnail", BlockSizeSelect_nowNs() - startNs, (double) levelWidth * levelHeight);
+
+  return 0;
+}
+
+// Read the frame header to find out if a frame is striped
+
+static
+int Mpsd_readHeader(const char *path, FrameHeader *header)
+{
+  FILE *fp = fopen(path, "rb");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for reading\n", path);
+    return -1;
+  }
+
+  uint8_t headerBytes[FRAME_HEADER_NUM_BYTES];
+
+  int status = Mpsd_readAll(fp, headerBytes, sizeof(headerBytes));
+
+  fclose(fp);
+
+  if (status != 0 || FrameHeader_read(headerBytes, sizeof(headerBytes), header) != 0) {
+    fprintf(stderr, "could not read frame header from \"%s\"\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Stream the image through StripeDriver and write each band as it is
+// encoded, peak memory is two bands of input plus one band of deltas.
+
+static
+int Mpsd_commandEncodeStriped(const char *inPath, const char *outPath, const MpsdOptions *options)
+{
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  ImageStream stream;
+
+  if (Mpsd_openImage(&stream, inPath, options) != 0) {
+    return -1;
+  }
+
+  FILE *fp = fopen(outPath, "wb");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for writing\n", outPath);
+    ImageStream_close(&stream);
+    return -1;
+  }
+
+  double startNs = BlockSizeSelect_nowNs();
+
+  StripeDriver driver;
+  StripeEncoder encoder;
+
+  int status = StripeDriver_init(&driver, &stream, options->blockSize, STRIPE_DRIVER_DEFAULT_WORKING_SET_BYTES, 0);
+
+  if (status == 0) {
+    status = StripeEncoder_init(&encoder, &driver, fp, options->numThreads);
+
+    if (status == 0) {
+      status = StripeDriver_run(&driver, StripeEncoder_encodeBand, &encoder);
+      StripeEncoder_free(&encoder);
+    }
+
+    if (status == 0 && !options->isQuiet) {
+      fprintf(stderr, "%d x %d, %d x %d blocks, %d bands of %d block rows\n",
+              stream.width, stream.height, driver.blockSize, driver.blockSize,
+              driver.numBands, driver.numBlockRowsInBand);
+    }
+
+    StripeDriver_free(&driver);
+  }
+
+  if (fclose(fp) != 0) {
+    status = -1;
+  }
+
+  if (status == 0) {
+    Mpsd_addStage(&report, "striped encode", BlockSizeSelect_nowNs() - startNs, (double) stream.width * stream.height);
+  } else {
+    fprintf(stderr, "could not encode \"%s\"\n", inPath);
+  }
+
+  ImageStream_close(&stream);
+
+  Mpsd_printReport(&report, options);
+
+  return status;
+}
+
+// Decode a striped frame one band at a time, verifying each band's
+// block row checksums, and write the rows of each band as it decodes.
+
+static
+int Mpsd_commandDecodeStriped(const char *inPath, const char *outPath, const MpsdOptions *options)
+{
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  FILE *inFp = fopen(inPath, "rb");
+
+  if (inFp == NULL) {
+    fprintf(stderr, "could not open \"%s\" for reading\n", inPath);
+    return -1;
+  }
+
+  double startNs = BlockSizeSelect_nowNs();
+
+  StripeDecoder decoder;
+
+  if (StripeDecoder_init(&decoder, inFp, options->numThreads) != 0) {
+    fclose(inFp);
+    return -1;
+  }
+
+  const int width = decoder.header.width;
+  const int height = decoder.header.height;
+
+  int status = -1;
+
+  FILE *outFp = Mpsd_createImage(outPath, width, height);
+
+  if (outFp != NULL) {
+    uint8_t *rowBytes = (uint8_t *) malloc(width);
+
+    const uint8_t *bandBytes;
+    int firstBlockRowi;
+    int numBlockRows;
+
+    status = (rowBytes != NULL) ? 0 : -1;
+
+    while (status == 0) {
+      int result = StripeDecoder_decodeBand(&decoder, &bandBytes, &firstBlockRowi, &numBlockRows);
+
+      if (result <= 0) {
+        status = result;
+        break;
+      }
+
+      if (Mpsd_writeBlockRows(outFp, &decoder.header, bandBytes, firstBlockRowi, numBlockRows, rowBytes) != 0) {
+        fprintf(stderr, "could not write \"%s\"\n", outPath);
+        status = -1;
+      }
+    }
+
+    free(rowBytes);
+
+    if (fclose(outFp) != 0) {
+      status = -1;
+    }
+  }
+
+  StripeDecoder_free(&decoder);
+  fclose(inFp);
+
+  if (status == 0) {
+    Mpsd_addStage(&report, "striped decode+verify", BlockSizeSelect_nowNs() - startNs, (double) width * height);
+  }
+
+  Mpsd_printReport(&report, options);
+
+  return status;
+}
+
+static
+int Mpsd_commandEncode(const char *inPath, const char *outPath, const MpsdOptions *options)
+{
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  ImageStream stream;
+
+  if (Mpsd_openImage(&stream, inPath, options) != 0) {
+    return -1;
+  }
+
+  MpsdFrame frame;
+  int status = Mpsd_encode(&stream, options, &frame, NULL, &report);
+
+  ImageStream_close(&stream);
+
+  if (status == 0) {
+    status = Mpsd_writeFrame(outPath, &frame, &report);
+    Mpsd_freeFrame(&frame);
+  }
+
+  Mpsd_printReport(&report, options);
+
+  return status;
+}
+
+static
+int Mpsd_commandDecode(const char *inPath, const char *outPath, const MpsdOptions *options)
+{
+  FrameHeader header;
+
+  if (Mpsd_readHeader(inPath, &header) != 0) {
+    return -1;
+  }
+
+  if (header.flags & FRAME_HEADER_FLAG_STRIPED) {
+    if (options->thumbnailPath != NULL) {
+      fprintf(stderr, "-T is not supported for striped frames\n");
+      return -1;
+    }
+
+    return Mpsd_commandDecodeStriped(inPath, outPath, options);
+  }
+
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  MpsdFrame frame;
+
+  if (Mpsd_readFrame(inPath, &frame, &report) != 0) {
+    return -1;
+  }
+
+  int kernel = options->kernel;
+
+  if (kernel == MPSD_KERNEL_AUTO && options->thumbnailPath == NULL) {
+    kernel = Mpsd_autoKernel(&frame, options, &report);
+  }
+
+  uint8_t *decoded = FrameArena_alloc(&arena, frame.numBytes);
+
+  int status = (decoded != NULL) ? 0 : -1;
+
+  if (status == 0 && options->thumbnailPath != NULL) {
+    // The pyramid is filled by the frame decode, so -k is not used
+    SumPyramid pyramid;
+    status = SumPyramid_init(&pyramid, frame.header.blockSize, frame.numBlocksInWidth, frame.numBlocksInHeight);
+
+    if (status == 0) {
+      SumPyramid_setImageSize(&pyramid, frame.header.width, frame.header.height);
+      status = Mpsd_decodeWithPyramid(&frame, decoded, &pyramid, options, &report);
+    }
+
+    if (status == 0) {
+      status = Mpsd_writeThumbnail(options->thumbnailPath, &pyramid, &report);
+    }
+
+    SumPyramid_free(&pyramid);
+  } else if (status == 0) {
+    status = Mpsd_decode(&frame, kernel, decoded, options, &report);
+  }
+
+  if (status == 0) {
+    status = Mpsd_writeImage(outPath, &frame, decoded, &report);
+  }
+
+  FrameArena_release(&arena, decoded);
+  Mpsd_freeFrame(&frame);
+
+  Mpsd_printReport(&report, options);
+
+  return status;
+}
+
+// Encode then decode with every kernel, or only the selected one,
+// numRepeats times and compare with the original block order bytes.
+
+static
+int Mpsd_commandVerify(const char *inPath, const MpsdOptions *options, int isBench)
+{
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  int numFailed = 0;
+
+  for ( int repeati = 0; repeati < options->numRepeats; repeati++ ) {
+    ImageStream stream;
+
+    if (Mpsd_openImage(&stream, inPath, options) != 0) {
+      return -1;
+    }
+
+    MpsdFrame frame;
+    uint8_t *blockBytes = NULL;
+
+    int status = Mpsd_encode(&stream, options, &frame, &blockBytes, &report);
+
+    ImageStream_close(&stream);
+
+    if (status != 0) {
+      return -1;
+    }
+
+    int kernels[SCAN_STRATEGY_NUM_STRATEGIES + 1];
+    int numKernels = 0;
+
+    if (options->kernel == MPSD_KERNEL_AUTO) {
+      kernels[numKernels++] = Mpsd_autoKernel(&frame, options, &report);
+    } else if (isBench && options->kernel == MPSD_KERNEL_FRAME) {
+      // Bench every kernel unless one was selected
+      kernels[numKernels++] = MPSD_KERNEL_FRAME;
+      for ( int strategy = 0; strategy < SCAN_STRATEGY_NUM_STRATEGIES; strategy++ ) {
+        kernels[numKernels++] = strategy;
+      }
+    } else {
+      kernels[numKernels++] = options->kernel;
+    }
+
+    uint8_t *decoded = FrameArena_alloc(&arena, frame.numBytes);
+
+    if (decoded == NULL) {
+      FrameArena_release(&arena, blockBytes);
+      Mpsd_freeFrame(&frame);
+      return -1;
+    }
+
+    for ( int i = 0; i < numKernels; i++ ) {
+      if (Mpsd_decode(&frame, kernels[i], decoded, options, &report) != 0 ||
+          memcmp(decoded, blockBytes, frame.numBytes) != 0) {
+        fprintf(stderr, "round trip with kernel %s does not match\n", Mpsd_kernelName(kernels[i]));
+        numFailed += 1;
+      }
+    }
+
+    FrameArena_release(&arena, decoded);
+    FrameArena_release(&arena, blockBytes);
+    Mpsd_freeFrame(&frame);
+  }
+
+  Mpsd_printReport(&report, options);
+
+  if (numFailed == 0 && !options->isQuiet) {
+    fprintf(stderr, "round trip ok\n");
+  }
+
+  return (numFailed == 0) ? 0 : -1;
+}
+
+// Print the modeled GPU reduce and sweep schedule counts, then the CPU
+// schedule and scan strategies timed on the encoded deltas against the
+// measured bandwidth and byte add rate.
+
+static
+int Mpsd_commandRoofline(const char *inPath, const MpsdOptions *options)
+{
+  MpsdReport report;
+  memset(&report, 0, sizeof(report));
+
+  ImageStream stream;
+
+  if (Mpsd_openImage(&stream, inPath, options) != 0) {
+    return -1;
+  }
+
+  MpsdFrame frame;
+  int status = Mpsd_encode(&stream, options, &frame, NULL, &report);
+
+  ImageStream_close(&stream);
+
+  if (status != 0) {
+    return -1;
+  }
+
+  const int blockSize = frame.header.blockSize;
+  const int width = frame.numBlocksInWidth * blockSize;
+  const int height = frame.numBlocksInHeight * blockSize;
+
+  ScanRooflineSchedule gpuSchedule;
+  ScanRooflineSchedule cpuSchedule;
+
+  status = ScanRoofline_buildSchedule(&gpuSchedule, width, height, blockSize, 1, 0);
+
+  if (status == 0) {
+    status = ScanRoofline_buildSchedule(&cpuSchedule, width, height, blockSize, 0, 0);
+  }
+
+  if (status == 0) {
+    status = ScanRoofline_timeCPUSchedule(&cpuSchedule, frame.deltas, NULL, options->numRepeats);
+  }
+
+  if (status == 0) {
+    status = ScanRoofline_timeScanStrategies(&cpuSchedule, frame.deltas, options->numThreads, options->numRepeats);
+  }
+
+  if (status == 0) {
+    const double bytesPerNs = ScanRoofline_measureBandwidth(64 * 1024 * 1024, options->numRepeats);
+    const double opsPerNs = ScanRoofline_measurePeakOps(options->numThreads, options->numRepeats);
+
+    // No GPU here, so the GPU counts are shown against the CPU bandwidth
+    ScanRoofline_print(stdout, &gpuSchedule, bytesPerNs, 0.0);
+    ScanRoofline_print(stdout, &cpuSchedule, bytesPerNs, opsPerNs);
+  }
+
+  Mpsd_freeFrame(&frame);
+
+  return status;
+}
+
+static
+void Mpsd_usage(void)
+{
+  fprintf(stderr,
+          "usage: mpsd encode [options] in.tga|in.raw out.mpsd\n"
+          "       mpsd decode [options] in.mpsd out.tga|out.raw\n"
+          "       mpsd verify [options] in.tga|in.raw\n"
+          "       mpsd bench  [options] in.tga|in.raw\n"
+          "       mpsd roofline [options] in.tga|in.raw\n"
+          "\n"
+          "  -t threads     worker threads, default is the number of cores\n"
+          "  -b size        block size 2 to 32 or auto, default 8\n"
+          "  -k kernel      decode kernel: frame, auto, serial, simd_horizontal,\n"
+          "                 lane_interleaved, hillis_steele, blelloch, reduce_then_scan\n"
+          "  -p path        tuning profile that auto loads and saves, default\n"
+          "                 $XDG_CACHE_HOME/mpsd_profile.txt or ~/.cache/mpsd_profile.txt\n"
+          "  -i             store the first byte of each block as an init byte\n"
+          "  -s             encode a striped frame in bands of block rows, decode\n"
+          "                 detects striped frames and always uses the frame kernel\n"
+          "  -T path        decode with a sum pyramid and also write the mean of\n"
+          "                 each block to path as a thumbnail image\n"
+          "  -W width       width of a raw input image\n"
+          "  -H height      height of a raw input image\n"
+          "  -n repeats     number of times verify, bench and roofline run, default 1 and 5\n"
+          "  -g             back frame buffers with huge pages\n"
+          "  -q             do not print the stage report\n");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    Mpsd_usage();
+    return 1;
+  }
+
+  const char *command = argv[1];
+
+  MpsdOptions options;
+  memset(&options, 0, sizeof(options));
+  options.numThreads = ParallelFor_numCores();
+  options.blockSize = 8;
+  options.kernel = MPSD_KERNEL_FRAME;
+  options.numRepeats = (strcmp(command, "bench") == 0 || strcmp(command, "roofline") == 0) ? 5 : 1;
+
+  optind = 2;
+
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:b:k:p:isT:W:H:n:gq")) != -1) {
+    switch (opt) {
+      case 't':
+        options.numThreads = atoi(optarg);
+        break;
+      case 'b':
+        options.blockSize = (strcmp(optarg, "auto") == 0) ? 0 : atoi(optarg);
+        break;
+      case 'k':
+        if (strcmp(optarg, "frame") == 0) {
+          options.kernel = MPSD_KERNEL_FRAME;
+        } else if (strcmp(optarg, "auto") == 0) {
+          options.kernel = MPSD_KERNEL_AUTO;
+        } else {
+          options.kernel = ScanStrategy_forName(optarg);
+          if (options.kernel < 0) {
+            fprintf(stderr, "unknown kernel \"%s\"\n", optarg);
+            return 1;
+          }
+        }
+        break;
+      case 'p':
+        options.profilePath = optarg;
+        break;
+      case 'i':
+        options.useBlockInitBytes = 1;
+        break;
+      case 's':
+        options.isStriped = 1;
+        break;
+      case 'T':
+        options.thumbnailPath = optarg;
+        break;
+      case 'W':
+        options.width = atoi(optarg);
+        break;
+      case 'H':
+        options.height = atoi(optarg);
+        break;
+      case 'n':
+        options.numRepeats = atoi(optarg);
+        break;
+      case 'g':
+        options.useHugePages = 1;
+        break;
+      case 'q':
+        options.isQuiet = 1;
+        break;
+      default:
+        Mpsd_usage();
+        return 1;
+    }
+  }
+
+  const int bs = options.blockSize;
+
+  if (options.numThreads < 1 || options.numRepeats < 1 ||
+      (bs != 0 && (bs < 2 || bs > 32 || (bs & (bs - 1)) != 0))) {
+    Mpsd_usage();
+    return 1;
+  }
+
+  if (options.isStriped && (bs == 0 || options.useBlockInitBytes)) {
+    // Selecting a block size or init bytes needs the whole frame
+    fprintf(stderr, "-s needs a fixed block size and cannot be used with -i\n");
+    return 1;
+  }
+
+  // Without a profile auto would tune again on every run
+  char defaultProfilePath[4096];
+
+  if (options.kernel == MPSD_KERNEL_AUTO && options.profilePath == NULL &&
+      Mpsd_defaultProfilePath(defaultProfilePath, sizeof(defaultProfilePath)) == 0) {
+    options.profilePath = defaultProfilePath;
+  }
+
+  const int numArgs = argc - optind;
+  char **args = argv + optind;
+
+  if (FrameArena_init(&arena, options.useHugePages) != 0) {
+    return 1;
+  }
+
+  int status;
+
+  if (strcmp(command, "encode") == 0 && numArgs == 2 && options.isStriped) {
+    status = Mpsd_commandEncodeStriped(args[0], args[1], &options);
+  } else if (strcmp(command, "encode") == 0 && numArgs == 2) {
+    status = Mpsd_commandEncode(args[0], args[1], &options);
+  } else if (strcmp(command, "decode") == 0 && numArgs == 2) {
+    status = Mpsd_commandDecode(args[0], args[1], &options);
+  } else if (strcmp(command, "verify") == 0 && numArgs == 1) {
+    status = Mpsd_commandVerify(args[0], &options, 0);
+  } else if (strcmp(command, "bench") == 0 && numArgs == 1) {
+    status = Mpsd_commandVerify(args[0], &options, 1);
+  } else if (strcmp(command, "roofline") == 0 && numArgs == 1) {
+    status = Mpsd_commandRoofline(args[0], &options);
+  } else {
+    Mpsd_usage();
+    status = -1;
+  }
+
+  FrameArena_free(&arena);
+
+  return (status == 0) ? 0 : 1;
+}
@@ -24,11 +24,32 @@ Implementation of renderer class which perfoms Metal setup and per frame renderi
 
 #import "Util.h"
 
+#include "image_stream.h"
+#include "frame_encoder.h"
+#include "block_checksum.h"
+#include "block_class.h"
+#include "block_size_select.h"
+#include "frame_header.h"
+#include "delta_histogram.h"
+#include "scan_strategy.h"
+
 #import "MetalRenderContext.h"
 #import "MetalPrefixSumRenderContext.h"
 #import "MetalPrefixSumRenderFrame.h"
 
-const static unsigned int blockDim = 8;
+// Block dimension used when a frame does not select its own size
+
+const static unsigned int defaultBlockDim = 8;
+
+// Define to score candidate block sizes from 2x2 to 32x32 for each
+// input frame and render with the lowest cost size.
+
+//#define IMPL_ADAPTIVE_BLOCK_SIZE
+
+// Define to print per level memory traffic and timings of the prefix
+// sum render passes and the CPU equivalents once, before the first frame.
+
+//#define IMPL_SCAN_ROOFLINE
 
 @interface AAPLRenderer ()
 
@@ -104,6 +125,28 @@ const static unsigned int blockDim = 8;
 
   NSData *_blockInitData;
 
+  // CRC32C of the original block order bytes for each row of blocks
+  NSData *_blockChecksumData;
+
+  // 2 bit zero, constant, or general class for each block, only the
+  // CPU decode uses it, the Metal reduce and sweep scan every block.
+  NSData *_blockClassData;
+
+  // 256 bin histogram of the delta bytes for the whole frame
+  NSData *_deltaHistogramData;
+
+  // FrameHeader bytes that describe the encoded frame
+  NSData *_frameHeaderData;
+
+  // Width and height of each block for the current frame
+  unsigned int blockDim;
+
+#if defined(DEBUG)
+  // Fastest CPU block scan on this host for the current frame geometry,
+  // diagnostic only, the DEBUG cross check is the only CPU decode here.
+  int _scanStrategy;
+#endif // DEBUG
+
   NSData *_outBlockOrderSymbolsData;
 
   NSData *_blockOrderSymbolsPreDeltas;
@@ -288,16 +331,17 @@ const static unsigned int blockDim = 8;
   int width = (int) texture.width;
   int height = (int) texture.height;
   
-  NSMutableData *mFramebuffer = [NSMutableData dataWithLength:width*height*sizeof(uint8_t)];
+  // Every byte is written by the texture read
+  NSData *framebuffer = [Util frameArenaDataWithLength:width*height*sizeof(uint8_t)];
   
-  [texture getBytes:(void*)mFramebuffer.mutableBytes
+  [texture getBytes:(uint8_t *) framebuffer.bytes
            bytesPerRow:width*sizeof(uint8_t)
          bytesPerImage:width*height*sizeof(uint8_t)
             fromRegion:MTLRegionMake2D(0, 0, width, height)
            mipmapLevel:0
                  slice:0];
   
-  return [NSData dataWithData:mFramebuffer];
+  return framebuffer;
 }
 
 // Query pixel contents of a texture and return as uint32_t
@@ -388,27 +432,49 @@ const static unsigned int blockDim = 8;
   
   int outBlockOrderSymbolsNumBytes = (blockDim * blockDim) * (blockWidth * blockHeight);
   
-  // Generate input that is zero padded out to the number of blocks needed
-  NSMutableData *outBlockOrderSymbolsData = [NSMutableData dataWithLength:outBlockOrderSymbolsNumBytes];
-  uint8_t *outBlockOrderSymbolsPtr = (uint8_t *) outBlockOrderSymbolsData.bytes;
+  // Generate input that is zero padded out to the number of blocks needed.
+  // The block order symbols are split directly into the pre delta buffer
+  // and deltas are written to a second buffer, both are recycled by the
+  // frame arena so no frame sized allocation or copy is made per frame.
+  NSData *blockOrderSymbolsData = [Util frameArenaDataWithLength:outBlockOrderSymbolsNumBytes];
+  uint8_t *blockOrderSymbolsPtr = (uint8_t *) blockOrderSymbolsData.bytes;
   
-  [Util splitIntoBlocksOfSize:blockDim
-                      inBytes:(uint8_t*)_imageInputBytes.bytes
-                     outBytes:outBlockOrderSymbolsPtr
-                        width:width
-                       height:height
-             numBlocksInWidth:blockWidth
-            numBlocksInHeight:blockHeight
-                    zeroValue:0];
+  if (self.imageInputFrame.inputPath != nil) {
+    // Stream rows from the file directly into block order, the
+    // frame is never held in image order.
     
-  // Make a copy of the block order symbols, since calculating deltas will replace
-  // these symbols in place to minimize memory.
-
-  _blockOrderSymbolsPreDeltas = [NSMutableData dataWithData:outBlockOrderSymbolsData];
+    ImageStream stream;
+    int status = ImageStream_openTGA(&stream, [self.imageInputFrame.inputPath UTF8String], 1);
+    assert(status == 0);
+    assert(stream.width == width && stream.height == height);
+    
+    status = ImageStream_splitIntoBlocks(&stream, blockDim, blockOrderSymbolsPtr, 0);
+    assert(status == 0);
+    
+    ImageStream_close(&stream);
+  } else if (self.imageInputFrame.inputImage != nil) {
+    // Convert decoded pixels to luma directly into block order
+    
+    [ImageInputFrame convertImage:self.imageInputFrame.inputImage
+               toLumaBlocksOfSize:blockDim
+                         outBytes:blockOrderSymbolsPtr];
+  } else {
+    [Util splitIntoBlocksOfSize:blockDim
+                        inBytes:(uint8_t*)_imageInputBytes.bytes
+                       outBytes:blockOrderSymbolsPtr
+                          width:width
+                         height:height
+               numBlocksInWidth:blockWidth
+              numBlocksInHeight:blockHeight
+                      zeroValue:0];
+  }
   
-#if defined(DEBUG)
-    NSData *blockOrderSymbolsCopy = [NSMutableData dataWithData:outBlockOrderSymbolsData];
-#endif // DEBUG
+  _blockOrderSymbolsPreDeltas = blockOrderSymbolsData;
+  
+  // Every delta byte is written by the encoder
+  
+  NSData *outBlockOrderSymbolsData = [Util frameArenaDataWithLength:outBlockOrderSymbolsNumBytes];
+  uint8_t *outBlockOrderSymbolsPtr = (uint8_t *) outBlockOrderSymbolsData.bytes;
   
   if ((0)) {
     //        for (int i = 0; i < outBlockOrderSymbolsNumBytes; i++) {
@@ -420,7 +486,7 @@ const static unsigned int blockDim = 8;
     for ( int blocki = 0; blocki < (blockWidth * blockHeight); blocki++ ) {
       printf("block %5d : ", blocki);
       
-      uint8_t *blockStartPtr = outBlockOrderSymbolsPtr + (blocki * (blockDim * blockDim));
+      uint8_t *blockStartPtr = blockOrderSymbolsPtr + (blocki * (blockDim * blockDim));
       
       for (int i = 0; i < (blockDim * blockDim); i++) {
         printf("%5d ", blockStartPtr[i]);
@@ -431,88 +497,138 @@ const static unsigned int blockDim = 8;
     printf("block order done\n");
   }
   
-  if ((1)) @autoreleasepool {
-    // byte deltas
+  {
+    // byte deltas are calculated from the pre delta copy directly into
+    // outBlockOrderSymbolsPtr. Blocks are partitioned across threads
+    // and nothing is allocated per block.
     
-    NSMutableArray *mBlocks = [NSMutableArray array];
+    const int numBlocks = blockWidth * blockHeight;
+    const int numThreads = ParallelFor_numCores();
     
-    for ( int blocki = 0; blocki < (blockWidth * blockHeight); blocki++ ) {
-      NSMutableData *mRowData = [NSMutableData data];
-      uint8_t *blockStartPtr = outBlockOrderSymbolsPtr + (blocki * (blockDim * blockDim));
-      [mRowData appendBytes:blockStartPtr length:(blockDim * blockDim)];
-      [mBlocks addObject:mRowData];
-    }
+#if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
+    // When saving the first element of a block, the first delta
+    // byte is set to zero. This increases the count of the zero delta
+    // value and reduces the size of the generated tree while
+    // storing the block init value wo a huffman code.
+    NSMutableData *mBlockInitData = [NSMutableData dataWithLength:numBlocks];
+    uint8_t *blockInitPtr = (uint8_t *) mBlockInitData.mutableBytes;
+#else
+    uint8_t *blockInitPtr = NULL;
+#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
     
-    // Convert blocks to deltas
+    // One checksum covers each row of blocks. Delta symbol counts
+    // for the entropy coder are collected in the same pass.
     
-    NSMutableArray *mRowsOfDeltas = [NSMutableArray array];
+    const int numStripes = BlockChecksum_numStripes(numBlocks, blockWidth);
+    NSMutableData *mBlockChecksumData = [NSMutableData dataWithLength:numStripes*sizeof(uint32_t)];
+    NSMutableData *mDeltaHistogramData = [NSMutableData dataWithLength:DELTA_HISTOGRAM_NUM_BINS*sizeof(uint32_t)];
     
-#if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
-    NSMutableData *mBlockInitData = [NSMutableData dataWithCapacity:(blockWidth * blockHeight)];
-#endif
+    int encodeStatus = DeltaHistogram_encodeDeltas((const uint8_t *) _blockOrderSymbolsPreDeltas.bytes,
+                                                   outBlockOrderSymbolsPtr,
+                                                   blockDim * blockDim,
+                                                   numBlocks,
+                                                   blockInitPtr,
+                                                   blockWidth,
+                                                   (uint32_t *) mDeltaHistogramData.mutableBytes,
+                                                   NULL,
+                                                   (uint32_t *) mBlockChecksumData.mutableBytes,
+                                                   numThreads);
+    assert(encodeStatus == 0);
     
-    for ( NSMutableData *blockData in mBlocks ) {
-      NSData *deltasData = [DeltaEncoder encodeByteDeltas:blockData];
-      
-#if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
-      // When saving the first element of a block, do the deltas
-      // first and then pull out the first delta and set the delta
-      // byte to zero. This increases the count of the zero delta
-      // value and reduces the size of the generated tree while
-      // storing the block init value wo a huffman code.
-      {
-        NSMutableData *mDeltasData = [NSMutableData dataWithData:deltasData];
-        
-        uint8_t *bytePtr = mDeltasData.mutableBytes;
-        uint8_t firstByte = bytePtr[0];
-        bytePtr[0] = 0;
-        
-        [mBlockInitData appendBytes:&firstByte length:1];
-        
-        deltasData = [NSData dataWithData:mDeltasData];
-      }
-#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
+    _blockChecksumData = mBlockChecksumData;
+    _deltaHistogramData = mDeltaHistogramData;
+    
+    if ((0)) {
+      const uint32_t *histogramPtr = (const uint32_t *) _deltaHistogramData.bytes;
+      printf("delta entropy : %.3f bits per byte\n", BlockSizeSelect_entropy(histogramPtr));
+    }
+    
+    // Classify each block so that the CPU decoder can fill zero and
+    // constant blocks without a prefix sum. The bitmap is not passed
+    // to the shaders, so the Metal prefix sum still scans every block.
+    
+    {
+      NSMutableData *mBlockClassData = [NSMutableData dataWithLength:BlockClass_numBitmapBytes(numBlocks)];
       
-      [mRowsOfDeltas addObject:deltasData];
+      BlockClass_classifyFrame((const uint8_t *) _blockOrderSymbolsPreDeltas.bytes,
+                               blockDim * blockDim,
+                               numBlocks,
+                               (uint8_t *) mBlockClassData.mutableBytes,
+                               numThreads);
       
-#if defined(DEBUG)
-      // Check that decoding generates the original input
+      _blockClassData = mBlockClassData;
       
-# if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
-      // Undo setting of the first element to zero.
-      {
-        uint8_t *initBytePtr = mBlockInitData.mutableBytes;
-        uint8_t firstByte = initBytePtr[mBlockInitData.length-1];
-        
-        NSMutableData *mDeltasData = [NSMutableData dataWithData:deltasData];
-        uint8_t *deltasBytePtr = mDeltasData.mutableBytes;
-        
-        deltasBytePtr[0] = firstByte;
-        
-        deltasData = [NSData dataWithData:mDeltasData];
+      if ((0)) {
+        int counts[3];
+        BlockClass_counts((const uint8_t *) _blockClassData.bytes, numBlocks, counts);
+        printf("blocks : %d zero, %d constant, %d general\n", counts[BLOCK_CLASS_ZERO], counts[BLOCK_CLASS_CONSTANT], counts[BLOCK_CLASS_GENERAL]);
       }
-# endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
-      
-      NSData *decodedDeltas = [DeltaEncoder decodeByteDeltas:deltasData];
-      NSAssert([decodedDeltas isEqualToData:blockData], @"decoded deltas");
-#endif // DEBUG
     }
     
-    // Write delta values back over outBlockOrderSymbolsPtr memory
+    // Record the block size in the frame header so that a decoder
+    // reads the shape from the stream.
     
-    int outWritei = 0;
+    {
+      FrameHeader header;
+      header.width = width;
+      header.height = height;
+      header.blockSize = blockDim;
+      header.flags = FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS | FRAME_HEADER_FLAG_BLOCK_CLASS_BITMAP;
+#if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
+      header.flags |= FRAME_HEADER_FLAG_BLOCK_INIT_BYTES;
+#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
+      
+      NSMutableData *mHeaderData = [NSMutableData dataWithLength:FRAME_HEADER_NUM_BYTES];
+      FrameHeader_write(&header, (uint8_t *) mHeaderData.mutableBytes);
+      _frameHeaderData = mHeaderData;
+    }
     
-    for ( NSData *deltaRow in mRowsOfDeltas ) {
-      uint8_t *ptr = (uint8_t *) deltaRow.bytes;
-      const int len = (int) deltaRow.length;
-      for ( int i = 0; i < len; i++) {
-        outBlockOrderSymbolsPtr[outWritei++] = ptr[i];
-      }
+#if defined(DEBUG)
+    // Check that decoding generates the original input, the checksum
+    // is verified as each row of blocks is decoded.
+    {
+      FrameHeader header;
+      int status = FrameHeader_read((const uint8_t *) _frameHeaderData.bytes, (int) _frameHeaderData.length, &header);
+      NSAssert(status == 0, @"frame header");
+      
+      const int headerBlockDim = header.blockSize;
+      const int headerNumBlocks = FrameHeader_numBlocksInWidth(&header) * FrameHeader_numBlocksInHeight(&header);
+      NSAssert(headerNumBlocks == numBlocks, @"frame header num blocks");
+      
+      NSData *decodedData = [Util frameArenaDataWithLength:outBlockOrderSymbolsNumBytes];
+      
+      int numFailed = FrameEncoder_decodeDeltasVerified(outBlockOrderSymbolsPtr,
+                                                        (uint8_t *) decodedData.bytes,
+                                                        headerBlockDim * headerBlockDim,
+                                                        headerNumBlocks,
+                                                        blockInitPtr,
+                                                        (const uint8_t *) _blockClassData.bytes,
+                                                        FrameHeader_numBlocksInWidth(&header),
+                                                        (const uint32_t *) _blockChecksumData.bytes,
+                                                        numThreads);
+      
+      NSAssert(numFailed == 0, @"decoded deltas checksum");
+      
+#if !defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
+      // The tuned scan must decode the same bytes
+      
+      NSData *scanData = [Util frameArenaDataWithLength:outBlockOrderSymbolsNumBytes];
+      
+      status = ScanStrategy_run(_scanStrategy,
+                                outBlockOrderSymbolsPtr,
+                                (uint8_t *) scanData.bytes,
+                                headerBlockDim * headerBlockDim,
+                                headerNumBlocks,
+                                numThreads);
+      
+      NSAssert(status == 0 && [scanData isEqualToData:decodedData], @"scan strategy decode");
+#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
     }
+#endif // DEBUG
     
 #if defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
-    _blockInitData = [NSData dataWithData:mBlockInitData];
-#endif
+    _blockInitData = mBlockInitData;
+#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
   }
   
   if ((0)) {
@@ -572,11 +688,52 @@ const static unsigned int blockDim = 8;
   
   // Copy encoded block order bytes
 
-  _outBlockOrderSymbolsData = [NSData dataWithData:outBlockOrderSymbolsData];
+  _outBlockOrderSymbolsData = outBlockOrderSymbolsData;
   
   return;
 }
 
+#if defined(IMPL_ADAPTIVE_BLOCK_SIZE)
+
+// Image order luma for block size scoring. Block order at a block size
+// of 1 is image order, so a streamed or image frame is read with the
+// same stream and fused converter that later write its blocks.
+
+- (NSData*) imageOrderLumaForFrame:(ImageInputFrame*)frame
+{
+  if (frame.inputData != nil) {
+    return frame.inputData;
+  }
+
+  const int width = frame.renderWidth;
+  const int height = frame.renderHeight;
+
+  NSMutableData *lumaData = [NSMutableData dataWithLength:width * height];
+  uint8_t *lumaPtr = (uint8_t *) lumaData.mutableBytes;
+
+  if (frame.inputPath != nil) {
+    ImageStream stream;
+    int status = ImageStream_openTGA(&stream, [frame.inputPath UTF8String], 1);
+    assert(status == 0);
+    assert(stream.width == width && stream.height == height);
+
+    status = ImageStream_splitIntoBlocks(&stream, 1, lumaPtr, 0);
+    assert(status == 0);
+
+    ImageStream_close(&stream);
+  } else {
+    assert(frame.inputImage != nil);
+
+    [ImageInputFrame convertImage:frame.inputImage
+               toLumaBlocksOfSize:1
+                         outBytes:lumaPtr];
+  }
+
+  return lumaData;
+}
+
+#endif // IMPL_ADAPTIVE_BLOCK_SIZE
+
 // Initialize with the MetalKit view from which we'll obtain our metal device
 
 - (nonnull instancetype)initWithMetalKitView:(nonnull MTKView *)mtkView
@@ -644,6 +801,7 @@ const static unsigned int blockDim = 8;
       //hcfg = TEST_IMAGE2;
       //hcfg = TEST_IMAGE3;
       hcfg = TEST_IMAGE4;
+      //hcfg = TEST_IMAGE_TGA_STREAM;
       
       ImageInputFrame *renderFrame = [ImageInputFrame frameForConfig:hcfg];
       
@@ -652,6 +810,43 @@ const static unsigned int blockDim = 8;
       unsigned int width = renderFrame.renderWidth;
       unsigned int height = renderFrame.renderHeight;
       
+      blockDim = defaultBlockDim;
+      
+#if defined(IMPL_ADAPTIVE_BLOCK_SIZE)
+      {
+        NSData *lumaData = [self imageOrderLumaForFrame:renderFrame];
+        
+        BlockSizeCalibration calibration;
+        int status = BlockSizeSelect_calibrate(&calibration, 5);
+        assert(status == 0);
+        
+        BlockSizeSelectParams params = BlockSizeSelect_defaultParams();
+        // The decode cost is calibrated on the CPU, so spread it over
+        // the CPU cores that time was measured on. Dividing a CPU time
+        // by the GPU thread count would make the decode term vanish and
+        // the choice would only follow size, there is no GPU calibration.
+        params.numDecodeLanes = ParallelFor_numCores();
+#if !defined(IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING)
+        params.useBlockInitBytes = 0;
+        params.blockOverheadBytes = 4;
+#endif // IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING
+        
+        BlockSizeScore scores[BLOCK_SIZE_SELECT_NUM_SIZES];
+        
+        blockDim = BlockSizeSelect_chooseForFrame((const uint8_t *) lumaData.bytes,
+                                                  width, height,
+                                                  &params, &calibration, scores);
+        
+        for ( int sizei = 0; sizei < BLOCK_SIZE_SELECT_NUM_SIZES; sizei++ ) {
+          BlockSizeScore *score = &scores[sizei];
+          printf("block size %2d : %.3f bits/byte, %.0f bytes, %.0f ns decode, cost %.0f\n",
+                 score->blockSize, score->entropyBitsPerByte, score->estimatedBytes, score->estimatedDecodeNs, score->cost);
+        }
+        
+        printf("selected block size %d x %d\n", blockDim, blockDim);
+      }
+#endif // IMPL_ADAPTIVE_BLOCK_SIZE
+      
       unsigned int blockWidth = width / blockDim;
       if ((width % blockDim) != 0) {
         blockWidth += 1;
@@ -662,6 +857,33 @@ const static unsigned int blockDim = 8;
         blockHeight += 1;
       }
       
+#if defined(DEBUG)
+      // Load the tuned CPU scan for this geometry, tuning is only
+      // done the first time a geometry is seen on this host. The app
+      // decodes on the GPU and has no release CPU decode, so this is
+      // diagnostic only: the DEBUG cross check runs the tuned scan
+      // against the reference decode. mpsd -k auto is the CPU decode
+      // that uses the tuned scan in release builds.
+      
+      {
+        NSString *cachesDir = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+        NSString *profilePath = [cachesDir stringByAppendingPathComponent:@"scan_strategy_profile.txt"];
+        
+        ScanStrategyProfile profile;
+        ScanStrategy_loadProfile(&profile, [profilePath UTF8String]);
+        
+        const int numEntries = profile.numEntries;
+        
+        _scanStrategy = ScanStrategy_select(&profile, blockDim * blockDim, blockWidth * blockHeight, ParallelFor_numCores());
+        
+        if (profile.numEntries != numEntries) {
+          ScanStrategy_saveProfile(&profile, [profilePath UTF8String]);
+        }
+        
+        NSLog(@"scan strategy %s", ScanStrategy_name(_scanStrategy));
+      }
+#endif // DEBUG
+      
       self->renderWidth = width;
       self->renderHeight = height;
       
@@ -680,6 +902,7 @@ const static unsigned int blockDim = 8;
         ptr->height = height;
         ptr->blockWidth = blockWidth;
         ptr->blockHeight = blockHeight;
+        ptr->blockDim = blockDim;
       }
       
       // Allocate prefix sum textures
@@ -916,6 +1139,19 @@ const static unsigned int blockDim = 8;
 //    return;
 //  }
   
+#if defined(IMPL_SCAN_ROOFLINE)
+  {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+      [self.mpsrc analyzePrefixSum:self.mrc
+                       renderFrame:self.mpsRenderFrame
+                   blockOrderBytes:(const uint8_t *)_outBlockOrderSymbolsData.bytes
+                       isExclusive:FALSE
+                        numRepeats:10];
+    });
+  }
+#endif // IMPL_SCAN_ROOFLINE
+  
   // Create a new command buffer
   
   id <MTLCommandBuffer> commandBuffer = [self.mrc.commandQueue commandBuffer];
@@ -1061,13 +1297,26 @@ const static unsigned int blockDim = 8;
       [self dump8BitTexture:outputTexture label:@"outputTexture"];
       }
       
-      // FIXME: compare to original input?
-      
-      uint8_t *bytePtr = (uint8_t *) _blockOrderSymbolsPreDeltas.bytes;
-      
       NSData *textureData = [self.class getTextureBytes:outputTexture];
       uint8_t *texturePtr = (uint8_t*) textureData.bytes;
       
+      // Verify GPU output against the per block row checksums
+      
+      {
+        int stripei = FrameEncoder_verifyChecksums(texturePtr,
+                                                   blockDim * blockDim,
+                                                   renderBlockWidth * renderBlockHeight,
+                                                   renderBlockWidth,
+                                                   (const uint32_t *) _blockChecksumData.bytes);
+        
+        if (stripei != -1) {
+          printf("prefix sum output checksum mismatch in block row %d\n", stripei);
+          assert(0);
+        }
+      }
+      
+      uint8_t *bytePtr = (uint8_t *) _blockOrderSymbolsPreDeltas.bytes;
+      
       assert(_blockOrderSymbolsPreDeltas.length == textureData.length);
       int cmp = memcmp(bytePtr, texturePtr, _blockOrderSymbolsPreDeltas.length);
       assert(cmp == 0);
@@ -1155,9 +1404,11 @@ const static unsigned int blockDim = 8;
         fprintf(stdout, "done\n");
       }
       
-      // Compare output to expected output
+      // Compare output to expected output, a streamed or image input
+      // frame has no image order copy to compare against, its block
+      // order output was already compared to the pre delta bytes.
       
-      if ((1)) {
+      if (_imageInputBytes != nil) {
         NSData *expectedData = _imageInputBytes;
         assert(expectedData);
         uint8_t *expectedDataPtr = (uint8_t *) expectedData.bytes;
@@ -92,6 +92,9 @@ typedef struct
   uint16_t height;
   uint16_t blockWidth;
   uint16_t blockHeight;
+  // Width and height of one square block
+  uint16_t blockDim;
+  uint16_t _dummy;
 } RenderTargetDimensionsAndBlockDimensionsUniform;
 
 typedef enum AAPLHuffmanTextureIndex
@@ -92,7 +92,7 @@ samplingCropShader(RasterizerData in [[stage_in]],
   // uint coords_to_offset(const ushort width, const ushort2 coords)
   // ushort2 offset_to_coords(const ushort blockDim, const uint offset)
   
-  const ushort blockDim = 8;
+  const ushort blockDim = rtd.blockDim;
   
   ushort2 blockRoot = gid / blockDim;
   uint blocki = coords_to_offset(rtd.blockWidth, blockRoot);
@@ -21,6 +21,7 @@ typedef enum {
   TEST_IMAGE2,
   TEST_IMAGE3,
   TEST_IMAGE4,
+  TEST_IMAGE_TGA_STREAM,
 } ImageInputFrameConfig;
 
 // Header shared between C code here, which executes Metal API commands, and .metal files, which
@@ -37,10 +38,27 @@ typedef enum {
 
 @property (nonatomic, copy) NSData *inputData;
 
+// When set, the input is streamed row by row from this TGA file
+// directly into block order and inputData is nil.
+
+@property (nonatomic, copy) NSString *inputPath;
+
+// When set, the input is converted from this image to luma directly
+// into block order and inputData is nil.
+
+@property (nonatomic, strong) UIImage *inputImage;
+
 @property (nonatomic, assign) BOOL capture;
 
 // Get a specific configuration given a HuffRenderFrameConfig identifier
 
 + (ImageInputFrame*) frameForConfig:(ImageInputFrameConfig)config;
 
+// Convert image to zero padded block order luma, outBytes must hold
+// every block needed to cover the image at blockSize.
+
++ (void) convertImage:(UIImage *)image
+   toLumaBlocksOfSize:(int)blockSize
+             outBytes:(uint8_t *)outBytes;
+
 @end
@@ -4,6 +4,9 @@
 
 #include <stdlib.h>
 
+#include "image_stream.h"
+#include "luma_convert.h"
+
 @implementation ImageInputFrame
 
 // Convert values to a NSData that contains bytes and append to array
@@ -65,38 +68,118 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
 
 + (NSData*) convertImageToGrayScale:(UIImage *)image
 {
+  CGImageRef imageRef = [image CGImage];
+  
+  // Pixel dimensions, image.size is in points
+  const int width = (int) CGImageGetWidth(imageRef);
+  const int height = (int) CGImageGetHeight(imageRef);
+  
   // Create image rectangle with current image width/height
-  CGRect imageRect = CGRectMake(0, 0, image.size.width, image.size.height);
+  CGRect imageRect = CGRectMake(0, 0, width, height);
   
   // Grayscale color space
   CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceGray();
   
   // Create bitmap content with current image size and grayscale colorspace
-  CGContextRef context = CGBitmapContextCreate(nil, image.size.width, image.size.height, 8, 0, colorSpace, kCGImageAlphaNone);
+  CGContextRef context = CGBitmapContextCreate(nil, width, height, 8, width, colorSpace, kCGImageAlphaNone);
   
   // Draw image into current context, with specified rectangle
   // using previously defined context (with grayscale colorspace)
-  CGContextDrawImage(context, imageRect, [image CGImage]);
-  
-  // Create bitmap image info from pixel data in current context
-  //CGImageRef imageRef = CGBitmapContextCreateImage(context);
-  
-  // Create a new UIImage object
-  //UIImage *newImage = [UIImage imageWithCGImage:imageRef];
+  CGContextDrawImage(context, imageRect, imageRef);
   
-  NSMutableData *mData = [NSMutableData dataWithBytes:CGBitmapContextGetData(context) length:image.size.width*image.size.height];
+  NSMutableData *mData = [NSMutableData dataWithBytes:CGBitmapContextGetData(context) length:width*height];
   
   // Release colorspace, context and bitmap information
   CGColorSpaceRelease(colorSpace);
   CGContextRelease(context);
-  //CFRelease(imageRef);
-  
-  // Return the new grayscale image
-  //return newImage;
   
   return [NSData dataWithData:mData];
 }
 
+// Convert an image to zero padded block order luma without drawing with
+// CoreGraphics. Decoded 8 bit pixels in a monochrome color space are split
+// into blocks as is and 32 bit BGRA or RGBA pixels are converted with BT.601
+// weights directly into blocks with LumaConvert_BGRA8FrameToBlocks, so the
+// image is never held as image order luma. Any other pixel layout, including
+// 8 bit indexed color, falls back to convertImageToGrayScale and a split.
+
++ (void) convertImage:(UIImage *)image
+   toLumaBlocksOfSize:(int)blockSize
+             outBytes:(uint8_t *)outBytes
+{
+  CGImageRef imageRef = [image CGImage];
+  
+  const int width = (int) CGImageGetWidth(imageRef);
+  const int height = (int) CGImageGetHeight(imageRef);
+  const int bytesPerRow = (int) CGImageGetBytesPerRow(imageRef);
+  const int bitsPerPixel = (int) CGImageGetBitsPerPixel(imageRef);
+  
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+  
+  CGBitmapInfo bitmapInfo = CGImageGetBitmapInfo(imageRef);
+  CGBitmapInfo byteOrder = bitmapInfo & kCGBitmapByteOrderMask;
+  CGImageAlphaInfo alphaInfo = CGImageGetAlphaInfo(imageRef);
+  CGColorSpaceModel colorModel = CGColorSpaceGetModel(CGImageGetColorSpace(imageRef));
+  
+  BOOL isAlphaFirst = (alphaInfo == kCGImageAlphaPremultipliedFirst ||
+                       alphaInfo == kCGImageAlphaFirst ||
+                       alphaInfo == kCGImageAlphaNoneSkipFirst);
+  BOOL isAlphaLast = (alphaInfo == kCGImageAlphaPremultipliedLast ||
+                      alphaInfo == kCGImageAlphaLast ||
+                      alphaInfo == kCGImageAlphaNoneSkipLast);
+  
+  BOOL isGray = (bitsPerPixel == 8 && CGImageGetBitsPerComponent(imageRef) == 8 &&
+                 colorModel == kCGColorSpaceModelMonochrome);
+  
+  LumaWeights weights = LumaWeights_BT601();
+  
+  if (isGray) {
+    // Already 8 bit gray
+  } else if (bitsPerPixel == 32 && colorModel == kCGColorSpaceModelRGB &&
+             byteOrder == kCGBitmapByteOrder32Little && isAlphaFirst) {
+    // BGRA in memory
+  } else if (bitsPerPixel == 32 && colorModel == kCGColorSpaceModelRGB &&
+             byteOrder != kCGBitmapByteOrder32Little && isAlphaLast) {
+    // RGBA in memory
+    weights = LumaWeights_swapRB(weights);
+  } else {
+    NSData *grayData = [self convertImageToGrayScale:image];
+    
+    [Util splitIntoBlocksOfSize:blockSize
+                        inBytes:(uint8_t *) grayData.bytes
+                       outBytes:outBytes
+                          width:width
+                         height:height
+               numBlocksInWidth:numBlocksInWidth
+              numBlocksInHeight:numBlocksInHeight
+                      zeroValue:0];
+    return;
+  }
+  
+  CFDataRef pixelsRef = CGDataProviderCopyData(CGImageGetDataProvider(imageRef));
+  const uint8_t *pixelsPtr = CFDataGetBytePtr(pixelsRef);
+  
+  if (isGray) {
+    const int numBlockRowBytes = BlockSplit_blockRowNumBytes(blockSize, numBlocksInWidth);
+    
+    for ( int row = 0; row < (numBlocksInHeight * blockSize); row++ ) {
+      uint8_t *blockRowBytes = outBytes + ((row / blockSize) * numBlockRowBytes);
+      
+      if (row < height) {
+        BlockSplit_row(pixelsPtr + (row * bytesPerRow), width, blockSize, numBlocksInWidth,
+                       row % blockSize, blockRowBytes, 0);
+      } else {
+        BlockSplit_zeroRow(blockSize, numBlocksInWidth, row % blockSize, blockRowBytes, 0);
+      }
+    }
+  } else {
+    LumaConvert_BGRA8FrameToBlocks(pixelsPtr, width, height, bytesPerRow, weights, blockSize, outBytes, 0);
+  }
+  
+  CFRelease(pixelsRef);
+}
+
 + (ImageInputFrame*) frameForConfig:(ImageInputFrameConfig)config
 {
   
@@ -512,7 +595,7 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
     }
       
     case TEST_IMAGE1: {
-      // Load PNG image, convert to grayscale, load bytes
+      // Load PNG image, converted to grayscale when split into blocks
       
       NSString *resFilename = @"Image.png";
       NSString* path = [[NSBundle mainBundle] pathForResource:resFilename ofType:nil];
@@ -521,18 +604,18 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
       UIImage *img = [UIImage imageWithContentsOfFile:path];
       assert(img);
       
-      // Convert PNG image
+      // Luma is converted straight into blocks in setupBlockEncoding
       
-      renderFrame.renderWidth = img.size.width;
-      renderFrame.renderHeight = img.size.height;
+      renderFrame.renderWidth = (int) CGImageGetWidth([img CGImage]);
+      renderFrame.renderHeight = (int) CGImageGetHeight([img CGImage]);
       
-      renderFrame.inputData = [self convertImageToGrayScale:img];
+      renderFrame.inputImage = img;
       
       break;
     }
 
     case TEST_IMAGE2: {
-      // Load PNG image, convert to grayscale, load bytes
+      // Load PNG image, converted to grayscale when split into blocks
       
       NSString *resFilename = @"ImageHuge.png";
       NSString* path = [[NSBundle mainBundle] pathForResource:resFilename ofType:nil];
@@ -541,18 +624,18 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
       UIImage *img = [UIImage imageWithContentsOfFile:path];
       assert(img);
       
-      // Convert PNG image
+      // Luma is converted straight into blocks in setupBlockEncoding
       
-      renderFrame.renderWidth = img.size.width;
-      renderFrame.renderHeight = img.size.height;
+      renderFrame.renderWidth = (int) CGImageGetWidth([img CGImage]);
+      renderFrame.renderHeight = (int) CGImageGetHeight([img CGImage]);
       
-      renderFrame.inputData = [self convertImageToGrayScale:img];
+      renderFrame.inputImage = img;
       
       break;
     }
 
     case TEST_IMAGE3: {
-      // Load PNG image, convert to grayscale, load bytes
+      // Load PNG image, converted to grayscale when split into blocks
       
       NSString *resFilename = @"ImageIpadSize.png";
       NSString* path = [[NSBundle mainBundle] pathForResource:resFilename ofType:nil];
@@ -561,12 +644,12 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
       UIImage *img = [UIImage imageWithContentsOfFile:path];
       assert(img);
       
-      // Convert PNG image
+      // Luma is converted straight into blocks in setupBlockEncoding
       
-      renderFrame.renderWidth = img.size.width;
-      renderFrame.renderHeight = img.size.height;
+      renderFrame.renderWidth = (int) CGImageGetWidth([img CGImage]);
+      renderFrame.renderHeight = (int) CGImageGetHeight([img CGImage]);
       
-      renderFrame.inputData = [self convertImageToGrayScale:img];
+      renderFrame.inputImage = img;
       
       break;
     }
@@ -581,18 +664,40 @@ appendXYCoordPixelsAsData(NSMutableArray * mArr, NSArray * values)
       UIImage *img = [UIImage imageWithContentsOfFile:path];
       assert(img);
       
-      // Convert PNG image
+      // Luma is converted straight into blocks in setupBlockEncoding
+      
+      renderFrame.renderWidth = (int) CGImageGetWidth([img CGImage]);
+      renderFrame.renderHeight = (int) CGImageGetHeight([img CGImage]);
+      
+      renderFrame.inputImage = img;
+      
+      break;
+    }
+      
+    case TEST_IMAGE_TGA_STREAM: {
+      // Read only the TGA header here, rows are converted to grayscale
+      // and split into blocks as they are read in setupBlockEncoding
+      
+      NSString *resFilename = @"Image.tga";
+      NSString* path = [[NSBundle mainBundle] pathForResource:resFilename ofType:nil];
+      NSAssert(path, @"path is nil");
+      
+      ImageStream stream;
+      int status = ImageStream_openTGA(&stream, [path UTF8String], 0);
+      assert(status == 0);
+      
+      renderFrame.renderWidth = stream.width;
+      renderFrame.renderHeight = stream.height;
       
-      renderFrame.renderWidth = img.size.width;
-      renderFrame.renderHeight = img.size.height;
+      ImageStream_close(&stream);
       
-      renderFrame.inputData = [self convertImageToGrayScale:img];
+      renderFrame.inputPath = path;
       
       break;
     }
   }
   
-  assert(renderFrame.inputData);
+  assert(renderFrame.inputData || renderFrame.inputPath || renderFrame.inputImage);
   
   renderFrame.capture = TRUE;
   //renderFrame.capture = FALSE;
@@ -75,4 +75,15 @@
              renderFrame:(MetalPrefixSumRenderFrame*)renderFrame
              isExclusive:(BOOL)isExclusive;
 
+// Render each reduce and sweep pass in its own command buffer and
+// print per level memory traffic and timings against the measured
+// bandwidth, then the same report for the CPU equivalents run on
+// blockOrderBytes. See scan_roofline.h.
+
+- (void) analyzePrefixSum:(MetalRenderContext*)mrc
+              renderFrame:(MetalPrefixSumRenderFrame*)renderFrame
+          blockOrderBytes:(const uint8_t*)blockOrderBytes
+              isExclusive:(BOOL)isExclusive
+               numRepeats:(int)numRepeats;
+
 @end
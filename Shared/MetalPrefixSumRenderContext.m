@@ -18,6 +18,8 @@
 #import "MetalRenderContext.h"
 #import "MetalPrefixSumRenderFrame.h"
 
+#include "scan_roofline.h"
+
 // Private API
 
 @interface MetalPrefixSumRenderContext ()
@@ -616,4 +618,152 @@
   return;
 }
 
+// Commit a command buffer, wait for it and return the GPU time in ns
+
+- (double) commitAndWaitNs:(id<MTLCommandBuffer>)commandBuffer
+{
+  const double startNs = BlockSizeSelect_nowNs();
+  
+  [commandBuffer commit];
+  [commandBuffer waitUntilCompleted];
+  
+  if (@available(macOS 10.15, iOS 10.3, tvOS 10.3, *)) {
+    return (commandBuffer.GPUEndTime - commandBuffer.GPUStartTime) * 1.0e9;
+  }
+  
+  // Host time includes the commit overhead
+  return BlockSizeSelect_nowNs() - startNs;
+}
+
+// Best of numRepeats blit copies of numBytes between two private
+// buffers, returns read plus write bytes per ns (GB/s).
+
+- (double) measureBandwidth:(MetalRenderContext*)mrc
+                   numBytes:(int)numBytes
+                 numRepeats:(int)numRepeats
+{
+  id<MTLBuffer> srcBuffer = [mrc.device newBufferWithLength:numBytes options:MTLResourceStorageModePrivate];
+  id<MTLBuffer> dstBuffer = [mrc.device newBufferWithLength:numBytes options:MTLResourceStorageModePrivate];
+  
+  double bestNs = 0.0;
+  
+  for (int i = 0; i < numRepeats; i++) {
+    id<MTLCommandBuffer> commandBuffer = [mrc.commandQueue commandBuffer];
+    commandBuffer.label = @"RooflineBandwidth";
+    
+    id<MTLBlitCommandEncoder> blitEncoder = [commandBuffer blitCommandEncoder];
+    [blitEncoder copyFromBuffer:srcBuffer sourceOffset:0 toBuffer:dstBuffer destinationOffset:0 size:numBytes];
+    [blitEncoder endEncoding];
+    
+    double elapsedNs = [self commitAndWaitNs:commandBuffer];
+    
+    if (i == 0 || elapsedNs < bestNs) {
+      bestNs = elapsedNs;
+    }
+  }
+  
+  return (bestNs > 0.0) ? ((2.0 * numBytes) / bestNs) : 0.0;
+}
+
+// Render each reduce and sweep pass of renderPrefixSum in its own
+// command buffer numRepeats times and print the roofline table for
+// the passes, then the same table for the CPU schedule and the CPU
+// scan strategies run on blockOrderBytes.
+
+- (void) analyzePrefixSum:(MetalRenderContext*)mrc
+              renderFrame:(MetalPrefixSumRenderFrame*)renderFrame
+          blockOrderBytes:(const uint8_t*)blockOrderBytes
+              isExclusive:(BOOL)isExclusive
+               numRepeats:(int)numRepeats
+{
+  int blockSize = 1;
+  while ((blockSize * blockSize) < (int) renderFrame.blockDim) {
+    blockSize *= 2;
+  }
+  
+  ScanRooflineSchedule schedule;
+  
+  if (ScanRoofline_buildSchedule(&schedule, (int) renderFrame.width, (int) renderFrame.height, blockSize, 1, isExclusive) != 0) {
+    return;
+  }
+  
+  // Schedule buffer ids in the order the textures were created
+  
+  NSMutableArray *textures = [NSMutableArray array];
+  [textures addObject:renderFrame.inputBlockOrderTexture];
+  [textures addObject:renderFrame.outputBlockOrderTexture];
+  [textures addObject:renderFrame.zeroTexture];
+  
+  for (int i = 0; i < renderFrame.reduceTextures.count; i++) {
+    [textures addObject:renderFrame.reduceTextures[i]];
+    [textures addObject:renderFrame.sweepTextures[i]];
+  }
+  
+#if defined(DEBUG)
+  assert(textures.count == schedule.numBuffers);
+  
+  for (int i = 0; i < schedule.numBuffers; i++) {
+    id<MTLTexture> txt = textures[i];
+    assert(txt.width == schedule.bufferWidth[i]);
+    assert(txt.height == schedule.bufferHeight[i]);
+  }
+#endif // DEBUG
+  
+  for (int li = 0; li < schedule.numLevels; li++) {
+    ScanRooflineLevel *rl = &schedule.levels[li];
+    
+    for (int i = 0; i < numRepeats; i++) {
+      id<MTLCommandBuffer> commandBuffer = [mrc.commandQueue commandBuffer];
+      commandBuffer.label = @"RooflineLevel";
+      
+      if (rl->kind == SCAN_ROOFLINE_KIND_REDUCE) {
+        [self renderPrefixSumReduce:mrc
+                      commandBuffer:commandBuffer
+                        renderFrame:renderFrame
+                       inputTexture:textures[rl->inBuffer]
+                      outputTexture:textures[rl->outBuffer]
+               sameDimTargetTexture:textures[rl->outBuffer + 1]
+                              level:rl->level];
+      } else {
+        [self renderPrefixSumSweep:mrc
+                     commandBuffer:commandBuffer
+                       renderFrame:renderFrame
+                     inputTexture1:textures[rl->inBuffer]
+                     inputTexture2:textures[rl->in2Buffer]
+                     outputTexture:textures[rl->outBuffer]
+                             level:rl->level
+                       isExclusive:(rl->kind == SCAN_ROOFLINE_KIND_SWEEP)];
+      }
+      
+      double elapsedNs = [self commitAndWaitNs:commandBuffer];
+      
+      if (i == 0 || elapsedNs < rl->measuredNs) {
+        rl->measuredNs = elapsedNs;
+      }
+    }
+  }
+  
+  double gpuBytesPerNs = [self measureBandwidth:mrc numBytes:(64 * 1024 * 1024) numRepeats:numRepeats];
+  
+  ScanRoofline_print(stdout, &schedule, gpuBytesPerNs, 0.0);
+  
+  // CPU equivalents of the same schedule
+  
+  ScanRooflineSchedule cpuSchedule;
+  
+  if (ScanRoofline_buildSchedule(&cpuSchedule, (int) renderFrame.width, (int) renderFrame.height, blockSize, 0, isExclusive) != 0) {
+    return;
+  }
+  
+  if (ScanRoofline_timeCPUSchedule(&cpuSchedule, blockOrderBytes, NULL, numRepeats) != 0 ||
+      ScanRoofline_timeScanStrategies(&cpuSchedule, blockOrderBytes, ParallelFor_numCores(), numRepeats) != 0) {
+    return;
+  }
+  
+  double cpuBytesPerNs = ScanRoofline_measureBandwidth(64 * 1024 * 1024, numRepeats);
+  double cpuOpsPerNs = ScanRoofline_measurePeakOps(ParallelFor_numCores(), numRepeats);
+  
+  ScanRoofline_print(stdout, &cpuSchedule, cpuBytesPerNs, cpuOpsPerNs);
+}
+
 @end
@@ -307,4 +307,13 @@ struct
 
 + (NSString*) formatNumbersAsString:(NSArray*)numbers;
 
+// Return a buffer of at least length bytes from the shared frame arena.
+// The data is immutable so that it always wraps the 64 byte aligned
+// arena pointer, the caller owns the bytes and writes them through a
+// cast of bytes. The buffer goes back to the arena when the data is
+// deallocated. The contents are not cleared, so the caller must write
+// every byte.
+
++ (NSData*) frameArenaDataWithLength:(NSUInteger)length;
+
 @end
@@ -6,6 +6,12 @@
 
 #import "Util.h"
 
+#include "frame_arena.h"
+
+// Back frame arena buffers with huge pages when available
+
+//#define IMPL_FRAME_ARENA_HUGE_PAGES
+
 @implementation Util
 
 // Given a flat array of elements, split the values up into blocks of length elements.
@@ -255,16 +261,6 @@
   
   memset(outBytes, zeroValue, numBytesInAllBlocks);
   
-  // This array of pointers points to the next available address
-  // for each block. As a block is filled in row by row this
-  // address is updated to account for the row that was written.
-  
-  uint8_t **blockStartPtrs = (uint8_t **) malloc(numBlocksInWidth*numBlocksInHeight*sizeof(uint8_t*));
-  
-  for (int blocki = 0; blocki < blockMax; blocki++) {
-    blockStartPtrs[blocki] = &outBytes[blocki * numBytesInOneBlock];
-  }
-  
   // Iterate over each row and then over a block worth of pixels
   
   uint32_t offset = 0;
@@ -286,7 +282,9 @@
         NSLog(@"row %d col %d = blocki %d", rowi, columnBlocki*blockSize, blocki);
       }
       
-      uint8_t *blockOutPtr = blockStartPtrs[blocki];
+      // Row within the block is (blockSize - rowCountdown)
+      
+      uint8_t *blockOutPtr = &outBytes[(blocki * numBytesInOneBlock) + ((blockSize - rowCountdown) * blockSize)];
       
       uint32_t numBytesToCopy = blockSize;
       
@@ -310,15 +308,9 @@
       }
       
       offset += numBytesToCopy;
-      
-      blockOutPtr += blockSize;
-      
-      blockStartPtrs[blocki] = blockOutPtr;
     }
   }
   
-  free(blockStartPtrs);
-  
   return;
 }
 
@@ -746,6 +738,47 @@
   return [numbers componentsJoinedByString:@","];
 }
 
+// Shared by every encode and decode path, buffers are recycled across
+// frames and threads.
+
+static FrameArena sharedFrameArena;
+
++ (NSData*) frameArenaDataWithLength:(NSUInteger)length
+{
+  static dispatch_once_t onceToken;
+  
+  dispatch_once(&onceToken, ^{
+#if defined(IMPL_FRAME_ARENA_HUGE_PAGES)
+    const int useHugePages = 1;
+#else
+    const int useHugePages = 0;
+#endif // IMPL_FRAME_ARENA_HUGE_PAGES
+    int status = FrameArena_init(&sharedFrameArena, useHugePages);
+    assert(status == 0);
+  });
+  
+  uint8_t *bytes = FrameArena_alloc(&sharedFrameArena, length);
+  
+  if (bytes == NULL) {
+    void *ptr = NULL;
+    
+    if (posix_memalign(&ptr, FRAME_ARENA_ALIGNMENT, length) != 0) {
+      return nil;
+    }
+    
+    return [[NSData alloc] initWithBytesNoCopy:ptr length:length freeWhenDone:YES];
+  }
+  
+  // Immutable data always keeps the NoCopy pointer, mutable data is
+  // free to copy it and would lose both the alignment and recycling.
+  
+  return [[NSData alloc] initWithBytesNoCopy:bytes
+                                      length:length
+                                 deallocator:^(void *ptr, NSUInteger numBytes) {
+                                   FrameArena_release(&sharedFrameArena, (uint8_t *) ptr);
+                                 }];
+}
+
 @end
 
 
@@ -0,0 +1,163 @@
+//
+//  block_class.h
+//
+//  MIT Licensed
+//
+//  Inline methods that classify each block of block order bytes as
+//  all zero, constant, or general and pack the result into a bitmap
+//  with 2 bits per block. All zero and constant blocks have all zero
+//  deltas after the first byte, so a decoder can fill these blocks
+//  with a single value and only run the prefix sum on general blocks.
+//  The skip is done by the CPU decode in frame_encoder.h, the Metal
+//  reduce and sweep shaders do not read the bitmap.
+//  Flat screen content like UI backgrounds and letterboxing is mostly
+//  made up of zero and constant blocks.
+
+#ifndef _block_class_h
+#define _block_class_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLOCK_CLASS_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK_CLASS_SSE2 1
+#endif
+
+#include "parallel_for.h"
+
+// Every byte in the block is zero
+#define BLOCK_CLASS_ZERO 0
+// Every byte in the block is equal to the first byte
+#define BLOCK_CLASS_CONSTANT 1
+// Any other block, decoded with a prefix sum
+#define BLOCK_CLASS_GENERAL 2
+
+static inline
+int BlockClass_numBitmapBytes(int numBlocks)
+{
+  return (numBlocks + 3) / 4;
+}
+
+static inline
+int BlockClass_get(const uint8_t *classBitmap, int blocki)
+{
+  return (classBitmap[blocki >> 2] >> ((blocki & 0x3) * 2)) & 0x3;
+}
+
+// Classify one block of numBytesInBlock bytes
+
+static inline
+int BlockClass_classify(const uint8_t *blockBytes, int numBytesInBlock)
+{
+  const uint8_t first = blockBytes[0];
+  int i = 0;
+
+#if defined(BLOCK_CLASS_SSE2)
+  const __m128i v0 = _mm_set1_epi8((char) first);
+  __m128i diff = _mm_setzero_si128();
+
+  for ( ; (i + 16) <= numBytesInBlock; i += 16 ) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (blockBytes + i));
+    diff = _mm_or_si128(diff, _mm_xor_si128(x, v0));
+  }
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+    return BLOCK_CLASS_GENERAL;
+  }
+#elif defined(BLOCK_CLASS_NEON)
+  const uint8x16_t v0 = vdupq_n_u8(first);
+  uint8x16_t diff = vdupq_n_u8(0);
+
+  for ( ; (i + 16) <= numBytesInBlock; i += 16 ) {
+    uint8x16_t x = vld1q_u8(blockBytes + i);
+    diff = vorrq_u8(diff, veorq_u8(x, v0));
+  }
+
+  uint64x2_t diff64 = vreinterpretq_u64_u8(diff);
+  if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) {
+    return BLOCK_CLASS_GENERAL;
+  }
+#endif
+
+  for ( ; i < numBytesInBlock; i++ ) {
+    if (blockBytes[i] != first) {
+      return BLOCK_CLASS_GENERAL;
+    }
+  }
+
+  return (first == 0) ? BLOCK_CLASS_ZERO : BLOCK_CLASS_CONSTANT;
+}
+
+typedef struct {
+  const uint8_t *blockBytes;
+  int numBytesInBlock;
+  int numBlocks;
+  uint8_t *classBitmap;
+} BlockClassContext;
+
+// Each work item is one bitmap byte so that threads never write
+// to the same byte.
+
+static inline
+void BlockClass_classifyChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  BlockClassContext *bcc = (BlockClassContext *) ctx;
+
+  for ( int bitmapi = start; bitmapi < end; bitmapi++ ) {
+    uint8_t bits = 0;
+
+    for ( int j = 0; j < 4; j++ ) {
+      const int blocki = (bitmapi * 4) + j;
+      if (blocki >= bcc->numBlocks) {
+        break;
+      }
+      int blockClass = BlockClass_classify(bcc->blockBytes + (blocki * bcc->numBytesInBlock), bcc->numBytesInBlock);
+      bits |= (uint8_t) (blockClass << (j * 2));
+    }
+
+    bcc->classBitmap[bitmapi] = bits;
+  }
+}
+
+// Classify numBlocks blocks of block order bytes and write
+// BlockClass_numBitmapBytes(numBlocks) bytes to classBitmap.
+
+static inline
+void BlockClass_classifyFrame(const uint8_t *blockBytes,
+                              int numBytesInBlock,
+                              int numBlocks,
+                              uint8_t *classBitmap,
+                              int numThreads)
+{
+  BlockClassContext bcc;
+  bcc.blockBytes = blockBytes;
+  bcc.numBytesInBlock = numBytesInBlock;
+  bcc.numBlocks = numBlocks;
+  bcc.classBitmap = classBitmap;
+
+  ParallelFor_run(numThreads, BlockClass_numBitmapBytes(numBlocks), BlockClass_classifyChunk, &bcc);
+}
+
+// Count the blocks of each class, counts must hold 3 values
+
+static inline
+void BlockClass_counts(const uint8_t *classBitmap, int numBlocks, int *counts)
+{
+  counts[BLOCK_CLASS_ZERO] = 0;
+  counts[BLOCK_CLASS_CONSTANT] = 0;
+  counts[BLOCK_CLASS_GENERAL] = 0;
+
+  for ( int blocki = 0; blocki < numBlocks; blocki++ ) {
+    counts[BlockClass_get(classBitmap, blocki)] += 1;
+  }
+}
+
+#endif // _block_class_h
@@ -0,0 +1,304 @@
+//
+//  block_size_select.h
+//
+//  MIT Licensed
+//
+//  Inline methods that choose a block size for a frame. Each candidate
+//  square block size from 2x2 to 32x32 is scored with a cost model:
+//
+//  cost = estimatedBytes + (bytesPerDecodeNs * estimatedDecodeNs)
+//
+//  estimatedBytes is the zeroth order entropy of the block deltas plus
+//  a fixed number of bytes of overhead for each block (a block start
+//  offset and optional init byte). estimatedDecodeNs comes from a
+//  calibration table that is filled in by timing the CPU block decoder
+//  once per process, with blocks spread over numDecodeLanes parallel
+//  decoders. Small blocks reset the delta predictor more often
+//  and pay more per block overhead, while large blocks add more zero
+//  padding at the image edges and expose less parallelism, so the
+//  lowest cost depends on the content of the frame.
+
+#ifndef _block_size_select_h
+#define _block_size_select_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+
+#include "frame_encoder.h"
+
+// Candidate block sizes are 2, 4, 8, 16, 32
+
+#define BLOCK_SIZE_SELECT_NUM_SIZES 5
+
+static inline
+int BlockSizeSelect_sizeForIndex(int sizei)
+{
+  return 2 << sizei;
+}
+
+typedef struct {
+  // Measured nanoseconds to decode one block for each candidate size
+  double decodeNsPerBlock[BLOCK_SIZE_SELECT_NUM_SIZES];
+} BlockSizeCalibration;
+
+typedef struct {
+  // Bytes stored for each block in addition to the deltas
+  double blockOverheadBytes;
+  // Weight that converts decode time into an equivalent number of bytes,
+  // zero selects the smallest output regardless of decode time.
+  double bytesPerDecodeNs;
+  // Number of blocks that can be decoded at the same time, 1 for a
+  // serial decoder or the number of cores or GPU threads in flight.
+  int numDecodeLanes;
+  // Smallest and largest block size to consider, both POT
+  int minBlockSize;
+  int maxBlockSize;
+  // When set, the first delta of each block is zero and the
+  // init byte is counted in blockOverheadBytes.
+  int useBlockInitBytes;
+} BlockSizeSelectParams;
+
+typedef struct {
+  int blockSize;
+  int numBlocks;
+  double entropyBitsPerByte;
+  double estimatedBytes;
+  double estimatedDecodeNs;
+  double cost;
+} BlockSizeScore;
+
+// Defaults assume a 32 bit block start offset and an init byte per
+// block, and weight 1 ns of decode time the same as 1 byte of output.
+
+static inline
+BlockSizeSelectParams BlockSizeSelect_defaultParams(void)
+{
+  BlockSizeSelectParams params;
+  params.blockOverheadBytes = 4 + 1;
+  params.bytesPerDecodeNs = 1.0;
+  params.numDecodeLanes = 1;
+  params.minBlockSize = 2;
+  params.maxBlockSize = 32;
+  params.useBlockInitBytes = 1;
+  return params;
+}
+
+static inline
+double BlockSizeSelect_nowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1.0e9) + ts.tv_nsec;
+}
+
+// Time single threaded decode of a synthetic frame for each candidate
+// block size. The fastest of numRepeats runs is kept to filter out
+// scheduling noise. Returns 0 on success or -1 on allocation failure.
+
+static inline
+int BlockSizeSelect_calibrate(BlockSizeCalibration *calibration, int numRepeats)
+{
+  const int numBytes = 256 * 256;
+
+  uint8_t *deltas = (uint8_t *) malloc(numBytes);
+  uint8_t *decoded = (uint8_t *) malloc(numBytes);
+
+  if (deltas == NULL || decoded == NULL) {
+    fprintf(stderr, "could not allocate %d bytes for block size calibration\n", numBytes);
+    free(deltas);
+    free(decoded);
+    return -1;
+  }
+
+  uint32_t seed = 0x12345678;
+
+  for ( int i = 0; i < numBytes; i++ ) {
+    seed = (seed * 1103515245) + 12345;
+    deltas[i] = (uint8_t) (seed >> 24);
+  }
+
+  for ( int sizei = 0; sizei < BLOCK_SIZE_SELECT_NUM_SIZES; sizei++ ) {
+    const int blockSize = BlockSizeSelect_sizeForIndex(sizei);
+    const int numBytesInBlock = blockSize * blockSize;
+    const int numBlocks = numBytes / numBytesInBlock;
+
+    double minNs = -1.0;
+
+    for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+      double startNs = BlockSizeSelect_nowNs();
+      FrameEncoder_decodeBlockRange(deltas, decoded, numBytesInBlock, 0, numBlocks, NULL);
+      double elapsedNs = BlockSizeSelect_nowNs() - startNs;
+
+      if (minNs < 0.0 || elapsedNs < minNs) {
+        minNs = elapsedNs;
+      }
+    }
+
+    calibration->decodeNsPerBlock[sizei] = minNs / numBlocks;
+  }
+
+  free(deltas);
+  free(decoded);
+
+  return 0;
+}
+
+// Histogram of the block order deltas that encoding an image order
+// frame with the given block size would generate. Bytes in the zero
+// padding past width or height are counted since they are encoded.
+
+static inline
+void BlockSizeSelect_deltaHistogram(const uint8_t *inBytes,
+                                    int width,
+                                    int height,
+                                    int blockSize,
+                                    int useBlockInitBytes,
+                                    uint32_t *histogram)
+{
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+
+  memset(histogram, 0, 256 * sizeof(uint32_t));
+
+  for ( int blockY = 0; blockY < numBlocksInHeight; blockY++ ) {
+    for ( int blockX = 0; blockX < numBlocksInWidth; blockX++ ) {
+      uint8_t prev = 0;
+
+      for ( int dy = 0; dy < blockSize; dy++ ) {
+        const int y = (blockY * blockSize) + dy;
+
+        for ( int dx = 0; dx < blockSize; dx++ ) {
+          const int x = (blockX * blockSize) + dx;
+
+          uint8_t val = 0;
+          if (x < width && y < height) {
+            val = inBytes[(y * width) + x];
+          }
+
+          if (useBlockInitBytes && dx == 0 && dy == 0) {
+            prev = val;
+          }
+
+          histogram[(uint8_t) (val - prev)] += 1;
+          prev = val;
+        }
+      }
+    }
+  }
+}
+
+// Zeroth order entropy in bits per symbol
+
+static inline
+double BlockSizeSelect_entropy(const uint32_t *histogram)
+{
+  double total = 0.0;
+
+  for ( int i = 0; i < 256; i++ ) {
+    total += histogram[i];
+  }
+
+  if (total == 0.0) {
+    return 0.0;
+  }
+
+  double bits = 0.0;
+
+  for ( int i = 0; i < 256; i++ ) {
+    if (histogram[i] != 0) {
+      double p = histogram[i] / total;
+      bits -= p * log2(p);
+    }
+  }
+
+  return bits;
+}
+
+// Score one block size for an image order frame
+
+static inline
+BlockSizeScore BlockSizeSelect_score(const uint8_t *inBytes,
+                                     int width,
+                                     int height,
+                                     int blockSize,
+                                     const BlockSizeSelectParams *params,
+                                     const BlockSizeCalibration *calibration)
+{
+  BlockSizeScore score;
+
+  uint32_t histogram[256];
+  BlockSizeSelect_deltaHistogram(inBytes, width, height, blockSize, params->useBlockInitBytes, histogram);
+
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+  const int numBlocks = numBlocksInWidth * numBlocksInHeight;
+  const int numBytes = numBlocks * blockSize * blockSize;
+
+  int sizei = 0;
+  while (BlockSizeSelect_sizeForIndex(sizei) < blockSize) {
+    sizei++;
+  }
+
+  score.blockSize = blockSize;
+  score.numBlocks = numBlocks;
+  score.entropyBitsPerByte = BlockSizeSelect_entropy(histogram);
+  score.estimatedBytes = ((score.entropyBitsPerByte * numBytes) / 8.0) + (params->blockOverheadBytes * numBlocks);
+  const int numLanes = (params->numDecodeLanes > 1) ? params->numDecodeLanes : 1;
+  const int numBlocksPerLane = (numBlocks + numLanes - 1) / numLanes;
+
+  score.estimatedDecodeNs = calibration->decodeNsPerBlock[sizei] * numBlocksPerLane;
+  score.cost = score.estimatedBytes + (params->bytesPerDecodeNs * score.estimatedDecodeNs);
+
+  return score;
+}
+
+// Score every candidate size in [minBlockSize, maxBlockSize] and return
+// the block size with the lowest cost. When scores is not NULL, the
+// score for each candidate index is written to scores[sizei].
+
+static inline
+int BlockSizeSelect_chooseForFrame(const uint8_t *inBytes,
+                                   int width,
+                                   int height,
+                                   const BlockSizeSelectParams *params,
+                                   const BlockSizeCalibration *calibration,
+                                   BlockSizeScore *scores)
+{
+  int bestBlockSize = 0;
+  double bestCost = 0.0;
+
+  for ( int sizei = 0; sizei < BLOCK_SIZE_SELECT_NUM_SIZES; sizei++ ) {
+    const int blockSize = BlockSizeSelect_sizeForIndex(sizei);
+
+    if (blockSize < params->minBlockSize || blockSize > params->maxBlockSize) {
+      if (scores != NULL) {
+        memset(&scores[sizei], 0, sizeof(BlockSizeScore));
+      }
+      continue;
+    }
+
+    BlockSizeScore score = BlockSizeSelect_score(inBytes, width, height, blockSize, params, calibration);
+
+    if (scores != NULL) {
+      scores[sizei] = score;
+    }
+
+    if (bestBlockSize == 0 || score.cost < bestCost) {
+      bestBlockSize = blockSize;
+      bestCost = score.cost;
+    }
+  }
+
+#if defined(DEBUG)
+  assert(bestBlockSize != 0);
+#endif // DEBUG
+
+  return bestBlockSize;
+}
+
+#endif // _block_size_select_h
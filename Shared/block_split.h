@@ -0,0 +1,130 @@
+//
+//  block_split.h
+//
+//  MIT Licensed
+//
+//  Inline methods that split image order rows of byte values into
+//  block order one row at a time. A row of blocks is stored as
+//  numBlocksInWidth blocks of (blockSize * blockSize) bytes and
+//  a frame in block order is just each row of blocks appended.
+//  Unlike Util splitIntoBlocksOfSize, these methods do not need
+//  the entire image in memory, so rows can be converted as soon
+//  as they have been read. BlockSplit_flattenRow is the inverse
+//  and copies one image order row back out of a row of blocks.
+
+#ifndef _block_split_h
+#define _block_split_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// Number of bytes in one row of blocks
+
+static inline
+int BlockSplit_blockRowNumBytes(int blockSize, int numBlocksInWidth)
+{
+  return (blockSize * blockSize) * numBlocksInWidth;
+}
+
+// Write one image order row of width bytes into the block order
+// buffer for a row of blocks. rowInBlock is the row offset inside
+// each block. Bytes past width in the last block are set to zeroValue.
+
+static inline
+void BlockSplit_row(const uint8_t *rowBytes,
+                    int width,
+                    int blockSize,
+                    int numBlocksInWidth,
+                    int rowInBlock,
+                    uint8_t *outBlockRowBytes,
+                    uint8_t zeroValue)
+{
+#if defined(DEBUG)
+  assert(rowInBlock >= 0 && rowInBlock < blockSize);
+  assert(width <= (blockSize * numBlocksInWidth));
+#endif // DEBUG
+
+  const int numBytesInOneBlock = blockSize * blockSize;
+
+  uint8_t *outPtr = outBlockRowBytes + (rowInBlock * blockSize);
+
+  int col = 0;
+
+  for ( int blocki = 0; blocki < numBlocksInWidth; blocki++ ) {
+    int numBytesToCopy = width - col;
+
+    if (numBytesToCopy >= blockSize) {
+      numBytesToCopy = blockSize;
+    } else if (numBytesToCopy < 0) {
+      numBytesToCopy = 0;
+    }
+
+    memcpy(outPtr, rowBytes + col, numBytesToCopy);
+
+    if (numBytesToCopy < blockSize) {
+      memset(outPtr + numBytesToCopy, zeroValue, blockSize - numBytesToCopy);
+    }
+
+    col += blockSize;
+    outPtr += numBytesInOneBlock;
+  }
+}
+
+// Write a padding row that lies below the image height, every
+// byte in this row of each block is set to zeroValue.
+
+static inline
+void BlockSplit_zeroRow(int blockSize,
+                        int numBlocksInWidth,
+                        int rowInBlock,
+                        uint8_t *outBlockRowBytes,
+                        uint8_t zeroValue)
+{
+  const int numBytesInOneBlock = blockSize * blockSize;
+
+  uint8_t *outPtr = outBlockRowBytes + (rowInBlock * blockSize);
+
+  for ( int blocki = 0; blocki < numBlocksInWidth; blocki++ ) {
+    memset(outPtr, zeroValue, blockSize);
+    outPtr += numBytesInOneBlock;
+  }
+}
+
+// Read one image order row of width bytes back out of the block
+// order buffer for a row of blocks, the inverse of BlockSplit_row.
+// Padding bytes past width in the last block are not copied.
+
+static inline
+void BlockSplit_flattenRow(const uint8_t *blockRowBytes,
+                           int width,
+                           int blockSize,
+                           int numBlocksInWidth,
+                           int rowInBlock,
+                           uint8_t *outRowBytes)
+{
+  (void) numBlocksInWidth;
+#if defined(DEBUG)
+  assert(rowInBlock >= 0 && rowInBlock < blockSize);
+  assert(width <= (blockSize * numBlocksInWidth));
+#endif // DEBUG
+
+  const int numBytesInOneBlock = blockSize * blockSize;
+
+  const uint8_t *inPtr = blockRowBytes + (rowInBlock * blockSize);
+
+  for ( int col = 0; col < width; col += blockSize ) {
+    int numBytesToCopy = width - col;
+
+    if (numBytesToCopy > blockSize) {
+      numBytesToCopy = blockSize;
+    }
+
+    memcpy(outRowBytes + col, inPtr, numBytesToCopy);
+    inPtr += numBytesInOneBlock;
+  }
+}
+
+#endif // _block_split_h
@@ -0,0 +1,212 @@
+//
+//  delta_histogram.h
+//
+//  MIT Licensed
+//
+//  Delta encoder variant that collects 256 bin histograms of the delta
+//  bytes as the deltas are generated, so that an entropy coder or
+//  adaptive model gets symbol frequencies without another pass over
+//  the encoded frame. Each block is counted right after it is encoded,
+//  while the deltas are still in L1.
+//
+//  Blocks are grouped into regions of numBlocksInRegion blocks, one row
+//  of blocks is a typical region. A histogram can be written for each
+//  region along with the histogram for the whole frame. Each thread
+//  counts into 4 interleaved sub-histograms so that runs of the same
+//  delta value do not stall on a store then load of the same counter,
+//  the sub-histograms are merged per region and each thread total is
+//  merged into the frame histogram once all threads finish.
+//
+//  When stripeChecksums is not NULL, the CRC32C of each region is also
+//  calculated in the same pass, as FrameEncoder_encodeDeltasWithChecksums
+//  does.
+
+#ifndef _delta_histogram_h
+#define _delta_histogram_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "parallel_for.h"
+#include "block_checksum.h"
+#include "frame_encoder.h"
+
+#define DELTA_HISTOGRAM_NUM_BINS 256
+#define DELTA_HISTOGRAM_NUM_SUB 4
+
+// Count numBytes bytes into 4 interleaved sub-histograms
+
+static inline
+void DeltaHistogram_count(const uint8_t * __restrict bytes,
+                          int numBytes,
+                          uint32_t (* __restrict subHistograms)[DELTA_HISTOGRAM_NUM_BINS])
+{
+  uint32_t * __restrict h0 = subHistograms[0];
+  uint32_t * __restrict h1 = subHistograms[1];
+  uint32_t * __restrict h2 = subHistograms[2];
+  uint32_t * __restrict h3 = subHistograms[3];
+
+  int i = 0;
+
+  for ( ; (i + 4) <= numBytes; i += 4 ) {
+    h0[bytes[i]] += 1;
+    h1[bytes[i+1]] += 1;
+    h2[bytes[i+2]] += 1;
+    h3[bytes[i+3]] += 1;
+  }
+
+  for ( ; i < numBytes; i++ ) {
+    h0[bytes[i]] += 1;
+  }
+}
+
+// Add the sub-histograms into histogram
+
+static inline
+void DeltaHistogram_merge(uint32_t (*subHistograms)[DELTA_HISTOGRAM_NUM_BINS], uint32_t *histogram)
+{
+  for ( int bini = 0; bini < DELTA_HISTOGRAM_NUM_BINS; bini++ ) {
+    histogram[bini] += subHistograms[0][bini] + subHistograms[1][bini] + subHistograms[2][bini] + subHistograms[3][bini];
+  }
+}
+
+typedef struct {
+  const uint8_t *inBytes;
+  uint8_t *outDeltas;
+  int numBytesInBlock;
+  uint8_t *blockInitBytes;
+  int numBlocks;
+  int numBlocksInRegion;
+  uint32_t *regionHistograms;
+  uint32_t *stripeChecksums;
+  // One frame histogram for each thread, merged after the run
+  uint32_t (*threadHistograms)[DELTA_HISTOGRAM_NUM_BINS];
+} DeltaHistogramContext;
+
+static inline
+void DeltaHistogram_encodeChunk(void *ctx, int threadi, int start, int end)
+{
+  DeltaHistogramContext *dhc = (DeltaHistogramContext *) ctx;
+
+  const int numBytesInBlock = dhc->numBytesInBlock;
+  uint32_t *threadHistogram = dhc->threadHistograms[threadi];
+
+  uint32_t subHistograms[DELTA_HISTOGRAM_NUM_SUB][DELTA_HISTOGRAM_NUM_BINS];
+  memset(subHistograms, 0, sizeof(subHistograms));
+  memset(threadHistogram, 0, DELTA_HISTOGRAM_NUM_BINS * sizeof(uint32_t));
+
+  for ( int regioni = start; regioni < end; regioni++ ) {
+    const int startBlocki = regioni * dhc->numBlocksInRegion;
+    int endBlocki = startBlocki + dhc->numBlocksInRegion;
+    if (endBlocki > dhc->numBlocks) {
+      endBlocki = dhc->numBlocks;
+    }
+
+    uint32_t crc = BlockChecksum_init();
+
+    for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+      FrameEncoder_encodeBlockRange(dhc->inBytes, dhc->outDeltas, numBytesInBlock, blocki, blocki+1, dhc->blockInitBytes);
+
+      DeltaHistogram_count(dhc->outDeltas + (blocki * numBytesInBlock), numBytesInBlock, subHistograms);
+
+      if (dhc->stripeChecksums != NULL) {
+        crc = BlockChecksum_update(crc, dhc->inBytes + (blocki * numBytesInBlock), numBytesInBlock);
+      }
+    }
+
+    if (dhc->stripeChecksums != NULL) {
+      dhc->stripeChecksums[regioni] = BlockChecksum_final(crc);
+    }
+
+    if (dhc->regionHistograms != NULL) {
+      uint32_t *regionHistogram = dhc->regionHistograms + (regioni * DELTA_HISTOGRAM_NUM_BINS);
+      memset(regionHistogram, 0, DELTA_HISTOGRAM_NUM_BINS * sizeof(uint32_t));
+      DeltaHistogram_merge(subHistograms, regionHistogram);
+      DeltaHistogram_merge(subHistograms, threadHistogram);
+      memset(subHistograms, 0, sizeof(subHistograms));
+    }
+  }
+
+  if (dhc->regionHistograms == NULL) {
+    DeltaHistogram_merge(subHistograms, threadHistogram);
+  }
+}
+
+// Encode a frame of block order bytes to deltas and write the 256 bin
+// histogram of every delta byte to frameHistogram. regionHistograms
+// may be NULL or hold 256 values for each region of numBlocksInRegion
+// blocks, stripeChecksums may be NULL or hold one value per region.
+// Returns 0 on success.
+
+static inline
+int DeltaHistogram_encodeDeltas(const uint8_t *inBytes,
+                                uint8_t *outDeltas,
+                                int numBytesInBlock,
+                                int numBlocks,
+                                uint8_t *blockInitBytes,
+                                int numBlocksInRegion,
+                                uint32_t *frameHistogram,
+                                uint32_t *regionHistograms,
+                                uint32_t *stripeChecksums,
+                                int numThreads)
+{
+#if defined(DEBUG)
+  assert(inBytes != outDeltas);
+  assert(numBytesInBlock > 0);
+  assert(numBlocksInRegion > 0);
+#endif // DEBUG
+
+  memset(frameHistogram, 0, DELTA_HISTOGRAM_NUM_BINS * sizeof(uint32_t));
+
+  const int numRegions = BlockChecksum_numStripes(numBlocks, numBlocksInRegion);
+
+  if (numRegions == 0) {
+    return 0;
+  }
+
+  // Same clamp as ParallelFor_run so that each chunk has a slot
+
+  int numChunks = numThreads;
+  if (numChunks > numRegions) {
+    numChunks = numRegions;
+  }
+  if (numChunks > PARALLEL_FOR_MAX_THREADS) {
+    numChunks = PARALLEL_FOR_MAX_THREADS;
+  }
+  if (numChunks < 1) {
+    numChunks = 1;
+  }
+
+  DeltaHistogramContext dhc;
+  dhc.inBytes = inBytes;
+  dhc.outDeltas = outDeltas;
+  dhc.numBytesInBlock = numBytesInBlock;
+  dhc.blockInitBytes = blockInitBytes;
+  dhc.numBlocks = numBlocks;
+  dhc.numBlocksInRegion = numBlocksInRegion;
+  dhc.regionHistograms = regionHistograms;
+  dhc.stripeChecksums = stripeChecksums;
+  dhc.threadHistograms = (uint32_t (*)[DELTA_HISTOGRAM_NUM_BINS]) malloc(numChunks * DELTA_HISTOGRAM_NUM_BINS * sizeof(uint32_t));
+
+  if (dhc.threadHistograms == NULL) {
+    fprintf(stderr, "could not allocate %d thread histograms\n", numChunks);
+    return -1;
+  }
+
+  numChunks = ParallelFor_run(numChunks, numRegions, DeltaHistogram_encodeChunk, &dhc);
+
+  for ( int threadi = 0; threadi < numChunks; threadi++ ) {
+    for ( int bini = 0; bini < DELTA_HISTOGRAM_NUM_BINS; bini++ ) {
+      frameHistogram[bini] += dhc.threadHistograms[threadi][bini];
+    }
+  }
+
+  free(dhc.threadHistograms);
+
+  return 0;
+}
+
+#endif // _delta_histogram_h
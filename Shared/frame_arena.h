@@ -0,0 +1,278 @@
+//
+//  frame_arena.h
+//
+//  MIT Licensed
+//
+//  Pool of frame sized buffers that are recycled across frames and
+//  threads. Every buffer starts on a 64 byte boundary, so vector loads
+//  at the start of each block are aligned whenever the block size is a
+//  multiple of 64 bytes, and no block straddles a cache line at the
+//  start of the frame. A released buffer goes back to the pool and the
+//  next request of the same or smaller size reuses it, so steady state
+//  encode and decode neither calls the allocator nor page faults.
+//
+//  With useHugePages set, new buffers are rounded up to 2 MB and backed
+//  by huge pages when the system supports it (MAP_HUGETLB or THP on
+//  Linux, superpages on x86 macOS). When huge pages are not available
+//  the buffer falls back to a regular 64 byte aligned allocation.
+
+#ifndef _frame_arena_h
+#define _frame_arena_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__APPLE__)
+#include <mach/vm_statistics.h>
+#endif
+
+#define FRAME_ARENA_ALIGNMENT 64
+#define FRAME_ARENA_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+#define FRAME_ARENA_MAX_BUFFERS 32
+
+typedef struct {
+  uint8_t *bytes;
+  size_t capacity;
+  int inUse;
+  // Allocated with mmap and released with munmap
+  int isMapped;
+} FrameArenaBuffer;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  int useHugePages;
+  int numBuffers;
+  FrameArenaBuffer buffers[FRAME_ARENA_MAX_BUFFERS];
+
+  // Requests served from the pool and requests that allocated
+  int numReused;
+  int numAllocated;
+} FrameArena;
+
+static inline
+int FrameArena_init(FrameArena *arena, int useHugePages)
+{
+  memset(arena, 0, sizeof(FrameArena));
+  arena->useHugePages = useHugePages;
+
+  if (pthread_mutex_init(&arena->mutex, NULL) != 0) {
+    fprintf(stderr, "could not create frame arena mutex\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Number of bytes in a frame of block order bytes
+
+static inline
+size_t FrameArena_numFrameBytes(int blockSize, int numBlocksInWidth, int numBlocksInHeight)
+{
+  return (size_t) blockSize * blockSize * numBlocksInWidth * numBlocksInHeight;
+}
+
+static inline
+size_t FrameArena_roundCapacity(const FrameArena *arena, size_t numBytes)
+{
+  const size_t alignment = arena->useHugePages ? FRAME_ARENA_HUGE_PAGE_BYTES : FRAME_ARENA_ALIGNMENT;
+  return (numBytes + alignment - 1) & ~(alignment - 1);
+}
+
+// Allocate a new buffer of capacity bytes from the system
+
+static inline
+int FrameArena_systemAlloc(const FrameArena *arena, FrameArenaBuffer *buffer, size_t capacity)
+{
+  buffer->bytes = NULL;
+  buffer->capacity = capacity;
+  buffer->inUse = 0;
+  buffer->isMapped = 0;
+
+  if (arena->useHugePages) {
+    void *ptr = MAP_FAILED;
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    ptr = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#elif defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+    ptr = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+
+    if (ptr != MAP_FAILED) {
+      buffer->bytes = (uint8_t *) ptr;
+      buffer->isMapped = 1;
+      return 0;
+    }
+  }
+
+  const size_t alignment = arena->useHugePages ? FRAME_ARENA_HUGE_PAGE_BYTES : FRAME_ARENA_ALIGNMENT;
+  void *ptr = NULL;
+
+  if (posix_memalign(&ptr, alignment, capacity) != 0) {
+    fprintf(stderr, "could not allocate %d byte frame buffer\n", (int) capacity);
+    buffer->capacity = 0;
+    return -1;
+  }
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (arena->useHugePages) {
+    // Ask for transparent huge pages when none are reserved
+    madvise(ptr, capacity, MADV_HUGEPAGE);
+  }
+#endif
+
+  buffer->bytes = (uint8_t *) ptr;
+  return 0;
+}
+
+static inline
+void FrameArena_systemFree(FrameArenaBuffer *buffer)
+{
+  if (buffer->isMapped) {
+    munmap(buffer->bytes, buffer->capacity);
+  } else {
+    free(buffer->bytes);
+  }
+
+  buffer->bytes = NULL;
+  buffer->capacity = 0;
+}
+
+// Returns a 64 byte aligned buffer of at least numBytes bytes. The
+// contents are not cleared, a reused buffer holds old frame data.
+// Returns NULL on allocation failure.
+
+static inline
+uint8_t* FrameArena_alloc(FrameArena *arena, size_t numBytes)
+{
+  if (numBytes == 0) {
+    numBytes = 1;
+  }
+
+  pthread_mutex_lock(&arena->mutex);
+
+  // Reuse the smallest free buffer that is large enough
+
+  int besti = -1;
+
+  for ( int i = 0; i < arena->numBuffers; i++ ) {
+    FrameArenaBuffer *buffer = &arena->buffers[i];
+
+    if (!buffer->inUse && buffer->capacity >= numBytes) {
+      if (besti == -1 || buffer->capacity < arena->buffers[besti].capacity) {
+        besti = i;
+      }
+    }
+  }
+
+  if (besti != -1) {
+    arena->buffers[besti].inUse = 1;
+    arena->numReused += 1;
+    uint8_t *bytes = arena->buffers[besti].bytes;
+    pthread_mutex_unlock(&arena->mutex);
+    return bytes;
+  }
+
+  // No free buffer is large enough, replace a free buffer that is
+  // too small or add a new slot.
+
+  int sloti = -1;
+
+  for ( int i = 0; i < arena->numBuffers; i++ ) {
+    if (!arena->buffers[i].inUse) {
+      sloti = i;
+      break;
+    }
+  }
+
+  if (sloti != -1) {
+    FrameArena_systemFree(&arena->buffers[sloti]);
+  } else if (arena->numBuffers < FRAME_ARENA_MAX_BUFFERS) {
+    sloti = arena->numBuffers;
+  } else {
+    pthread_mutex_unlock(&arena->mutex);
+    fprintf(stderr, "frame arena has %d buffers in use\n", FRAME_ARENA_MAX_BUFFERS);
+    return NULL;
+  }
+
+  FrameArenaBuffer *buffer = &arena->buffers[sloti];
+
+  if (FrameArena_systemAlloc(arena, buffer, FrameArena_roundCapacity(arena, numBytes)) != 0) {
+    // An emptied slot has zero capacity and is never reused
+    pthread_mutex_unlock(&arena->mutex);
+    return NULL;
+  }
+
+  if (sloti == arena->numBuffers) {
+    arena->numBuffers += 1;
+  }
+
+  buffer->inUse = 1;
+  arena->numAllocated += 1;
+
+  uint8_t *bytes = buffer->bytes;
+  pthread_mutex_unlock(&arena->mutex);
+
+#if defined(DEBUG)
+  assert((((uintptr_t) bytes) % FRAME_ARENA_ALIGNMENT) == 0);
+#endif // DEBUG
+
+  return bytes;
+}
+
+// Return a buffer to the pool so that a later alloc can reuse it
+
+static inline
+void FrameArena_release(FrameArena *arena, uint8_t *bytes)
+{
+  if (bytes == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&arena->mutex);
+
+  int found = 0;
+
+  for ( int i = 0; i < arena->numBuffers; i++ ) {
+    if (arena->buffers[i].bytes == bytes) {
+#if defined(DEBUG)
+      assert(arena->buffers[i].inUse);
+#endif // DEBUG
+      arena->buffers[i].inUse = 0;
+      found = 1;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&arena->mutex);
+
+  if (!found) {
+    fprintf(stderr, "released buffer %p is not in the frame arena\n", bytes);
+  }
+
+#if defined(DEBUG)
+  assert(found);
+#endif // DEBUG
+}
+
+// Free every buffer, all buffers must have been released
+
+static inline
+void FrameArena_free(FrameArena *arena)
+{
+  for ( int i = 0; i < arena->numBuffers; i++ ) {
+#if defined(DEBUG)
+    assert(!arena->buffers[i].inUse);
+#endif // DEBUG
+    FrameArena_systemFree(&arena->buffers[i]);
+  }
+
+  arena->numBuffers = 0;
+  pthread_mutex_destroy(&arena->mutex);
+}
+
+#endif // _frame_arena_h
@@ -0,0 +1,484 @@
+//
+//  frame_encoder.h
+//
+//  MIT Licensed
+//
+//  Inline methods that encode a whole frame of block order bytes as
+//  per block byte deltas, and decode those deltas back with a per block
+//  prefix sum. Deltas are written directly into one output buffer, the
+//  blocks are partitioned across threads, and nothing is allocated per
+//  block. The delta format matches DeltaEncoder encodeByteDeltas: the
+//  first byte of each block is a delta from zero and every other byte
+//  is (value - previous) with unsigned 8 bit wraparound.
+//
+//  When blockInitBytes is not NULL, the first delta of each block is
+//  stored in blockInitBytes[blocki] and set to zero in the delta output,
+//  as IMPL_DELTAS_AND_INIT_ZERO_DELTA_BEFORE_HUFF_ENCODING does.
+//
+//  Optional CRC32C checksums cover a stripe of blocks and are computed
+//  over the original bytes. The checksum is calculated while the data
+//  is in cache, during the delta loop when encoding and right after a
+//  stripe is decoded, so verification does not need another pass over
+//  the frame.
+//
+//  An optional block class bitmap from block_class.h lets the decoder
+//  fill zero and constant blocks and skip the prefix sum for them.
+//
+//  An optional SumPyramid from sum_pyramid.h is filled from each block
+//  right after it is decoded, so thumbnails and block means come out
+//  of the decode without a separate downsample pass.
+
+#ifndef _frame_encoder_h
+#define _frame_encoder_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "parallel_for.h"
+#include "block_checksum.h"
+#include "segmented_scan.h"
+#include "block_class.h"
+#include "sum_pyramid.h"
+
+// Encode numBlocks blocks of numBytesInBlock bytes each, serial.
+// inBytes and outDeltas must not overlap.
+
+static inline
+void FrameEncoder_encodeBlockRange(const uint8_t * __restrict inBytes,
+                                   uint8_t * __restrict outDeltas,
+                                   int numBytesInBlock,
+                                   int startBlocki,
+                                   int endBlocki,
+                                   uint8_t * __restrict blockInitBytes)
+{
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    const uint8_t * __restrict inPtr = inBytes + (blocki * numBytesInBlock);
+    uint8_t * __restrict outPtr = outDeltas + (blocki * numBytesInBlock);
+
+    if (blockInitBytes != NULL) {
+      blockInitBytes[blocki] = inPtr[0];
+      outPtr[0] = 0;
+    } else {
+      outPtr[0] = inPtr[0];
+    }
+
+    // Simple loop form so that the compiler emits vector subtracts
+    for ( int i = 1; i < numBytesInBlock; i++ ) {
+      outPtr[i] = (uint8_t) (inPtr[i] - inPtr[i-1]);
+    }
+  }
+}
+
+// Decode numBlocks blocks of deltas with a vector inclusive prefix sum per block
+
+static inline
+void FrameEncoder_decodeBlockRange(const uint8_t * __restrict inDeltas,
+                                   uint8_t * __restrict outBytes,
+                                   int numBytesInBlock,
+                                   int startBlocki,
+                                   int endBlocki,
+                                   const uint8_t * __restrict blockInitBytes)
+{
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    const uint8_t * __restrict inPtr = inDeltas + (blocki * numBytesInBlock);
+    uint8_t * __restrict outPtr = outBytes + (blocki * numBytesInBlock);
+
+    uint8_t carryIn = (blockInitBytes != NULL) ? blockInitBytes[blocki] : 0;
+
+    SegmentedScan_run(inPtr, outPtr, numBytesInBlock, carryIn, 0);
+  }
+}
+
+// Decode blocks in the range [startBlocki, endBlocki) using the block
+// class bitmap. Zero and constant blocks are filled with a memset and
+// a bitmap byte of zero skips 4 zero blocks at once.
+
+static inline
+void FrameEncoder_decodeClassifiedBlockRange(const uint8_t *inDeltas,
+                                             uint8_t *outBytes,
+                                             int numBytesInBlock,
+                                             int startBlocki,
+                                             int endBlocki,
+                                             const uint8_t *blockInitBytes,
+                                             const uint8_t *blockClasses)
+{
+  int blocki = startBlocki;
+
+  while (blocki < endBlocki) {
+    uint8_t *outPtr = outBytes + (blocki * numBytesInBlock);
+
+    if (((blocki & 0x3) == 0) && ((blocki + 4) <= endBlocki) && (blockClasses[blocki >> 2] == 0)) {
+      memset(outPtr, 0, numBytesInBlock * 4);
+      blocki += 4;
+      continue;
+    }
+
+    const int blockClass = BlockClass_get(blockClasses, blocki);
+
+    if (blockClass == BLOCK_CLASS_ZERO) {
+      memset(outPtr, 0, numBytesInBlock);
+    } else if (blockClass == BLOCK_CLASS_CONSTANT) {
+      // All deltas after the first are zero
+      uint8_t value = (blockInitBytes != NULL) ? blockInitBytes[blocki] : inDeltas[blocki * numBytesInBlock];
+      memset(outPtr, value, numBytesInBlock);
+    } else {
+      FrameEncoder_decodeBlockRange(inDeltas, outBytes, numBytesInBlock, blocki, blocki+1, blockInitBytes);
+    }
+
+    blocki += 1;
+  }
+}
+
+typedef struct {
+  const uint8_t *inBytes;
+  uint8_t *outBytes;
+  int numBytesInBlock;
+  uint8_t *blockInitBytes;
+  const uint8_t *blockClasses;
+  SumPyramid *pyramid;
+  int numBlocks;
+  int numBlocksInStripe;
+  uint32_t *stripeChecksums;
+  int numFailedStripes[PARALLEL_FOR_MAX_THREADS];
+} FrameEncoderContext;
+
+static inline
+void FrameEncoder_encodeChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  FrameEncoderContext *fec = (FrameEncoderContext *) ctx;
+  FrameEncoder_encodeBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, start, end, fec->blockInitBytes);
+}
+
+// Decode one block and add it to the pyramid. Zero and constant blocks
+// fill the pyramid from the block value without reading the block.
+
+static inline
+void FrameEncoder_decodePyramidBlock(FrameEncoderContext *fec, int blocki)
+{
+  const int numBytesInBlock = fec->numBytesInBlock;
+  uint8_t *outPtr = fec->outBytes + (blocki * numBytesInBlock);
+
+  if (fec->blockClasses != NULL) {
+    const int blockClass = BlockClass_get(fec->blockClasses, blocki);
+
+    if (blockClass != BLOCK_CLASS_GENERAL) {
+      uint8_t value = 0;
+      if (blockClass == BLOCK_CLASS_CONSTANT) {
+        value = (fec->blockInitBytes != NULL) ? fec->blockInitBytes[blocki] : fec->inBytes[blocki * numBytesInBlock];
+      }
+      memset(outPtr, value, numBytesInBlock);
+      SumPyramid_addConstantBlock(fec->pyramid, blocki, value);
+      return;
+    }
+  }
+
+  FrameEncoder_decodeBlockRange(fec->inBytes, fec->outBytes, numBytesInBlock, blocki, blocki+1, fec->blockInitBytes);
+  SumPyramid_addBlock(fec->pyramid, blocki, outPtr);
+}
+
+static inline
+void FrameEncoder_decodeChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  FrameEncoderContext *fec = (FrameEncoderContext *) ctx;
+  if (fec->pyramid != NULL) {
+    for ( int blocki = start; blocki < end; blocki++ ) {
+      FrameEncoder_decodePyramidBlock(fec, blocki);
+    }
+  } else if (fec->blockClasses != NULL) {
+    FrameEncoder_decodeClassifiedBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, start, end, fec->blockInitBytes, fec->blockClasses);
+  } else {
+    FrameEncoder_decodeBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, start, end, fec->blockInitBytes);
+  }
+}
+
+// Encode then checksum each block in the stripe range [start, end)
+
+static inline
+void FrameEncoder_encodeStripeChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  FrameEncoderContext *fec = (FrameEncoderContext *) ctx;
+
+  for ( int stripei = start; stripei < end; stripei++ ) {
+    const int startBlocki = stripei * fec->numBlocksInStripe;
+    int endBlocki = startBlocki + fec->numBlocksInStripe;
+    if (endBlocki > fec->numBlocks) {
+      endBlocki = fec->numBlocks;
+    }
+
+    uint32_t crc = BlockChecksum_init();
+
+    for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+      FrameEncoder_encodeBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, blocki, blocki+1, fec->blockInitBytes);
+      crc = BlockChecksum_update(crc, fec->inBytes + (blocki * fec->numBytesInBlock), fec->numBytesInBlock);
+    }
+
+    fec->stripeChecksums[stripei] = BlockChecksum_final(crc);
+  }
+}
+
+// Decode then verify each block in the stripe range [start, end)
+
+static inline
+void FrameEncoder_decodeStripeChunk(void *ctx, int threadi, int start, int end)
+{
+  FrameEncoderContext *fec = (FrameEncoderContext *) ctx;
+
+  int numFailed = 0;
+
+  for ( int stripei = start; stripei < end; stripei++ ) {
+    const int startBlocki = stripei * fec->numBlocksInStripe;
+    int endBlocki = startBlocki + fec->numBlocksInStripe;
+    if (endBlocki > fec->numBlocks) {
+      endBlocki = fec->numBlocks;
+    }
+
+    if (fec->blockClasses != NULL) {
+      FrameEncoder_decodeClassifiedBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, startBlocki, endBlocki, fec->blockInitBytes, fec->blockClasses);
+    } else {
+      FrameEncoder_decodeBlockRange(fec->inBytes, fec->outBytes, fec->numBytesInBlock, startBlocki, endBlocki, fec->blockInitBytes);
+    }
+
+    // A stripe is small enough that the decoded bytes are still in cache
+
+    uint32_t crc = BlockChecksum_crc32c(fec->outBytes + (startBlocki * fec->numBytesInBlock),
+                                        (endBlocki - startBlocki) * fec->numBytesInBlock);
+
+    if (crc != fec->stripeChecksums[stripei]) {
+      numFailed += 1;
+    }
+  }
+
+  fec->numFailedStripes[threadi] = numFailed;
+}
+
+// Encode a frame of numBlocks blocks using up to numThreads threads
+
+static inline
+void FrameEncoder_encodeDeltas(const uint8_t *inBytes,
+                               uint8_t *outDeltas,
+                               int numBytesInBlock,
+                               int numBlocks,
+                               uint8_t *blockInitBytes,
+                               int numThreads)
+{
+#if defined(DEBUG)
+  assert(inBytes != outDeltas);
+  assert(numBytesInBlock > 0);
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inBytes;
+  fec.outBytes = outDeltas;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = blockInitBytes;
+  fec.blockClasses = NULL;
+  fec.pyramid = NULL;
+
+  ParallelFor_run(numThreads, numBlocks, FrameEncoder_encodeChunk, &fec);
+}
+
+// Decode a frame of numBlocks blocks using up to numThreads threads
+
+static inline
+void FrameEncoder_decodeDeltas(const uint8_t *inDeltas,
+                               uint8_t *outBytes,
+                               int numBytesInBlock,
+                               int numBlocks,
+                               const uint8_t *blockInitBytes,
+                               int numThreads)
+{
+#if defined(DEBUG)
+  assert(inDeltas != outBytes);
+  assert(numBytesInBlock > 0);
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inDeltas;
+  fec.outBytes = outBytes;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = (uint8_t *) blockInitBytes;
+  fec.blockClasses = NULL;
+  fec.pyramid = NULL;
+
+  ParallelFor_run(numThreads, numBlocks, FrameEncoder_decodeChunk, &fec);
+}
+
+// Decode a frame using a block class bitmap, only general blocks
+// are decoded with a prefix sum.
+
+static inline
+void FrameEncoder_decodeDeltasClassified(const uint8_t *inDeltas,
+                                         uint8_t *outBytes,
+                                         int numBytesInBlock,
+                                         int numBlocks,
+                                         const uint8_t *blockInitBytes,
+                                         const uint8_t *blockClasses,
+                                         int numThreads)
+{
+#if defined(DEBUG)
+  assert(inDeltas != outBytes);
+  assert(numBytesInBlock > 0);
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inDeltas;
+  fec.outBytes = outBytes;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = (uint8_t *) blockInitBytes;
+  fec.blockClasses = blockClasses;
+  fec.pyramid = NULL;
+
+  ParallelFor_run(numThreads, numBlocks, FrameEncoder_decodeChunk, &fec);
+}
+
+// Decode a frame and fill every level of pyramid, which must have
+// been initialized with the same block size and block dimensions.
+// blockClasses may be NULL to run the prefix sum on every block.
+
+static inline
+void FrameEncoder_decodeDeltasWithPyramid(const uint8_t *inDeltas,
+                                          uint8_t *outBytes,
+                                          int numBytesInBlock,
+                                          int numBlocks,
+                                          const uint8_t *blockInitBytes,
+                                          const uint8_t *blockClasses,
+                                          SumPyramid *pyramid,
+                                          int numThreads)
+{
+#if defined(DEBUG)
+  assert(inDeltas != outBytes);
+  assert(numBytesInBlock == (pyramid->blockSize * pyramid->blockSize));
+  assert(numBlocks == (pyramid->numBlocksInWidth * pyramid->numBlocksInHeight));
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inDeltas;
+  fec.outBytes = outBytes;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = (uint8_t *) blockInitBytes;
+  fec.blockClasses = blockClasses;
+  fec.pyramid = pyramid;
+
+  ParallelFor_run(numThreads, numBlocks, FrameEncoder_decodeChunk, &fec);
+}
+
+// Encode a frame and write one CRC32C checksum for each stripe of
+// numBlocksInStripe blocks into stripeChecksums. Pass numBlocksInStripe
+// as 1 for per block checksums or numBlocksInWidth for one checksum
+// per row of blocks.
+
+static inline
+void FrameEncoder_encodeDeltasWithChecksums(const uint8_t *inBytes,
+                                            uint8_t *outDeltas,
+                                            int numBytesInBlock,
+                                            int numBlocks,
+                                            uint8_t *blockInitBytes,
+                                            int numBlocksInStripe,
+                                            uint32_t *stripeChecksums,
+                                            int numThreads)
+{
+#if defined(DEBUG)
+  assert(inBytes != outDeltas);
+  assert(numBytesInBlock > 0);
+  assert(numBlocksInStripe > 0);
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inBytes;
+  fec.outBytes = outDeltas;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = blockInitBytes;
+  fec.blockClasses = NULL;
+  fec.pyramid = NULL;
+  fec.numBlocks = numBlocks;
+  fec.numBlocksInStripe = numBlocksInStripe;
+  fec.stripeChecksums = stripeChecksums;
+
+  const int numStripes = BlockChecksum_numStripes(numBlocks, numBlocksInStripe);
+
+  ParallelFor_run(numThreads, numStripes, FrameEncoder_encodeStripeChunk, &fec);
+}
+
+// Decode a frame and verify each stripe against stripeChecksums.
+// blockClasses may be NULL to run the prefix sum on every block.
+// Returns the number of stripes that failed verification, so
+// zero means the entire frame decoded to the original bytes.
+
+static inline
+int FrameEncoder_decodeDeltasVerified(const uint8_t *inDeltas,
+                                      uint8_t *outBytes,
+                                      int numBytesInBlock,
+                                      int numBlocks,
+                                      const uint8_t *blockInitBytes,
+                                      const uint8_t *blockClasses,
+                                      int numBlocksInStripe,
+                                      const uint32_t *stripeChecksums,
+                                      int numThreads)
+{
+#if defined(DEBUG)
+  assert(inDeltas != outBytes);
+  assert(numBytesInBlock > 0);
+  assert(numBlocksInStripe > 0);
+#endif // DEBUG
+
+  FrameEncoderContext fec;
+  fec.inBytes = inDeltas;
+  fec.outBytes = outBytes;
+  fec.numBytesInBlock = numBytesInBlock;
+  fec.blockInitBytes = (uint8_t *) blockInitBytes;
+  fec.blockClasses = blockClasses;
+  fec.pyramid = NULL;
+  fec.numBlocks = numBlocks;
+  fec.numBlocksInStripe = numBlocksInStripe;
+  fec.stripeChecksums = (uint32_t *) stripeChecksums;
+
+  const int numStripes = BlockChecksum_numStripes(numBlocks, numBlocksInStripe);
+
+  int numChunks = ParallelFor_run(numThreads, numStripes, FrameEncoder_decodeStripeChunk, &fec);
+
+  int numFailed = 0;
+
+  for ( int threadi = 0; threadi < numChunks; threadi++ ) {
+    numFailed += fec.numFailedStripes[threadi];
+  }
+
+  return numFailed;
+}
+
+// Verify already decoded block order bytes, for example the output
+// of the GPU prefix sum, against stripe checksums. Returns the
+// index of the first stripe that does not match or -1 if all match.
+
+static inline
+int FrameEncoder_verifyChecksums(const uint8_t *blockBytes,
+                                 int numBytesInBlock,
+                                 int numBlocks,
+                                 int numBlocksInStripe,
+                                 const uint32_t *stripeChecksums)
+{
+  const int numStripes = BlockChecksum_numStripes(numBlocks, numBlocksInStripe);
+  const int numBytesInStripe = numBytesInBlock * numBlocksInStripe;
+  const int numBytes = numBytesInBlock * numBlocks;
+
+  for ( int stripei = 0; stripei < numStripes; stripei++ ) {
+    const int offset = stripei * numBytesInStripe;
+    int len = numBytesInStripe;
+    if ((offset + len) > numBytes) {
+      len = numBytes - offset;
+    }
+
+    if (BlockChecksum_crc32c(blockBytes + offset, len) != stripeChecksums[stripei]) {
+      return stripei;
+    }
+  }
+
+  return -1;
+}
+
+#endif // _frame_encoder_h
@@ -0,0 +1,165 @@
+//
+//  frame_header.h
+//
+//  MIT Licensed
+//
+//  Fixed size header that is written in front of an encoded frame of
+//  block order deltas. The header records the image dimensions, the
+//  block size the encoder selected, and which optional sections
+//  follow the deltas, so that a decoder does not need to know the
+//  encoder configuration ahead of time. All fields are little endian.
+//
+//  offset 0  : 'M' 'P' 'S' 'D'
+//  offset 4  : version
+//  offset 5  : log2(blockSize)
+//  offset 6  : flags
+//  offset 7  : reserved, zero
+//  offset 8  : width (uint32)
+//  offset 12 : height (uint32)
+
+#ifndef _frame_header_h
+#define _frame_header_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+
+#define FRAME_HEADER_NUM_BYTES 16
+#define FRAME_HEADER_VERSION 1
+
+// One init byte per block follows the deltas
+#define FRAME_HEADER_FLAG_BLOCK_INIT_BYTES 0x1
+// One CRC32C per row of blocks follows the init bytes
+#define FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS 0x2
+// A 2 bit block class for each block follows the checksums
+#define FRAME_HEADER_FLAG_BLOCK_CLASS_BITMAP 0x4
+// The number of block rows in a band follows the header as a uint32,
+// then each band of deltas is followed by its block row checksums.
+// Written and read by StripeEncoder and StripeDecoder.
+#define FRAME_HEADER_FLAG_STRIPED 0x8
+
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  uint32_t blockSize;
+  uint32_t flags;
+} FrameHeader;
+
+static inline
+int FrameHeader_numBlocksInWidth(const FrameHeader *header)
+{
+  return (int) ((header->width + header->blockSize - 1) / header->blockSize);
+}
+
+static inline
+int FrameHeader_numBlocksInHeight(const FrameHeader *header)
+{
+  return (int) ((header->height + header->blockSize - 1) / header->blockSize);
+}
+
+// Number of bytes in every zero padded block of the frame, computed in
+// 64 bits so that it can be checked before any int math is done with it.
+
+static inline
+int64_t FrameHeader_numBlockBytes(const FrameHeader *header)
+{
+  const int64_t blockSize = header->blockSize;
+  const int64_t numBlocksInWidth = (header->width + blockSize - 1) / blockSize;
+  const int64_t numBlocksInHeight = (header->height + blockSize - 1) / blockSize;
+  return numBlocksInWidth * numBlocksInHeight * blockSize * blockSize;
+}
+
+static inline
+void FrameHeader_writeUInt32(uint8_t *out, uint32_t v)
+{
+  out[0] = (uint8_t) (v & 0xFF);
+  out[1] = (uint8_t) ((v >> 8) & 0xFF);
+  out[2] = (uint8_t) ((v >> 16) & 0xFF);
+  out[3] = (uint8_t) ((v >> 24) & 0xFF);
+}
+
+static inline
+uint32_t FrameHeader_readUInt32(const uint8_t *in)
+{
+  return ((uint32_t) in[0]) | (((uint32_t) in[1]) << 8) | (((uint32_t) in[2]) << 16) | (((uint32_t) in[3]) << 24);
+}
+
+// Write FRAME_HEADER_NUM_BYTES bytes, blockSize must be a POT from 2 to 32
+
+static inline
+void FrameHeader_write(const FrameHeader *header, uint8_t *out)
+{
+  int blockSizeLog2 = 0;
+  while ((1u << blockSizeLog2) < header->blockSize) {
+    blockSizeLog2++;
+  }
+
+#if defined(DEBUG)
+  assert((1u << blockSizeLog2) == header->blockSize);
+  assert(blockSizeLog2 >= 1 && blockSizeLog2 <= 5);
+#endif // DEBUG
+
+  out[0] = 'M';
+  out[1] = 'P';
+  out[2] = 'S';
+  out[3] = 'D';
+  out[4] = FRAME_HEADER_VERSION;
+  out[5] = (uint8_t) blockSizeLog2;
+  out[6] = (uint8_t) header->flags;
+  out[7] = 0;
+  FrameHeader_writeUInt32(out + 8, header->width);
+  FrameHeader_writeUInt32(out + 12, header->height);
+}
+
+// Parse a header, returns 0 on success or -1 if the bytes are not
+// a valid header. A valid header has dimensions that fit in an int
+// and a padded block byte count that fits in an int, so readers can
+// do int math on the frame dimensions and byte counts.
+
+static inline
+int FrameHeader_read(const uint8_t *in, int numBytes, FrameHeader *header)
+{
+  if (numBytes < FRAME_HEADER_NUM_BYTES) {
+    fprintf(stderr, "frame header truncated : %d bytes\n", numBytes);
+    return -1;
+  }
+
+  if (in[0] != 'M' || in[1] != 'P' || in[2] != 'S' || in[3] != 'D') {
+    fprintf(stderr, "frame header magic does not match\n");
+    return -1;
+  }
+
+  if (in[4] != FRAME_HEADER_VERSION) {
+    fprintf(stderr, "unsupported frame header version %d\n", in[4]);
+    return -1;
+  }
+
+  // Block sizes from 2x2 to 32x32, the same range the writer accepts
+  if (in[5] < 1 || in[5] > 5) {
+    fprintf(stderr, "invalid frame header block size log2 %d\n", in[5]);
+    return -1;
+  }
+
+  header->blockSize = 1u << in[5];
+  header->flags = in[6];
+  header->width = FrameHeader_readUInt32(in + 8);
+  header->height = FrameHeader_readUInt32(in + 12);
+
+  if (header->width == 0 || header->height == 0 ||
+      header->width > INT_MAX || header->height > INT_MAX) {
+    fprintf(stderr, "invalid frame header dimensions %u x %u\n", header->width, header->height);
+    return -1;
+  }
+
+  if (FrameHeader_numBlockBytes(header) > INT_MAX) {
+    fprintf(stderr, "frame header dimensions %u x %u are too large\n", header->width, header->height);
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif // _frame_header_h
@@ -0,0 +1,447 @@
+//
+//  image_stream.h
+//
+//  MIT Licensed
+//
+//  Inline methods that read uncompressed TGA images and raw 8 bit
+//  images one row at a time, either from a file descriptor with
+//  pread() or from a mmap of the file. Each row is converted to
+//  grayscale as it is read and every group of blockSize rows is
+//  written straight into block order, so the image is never held
+//  in memory in image order. Peak memory is one row of blocks.
+
+#ifndef _image_stream_h
+#define _image_stream_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "block_split.h"
+#include "luma_convert.h"
+
+typedef enum {
+  ImageStreamFormatGray8 = 0,
+  ImageStreamFormatBGR24,
+  ImageStreamFormatBGRA32,
+} ImageStreamFormat;
+
+typedef struct {
+  int fd;
+
+  // Non-NULL when the file has been mapped into memory
+  const uint8_t *mapPtr;
+  size_t mapLength;
+
+  ImageStreamFormat format;
+
+  int width;
+  int height;
+  int bytesPerPixel;
+
+  // TGA rows are stored bottom to top unless descriptor bit 5 is set
+  int isBottomUp;
+
+  // Weights used to convert BGR(A) pixels, BT.601 unless changed after open
+  LumaWeights lumaWeights;
+
+  off_t dataOffset;
+
+  // Holds one row of source pixels when reading with pread()
+  uint8_t *rowBuffer;
+
+  // Holds one row of grayscale bytes after conversion
+  uint8_t *grayBuffer;
+} ImageStream;
+
+// Callback invoked once for each row of blocks, blockRowBytes
+// contains numBlocksInWidth blocks in block order.
+
+typedef void (*ImageStreamBlockRowFunc)(void *ctx,
+                                        int blockRowi,
+                                        const uint8_t *blockRowBytes,
+                                        int numBytes);
+
+// Open path and optionally map it, returns 0 on success
+
+static inline
+int ImageStream_openFile(ImageStream *stream, const char *path, int useMmap)
+{
+  memset(stream, 0, sizeof(ImageStream));
+  stream->fd = -1;
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    fprintf(stderr, "could not open \"%s\" : %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  stream->fd = fd;
+  stream->lumaWeights = LumaWeights_BT601();
+
+  if (useMmap) {
+    struct stat sb;
+
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      void *ptr = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (ptr != MAP_FAILED) {
+        // Rows are consumed in order, so let the kernel read ahead
+        madvise(ptr, (size_t) sb.st_size, MADV_SEQUENTIAL);
+        stream->mapPtr = (const uint8_t *) ptr;
+        stream->mapLength = (size_t) sb.st_size;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Read exactly numBytes at offset, returns 0 on success
+
+static inline
+int ImageStream_pread(ImageStream *stream, void *outPtr, size_t numBytes, off_t offset)
+{
+  if (stream->mapPtr != NULL) {
+    if ((offset + numBytes) > stream->mapLength) {
+      return -1;
+    }
+    memcpy(outPtr, stream->mapPtr + offset, numBytes);
+    return 0;
+  }
+
+  uint8_t *ptr = (uint8_t *) outPtr;
+
+  while (numBytes > 0) {
+    ssize_t numRead = pread(stream->fd, ptr, numBytes, offset);
+
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    } else if (numRead <= 0) {
+      return -1;
+    }
+
+    ptr += numRead;
+    offset += numRead;
+    numBytes -= numRead;
+  }
+
+  return 0;
+}
+
+// Allocate row buffers once the image dimensions are known,
+// returns 0 on success
+
+static inline
+int ImageStream_allocRowBuffers(ImageStream *stream)
+{
+  stream->rowBuffer = (uint8_t *) malloc((size_t) stream->width * stream->bytesPerPixel);
+  stream->grayBuffer = (uint8_t *) malloc((size_t) stream->width);
+
+  if (stream->rowBuffer == NULL || stream->grayBuffer == NULL) {
+    fprintf(stderr, "could not allocate %d byte row buffers\n", stream->width * stream->bytesPerPixel);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Check that the file holds every row of pixels after dataOffset,
+// returns 0 on success
+
+static inline
+int ImageStream_checkLength(ImageStream *stream, const char *path)
+{
+  struct stat sb;
+
+  if (fstat(stream->fd, &sb) != 0) {
+    fprintf(stderr, "could not stat \"%s\" : %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  const int64_t numPixelBytes = (int64_t) stream->width * stream->height * stream->bytesPerPixel;
+
+  if ((int64_t) sb.st_size < ((int64_t) stream->dataOffset + numPixelBytes)) {
+    fprintf(stderr, "\"%s\" is %lld bytes, %d x %d pixels need %lld\n",
+            path, (long long) sb.st_size, stream->width, stream->height,
+            (long long) ((int64_t) stream->dataOffset + numPixelBytes));
+    return -1;
+  }
+
+  return 0;
+}
+
+static inline
+void ImageStream_close(ImageStream *stream)
+{
+  if (stream->mapPtr != NULL) {
+    munmap((void *) stream->mapPtr, stream->mapLength);
+    stream->mapPtr = NULL;
+  }
+  if (stream->fd != -1) {
+    close(stream->fd);
+    stream->fd = -1;
+  }
+  free(stream->rowBuffer);
+  stream->rowBuffer = NULL;
+  free(stream->grayBuffer);
+  stream->grayBuffer = NULL;
+}
+
+// Open an uncompressed TGA file, only the 18 byte header is read here.
+// Supports 8 bit grayscale (type 3) and 24 or 32 bit BGR(A) (type 2)
+// images in either row order. Returns 0 on success.
+
+static inline
+int ImageStream_openTGA(ImageStream *stream, const char *path, int useMmap)
+{
+  if (ImageStream_openFile(stream, path, useMmap) != 0) {
+    return -1;
+  }
+
+  uint8_t header[18];
+
+  if (ImageStream_pread(stream, header, sizeof(header), 0) != 0) {
+    fprintf(stderr, "could not read TGA header from \"%s\"\n", path);
+    ImageStream_close(stream);
+    return -1;
+  }
+
+  const uint8_t idSize = header[0];
+  const uint8_t colorMapType = header[1];
+  const uint8_t imageType = header[2];
+  const uint16_t xOffset = header[8] | (header[9] << 8);
+  const uint16_t yOffset = header[10] | (header[11] << 8);
+  const uint16_t width = header[12] | (header[13] << 8);
+  const uint16_t height = header[14] | (header[15] << 8);
+  const uint8_t bitsPerPixel = header[16];
+  const uint8_t descriptor = header[17];
+
+  int isSupported = 1;
+
+  if (colorMapType != 0 || xOffset != 0 || yOffset != 0 || (descriptor & 0x10) != 0) {
+    isSupported = 0;
+  } else if (imageType == 3 && bitsPerPixel == 8) {
+    stream->format = ImageStreamFormatGray8;
+  } else if (imageType == 2 && bitsPerPixel == 24) {
+    stream->format = ImageStreamFormatBGR24;
+  } else if (imageType == 2 && bitsPerPixel == 32) {
+    stream->format = ImageStreamFormatBGRA32;
+  } else {
+    isSupported = 0;
+  }
+
+  if (!isSupported || width == 0 || height == 0) {
+    fprintf(stderr, "only uncompressed 8 bit gray or 24/32 bit BGR(A) TGA images are supported\n");
+    ImageStream_close(stream);
+    return -1;
+  }
+
+  stream->width = width;
+  stream->height = height;
+  stream->bytesPerPixel = bitsPerPixel / 8;
+  stream->isBottomUp = ((descriptor & 0x20) == 0);
+  stream->dataOffset = sizeof(header) + idSize;
+
+  if (ImageStream_checkLength(stream, path) != 0 ||
+      ImageStream_allocRowBuffers(stream) != 0) {
+    ImageStream_close(stream);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Open a raw file of (width * height) 8 bit grayscale values stored
+// top to bottom with no header. The file must hold at least that many
+// bytes. Returns 0 on success.
+
+static inline
+int ImageStream_openRaw(ImageStream *stream, const char *path, int width, int height, int useMmap)
+{
+  if (width <= 0 || height <= 0) {
+    memset(stream, 0, sizeof(ImageStream));
+    stream->fd = -1;
+    fprintf(stderr, "invalid raw image dimensions %d x %d\n", width, height);
+    return -1;
+  }
+
+  if (ImageStream_openFile(stream, path, useMmap) != 0) {
+    return -1;
+  }
+
+  stream->format = ImageStreamFormatGray8;
+  stream->width = width;
+  stream->height = height;
+  stream->bytesPerPixel = 1;
+  stream->isBottomUp = 0;
+  stream->dataOffset = 0;
+
+  if (ImageStream_checkLength(stream, path) != 0 ||
+      ImageStream_allocRowBuffers(stream) != 0) {
+    ImageStream_close(stream);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Read row rowi, counting from the top of the image, and return a
+// pointer to the source pixels for that row. When the file is mapped
+// the returned pointer points into the map and nothing is copied.
+// Returns NULL if the row could not be read.
+
+static inline
+const uint8_t* ImageStream_readRow(ImageStream *stream, int rowi)
+{
+#if defined(DEBUG)
+  assert(rowi >= 0 && rowi < stream->height);
+#endif // DEBUG
+
+  const int fileRowi = stream->isBottomUp ? (stream->height - 1 - rowi) : rowi;
+  const size_t numRowBytes = stream->width * stream->bytesPerPixel;
+  const off_t offset = stream->dataOffset + ((off_t) fileRowi * numRowBytes);
+
+  if (stream->mapPtr != NULL) {
+    if ((offset + numRowBytes) > stream->mapLength) {
+      return NULL;
+    }
+    return stream->mapPtr + offset;
+  }
+
+  if (ImageStream_pread(stream, stream->rowBuffer, numRowBytes, offset) != 0) {
+    return NULL;
+  }
+
+  return stream->rowBuffer;
+}
+
+// Read row rowi and return a pointer to width grayscale bytes
+
+static inline
+const uint8_t* ImageStream_readGrayRow(ImageStream *stream, int rowi)
+{
+  const uint8_t *srcPtr = ImageStream_readRow(stream, rowi);
+
+  if (srcPtr == NULL || stream->format == ImageStreamFormatGray8) {
+    return srcPtr;
+  }
+
+  LumaConvert_toY8(srcPtr, stream->width, stream->bytesPerPixel, stream->lumaWeights, stream->grayBuffer);
+  return stream->grayBuffer;
+}
+
+// Read the blockSize image rows that make up row of blocks blockRowi
+// and write them to outBlockRowBytes in block order. Rows and columns
+// past the image bounds are filled with zeroValue. Returns 0 on success.
+
+static inline
+int ImageStream_readBlockRow(ImageStream *stream,
+                             int blockSize,
+                             int blockRowi,
+                             uint8_t *outBlockRowBytes,
+                             uint8_t zeroValue)
+{
+  const int numBlocksInWidth = (stream->width + blockSize - 1) / blockSize;
+
+  for ( int rowInBlock = 0; rowInBlock < blockSize; rowInBlock++ ) {
+    const int rowi = (blockRowi * blockSize) + rowInBlock;
+
+    if (rowi >= stream->height) {
+      BlockSplit_zeroRow(blockSize, numBlocksInWidth, rowInBlock, outBlockRowBytes, zeroValue);
+      continue;
+    }
+
+    const uint8_t *srcPtr = ImageStream_readRow(stream, rowi);
+
+    if (srcPtr == NULL) {
+      return -1;
+    }
+
+    if (stream->format == ImageStreamFormatGray8) {
+      BlockSplit_row(srcPtr, stream->width, blockSize, numBlocksInWidth, rowInBlock, outBlockRowBytes, zeroValue);
+    } else {
+      // Luma is written directly into block order
+      LumaConvert_rowToBlockRow(srcPtr, stream->width, stream->bytesPerPixel, stream->lumaWeights,
+                                blockSize, numBlocksInWidth, rowInBlock,
+                                outBlockRowBytes, zeroValue, stream->grayBuffer);
+    }
+  }
+
+  return 0;
+}
+
+// Stream the whole image through a single row of blocks buffer,
+// func is invoked as soon as each row of blocks has been read so
+// that ingest overlaps with reading the file. Returns 0 on success.
+
+static inline
+int ImageStream_splitIntoBlockRows(ImageStream *stream,
+                                   int blockSize,
+                                   uint8_t zeroValue,
+                                   ImageStreamBlockRowFunc func,
+                                   void *ctx)
+{
+  const int numBlocksInWidth = (stream->width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (stream->height + blockSize - 1) / blockSize;
+  const int numBytes = BlockSplit_blockRowNumBytes(blockSize, numBlocksInWidth);
+
+  uint8_t *blockRowBytes = (uint8_t *) malloc(numBytes);
+
+  if (blockRowBytes == NULL) {
+    fprintf(stderr, "could not allocate %d byte row of blocks\n", numBytes);
+    return -1;
+  }
+
+  int status = 0;
+
+  for ( int blockRowi = 0; blockRowi < numBlocksInHeight; blockRowi++ ) {
+    status = ImageStream_readBlockRow(stream, blockSize, blockRowi, blockRowBytes, zeroValue);
+
+    if (status != 0) {
+      break;
+    }
+
+    func(ctx, blockRowi, blockRowBytes, numBytes);
+  }
+
+  free(blockRowBytes);
+
+  return status;
+}
+
+// Stream the whole image directly into a block order output buffer
+// that is large enough to hold every zero padded block. No image
+// order copy of the frame is made. Returns 0 on success.
+
+static inline
+int ImageStream_splitIntoBlocks(ImageStream *stream,
+                                int blockSize,
+                                uint8_t *outBlockBytes,
+                                uint8_t zeroValue)
+{
+  const int numBlocksInWidth = (stream->width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (stream->height + blockSize - 1) / blockSize;
+  const int numBytes = BlockSplit_blockRowNumBytes(blockSize, numBlocksInWidth);
+
+  for ( int blockRowi = 0; blockRowi < numBlocksInHeight; blockRowi++ ) {
+    uint8_t *blockRowBytes = outBlockBytes + (blockRowi * numBytes);
+
+    if (ImageStream_readBlockRow(stream, blockSize, blockRowi, blockRowBytes, zeroValue) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+#endif // _image_stream_h
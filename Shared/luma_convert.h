@@ -0,0 +1,297 @@
+//
+//  luma_convert.h
+//
+//  MIT Licensed
+//
+//  Inline methods that convert BGRA or BGR pixels to 8 bit luma (Y)
+//  values with fixed point BT.601 or BT.709 weights. NEON is used on
+//  ARM, SSE2 on x86, and a scalar loop handles the tail and any other
+//  platform. Every path computes ((wR*R + wG*G + wB*B + 128) >> 8) so
+//  output is bit identical no matter which path was taken.
+//
+//  A fused mode writes luma values directly into block order so that
+//  a full frame of image order grayscale bytes is never generated.
+
+#ifndef _luma_convert_h
+#define _luma_convert_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LUMA_CONVERT_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LUMA_CONVERT_SSE2 1
+#endif
+
+#include "block_split.h"
+
+// Weights are scaled by 256 and must sum to 256 so that a white
+// pixel maps to 255 and the 16 bit NEON accumulator cannot overflow.
+
+typedef struct {
+  uint8_t b;
+  uint8_t g;
+  uint8_t r;
+} LumaWeights;
+
+// BT.601 : 0.299 R + 0.587 G + 0.114 B
+
+static inline
+LumaWeights LumaWeights_BT601(void)
+{
+  LumaWeights w = { 29, 150, 77 };
+  return w;
+}
+
+// BT.709 : 0.2126 R + 0.7152 G + 0.0722 B
+
+static inline
+LumaWeights LumaWeights_BT709(void)
+{
+  LumaWeights w = { 19, 183, 54 };
+  return w;
+}
+
+// Input stored as RGBA or RGB can be converted by swapping the
+// B and R weights rather than swizzling pixels.
+
+static inline
+LumaWeights LumaWeights_swapRB(LumaWeights w)
+{
+  LumaWeights s = { w.r, w.g, w.b };
+  return s;
+}
+
+static inline
+uint8_t LumaConvert_pixel(uint32_t B, uint32_t G, uint32_t R, LumaWeights w)
+{
+  return (uint8_t) (((w.r * R) + (w.g * G) + (w.b * B) + 128) >> 8);
+}
+
+// Scalar conversion of numPixels pixels that are bytesPerPixel apart
+
+static inline
+void LumaConvert_scalar(const uint8_t *inPixels,
+                        int numPixels,
+                        int bytesPerPixel,
+                        LumaWeights w,
+                        uint8_t *outY)
+{
+  for ( int i = 0; i < numPixels; i++ ) {
+    const uint8_t *p = inPixels + (i * bytesPerPixel);
+    outY[i] = LumaConvert_pixel(p[0], p[1], p[2], w);
+  }
+}
+
+// Convert numPixels 32 bit BGRA pixels to luma
+
+static inline
+void LumaConvert_BGRA8ToY8(const uint8_t *inPixels,
+                           int numPixels,
+                           LumaWeights w,
+                           uint8_t *outY)
+{
+  int i = 0;
+
+#if defined(LUMA_CONVERT_NEON)
+  const uint8x8_t wB = vdup_n_u8(w.b);
+  const uint8x8_t wG = vdup_n_u8(w.g);
+  const uint8x8_t wR = vdup_n_u8(w.r);
+
+  for ( ; (i + 16) <= numPixels; i += 16 ) {
+    uint8x16x4_t bgra = vld4q_u8(inPixels + (i * 4));
+
+    uint16x8_t lo = vmull_u8(vget_low_u8(bgra.val[0]), wB);
+    lo = vmlal_u8(lo, vget_low_u8(bgra.val[1]), wG);
+    lo = vmlal_u8(lo, vget_low_u8(bgra.val[2]), wR);
+
+    uint16x8_t hi = vmull_u8(vget_high_u8(bgra.val[0]), wB);
+    hi = vmlal_u8(hi, vget_high_u8(bgra.val[1]), wG);
+    hi = vmlal_u8(hi, vget_high_u8(bgra.val[2]), wR);
+
+    // Rounding narrow shift is (x + 128) >> 8
+    vst1q_u8(outY + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+  }
+#elif defined(LUMA_CONVERT_SSE2)
+  // Each pair of 16 bit lanes is multiplied by (wB, wG) and (wR, 0)
+  // with madd, then the two 32 bit partial sums for a pixel are added.
+
+  const __m128i W = _mm_setr_epi16(w.b, w.g, w.r, 0, w.b, w.g, w.r, 0);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(128);
+
+  for ( ; (i + 16) <= numPixels; i += 16 ) {
+    __m128i sums[4];
+
+    for ( int j = 0; j < 4; j++ ) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (inPixels + ((i + (j * 4)) * 4)));
+
+      __m128i mlo = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), W);
+      __m128i mhi = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), W);
+
+      __m128 flo = _mm_castsi128_ps(mlo);
+      __m128 fhi = _mm_castsi128_ps(mhi);
+
+      __m128i bg = _mm_castps_si128(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0)));
+      __m128i r = _mm_castps_si128(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1)));
+
+      __m128i sum = _mm_add_epi32(_mm_add_epi32(bg, r), round);
+      sums[j] = _mm_srli_epi32(sum, 8);
+    }
+
+    __m128i y16lo = _mm_packs_epi32(sums[0], sums[1]);
+    __m128i y16hi = _mm_packs_epi32(sums[2], sums[3]);
+
+    _mm_storeu_si128((__m128i *) (outY + i), _mm_packus_epi16(y16lo, y16hi));
+  }
+#endif
+
+  LumaConvert_scalar(inPixels + (i * 4), numPixels - i, 4, w, outY + i);
+}
+
+// Convert numPixels 24 bit BGR pixels to luma
+
+static inline
+void LumaConvert_BGR8ToY8(const uint8_t *inPixels,
+                          int numPixels,
+                          LumaWeights w,
+                          uint8_t *outY)
+{
+  int i = 0;
+
+#if defined(LUMA_CONVERT_NEON)
+  const uint8x8_t wB = vdup_n_u8(w.b);
+  const uint8x8_t wG = vdup_n_u8(w.g);
+  const uint8x8_t wR = vdup_n_u8(w.r);
+
+  for ( ; (i + 16) <= numPixels; i += 16 ) {
+    uint8x16x3_t bgr = vld3q_u8(inPixels + (i * 3));
+
+    uint16x8_t lo = vmull_u8(vget_low_u8(bgr.val[0]), wB);
+    lo = vmlal_u8(lo, vget_low_u8(bgr.val[1]), wG);
+    lo = vmlal_u8(lo, vget_low_u8(bgr.val[2]), wR);
+
+    uint16x8_t hi = vmull_u8(vget_high_u8(bgr.val[0]), wB);
+    hi = vmlal_u8(hi, vget_high_u8(bgr.val[1]), wG);
+    hi = vmlal_u8(hi, vget_high_u8(bgr.val[2]), wR);
+
+    vst1q_u8(outY + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+  }
+#endif
+
+  LumaConvert_scalar(inPixels + (i * 3), numPixels - i, 3, w, outY + i);
+}
+
+// Convert numPixels BGR or BGRA pixels depending on bytesPerPixel
+
+static inline
+void LumaConvert_toY8(const uint8_t *inPixels,
+                      int numPixels,
+                      int bytesPerPixel,
+                      LumaWeights w,
+                      uint8_t *outY)
+{
+  if (bytesPerPixel == 4) {
+    LumaConvert_BGRA8ToY8(inPixels, numPixels, w, outY);
+  } else if (bytesPerPixel == 3) {
+    LumaConvert_BGR8ToY8(inPixels, numPixels, w, outY);
+  } else {
+    LumaConvert_scalar(inPixels, numPixels, bytesPerPixel, w, outY);
+  }
+}
+
+// Fused conversion of one row of pixels into one row of each block in
+// a row of blocks. When blockSize is a multiple of 16 each block row
+// segment is converted in place with full width vectors. Otherwise
+// the row is converted into tmpRow, which must hold width bytes and
+// stays in L1, and then scattered into blocks.
+
+static inline
+void LumaConvert_rowToBlockRow(const uint8_t *inPixels,
+                               int width,
+                               int bytesPerPixel,
+                               LumaWeights w,
+                               int blockSize,
+                               int numBlocksInWidth,
+                               int rowInBlock,
+                               uint8_t *outBlockRowBytes,
+                               uint8_t zeroValue,
+                               uint8_t *tmpRow)
+{
+  if ((blockSize % 16) != 0) {
+    LumaConvert_toY8(inPixels, width, bytesPerPixel, w, tmpRow);
+    BlockSplit_row(tmpRow, width, blockSize, numBlocksInWidth, rowInBlock, outBlockRowBytes, zeroValue);
+    return;
+  }
+
+  const int numBytesInOneBlock = blockSize * blockSize;
+
+  uint8_t *outPtr = outBlockRowBytes + (rowInBlock * blockSize);
+
+  int col = 0;
+
+  for ( int blocki = 0; blocki < numBlocksInWidth; blocki++ ) {
+    int numToConvert = width - col;
+
+    if (numToConvert >= blockSize) {
+      numToConvert = blockSize;
+    } else if (numToConvert < 0) {
+      numToConvert = 0;
+    }
+
+    LumaConvert_toY8(inPixels + (col * bytesPerPixel), numToConvert, bytesPerPixel, w, outPtr);
+
+    if (numToConvert < blockSize) {
+      memset(outPtr + numToConvert, zeroValue, blockSize - numToConvert);
+    }
+
+    col += blockSize;
+    outPtr += numBytesInOneBlock;
+  }
+}
+
+// Fused conversion of a whole in memory frame of BGRA pixels into zero
+// padded block order luma. bytesPerRow may include row padding.
+
+static inline
+void LumaConvert_BGRA8FrameToBlocks(const uint8_t *inPixels,
+                                    int width,
+                                    int height,
+                                    int bytesPerRow,
+                                    LumaWeights w,
+                                    int blockSize,
+                                    uint8_t *outBlockBytes,
+                                    uint8_t zeroValue)
+{
+  const int numBlocksInWidth = (width + blockSize - 1) / blockSize;
+  const int numBlocksInHeight = (height + blockSize - 1) / blockSize;
+  const int numBlockRowBytes = BlockSplit_blockRowNumBytes(blockSize, numBlocksInWidth);
+
+  uint8_t *tmpRow = (uint8_t *) malloc(width);
+
+  for ( int blockRowi = 0; blockRowi < numBlocksInHeight; blockRowi++ ) {
+    uint8_t *blockRowBytes = outBlockBytes + (blockRowi * numBlockRowBytes);
+
+    for ( int rowInBlock = 0; rowInBlock < blockSize; rowInBlock++ ) {
+      const int rowi = (blockRowi * blockSize) + rowInBlock;
+
+      if (rowi >= height) {
+        BlockSplit_zeroRow(blockSize, numBlocksInWidth, rowInBlock, blockRowBytes, zeroValue);
+      } else {
+        LumaConvert_rowToBlockRow(inPixels + (rowi * bytesPerRow), width, 4, w,
+                                  blockSize, numBlocksInWidth, rowInBlock,
+                                  blockRowBytes, zeroValue, tmpRow);
+      }
+    }
+  }
+
+  free(tmpRow);
+}
+
+#endif // _luma_convert_h
@@ -0,0 +1,131 @@
+//
+//  parallel_for.h
+//
+//  MIT Licensed
+//
+//  Inline methods that split a range of work items into contiguous
+//  chunks and process each chunk on its own pthread. The calling
+//  thread processes the first chunk, so a single thread run has no
+//  thread creation overhead. No heap memory is allocated.
+
+#ifndef _parallel_for_h
+#define _parallel_for_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define PARALLEL_FOR_MAX_THREADS 64
+
+// Process items in the range [start, end)
+
+typedef void (*ParallelForFunc)(void *ctx, int threadi, int start, int end);
+
+typedef struct {
+  ParallelForFunc func;
+  void *ctx;
+  int threadi;
+  int start;
+  int end;
+} ParallelForChunk;
+
+static inline
+void* ParallelFor_threadMain(void *arg)
+{
+  ParallelForChunk *chunk = (ParallelForChunk *) arg;
+  chunk->func(chunk->ctx, chunk->threadi, chunk->start, chunk->end);
+  return NULL;
+}
+
+// Number of online cores, always at least 1
+
+static inline
+int ParallelFor_numCores(void)
+{
+  long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (numCores < 1) {
+    numCores = 1;
+  } else if (numCores > PARALLEL_FOR_MAX_THREADS) {
+    numCores = PARALLEL_FOR_MAX_THREADS;
+  }
+
+  return (int) numCores;
+}
+
+// Split numItems into at most numThreads contiguous chunks and invoke
+// func once per chunk. Returns the number of chunks that were run.
+
+static inline
+int ParallelFor_run(int numThreads, int numItems, ParallelForFunc func, void *ctx)
+{
+  if (numItems <= 0) {
+    return 0;
+  }
+
+  if (numThreads > numItems) {
+    numThreads = numItems;
+  }
+  if (numThreads > PARALLEL_FOR_MAX_THREADS) {
+    numThreads = PARALLEL_FOR_MAX_THREADS;
+  }
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+
+  if (numThreads == 1) {
+    func(ctx, 0, 0, numItems);
+    return 1;
+  }
+
+  ParallelForChunk chunks[PARALLEL_FOR_MAX_THREADS];
+  pthread_t threads[PARALLEL_FOR_MAX_THREADS];
+  int isRunning[PARALLEL_FOR_MAX_THREADS];
+
+  const int numPerThread = numItems / numThreads;
+  const int numOver = numItems % numThreads;
+
+  int start = 0;
+
+  for ( int threadi = 0; threadi < numThreads; threadi++ ) {
+    // The first numOver chunks get one extra item
+    int count = numPerThread + ((threadi < numOver) ? 1 : 0);
+
+    chunks[threadi].func = func;
+    chunks[threadi].ctx = ctx;
+    chunks[threadi].threadi = threadi;
+    chunks[threadi].start = start;
+    chunks[threadi].end = start + count;
+
+    start += count;
+  }
+
+#if defined(DEBUG)
+  assert(start == numItems);
+#endif // DEBUG
+
+  for ( int threadi = 1; threadi < numThreads; threadi++ ) {
+    int status = pthread_create(&threads[threadi], NULL, ParallelFor_threadMain, &chunks[threadi]);
+    isRunning[threadi] = (status == 0);
+
+    if (!isRunning[threadi]) {
+      // Could not create a thread, process this chunk on the caller
+      ParallelFor_threadMain(&chunks[threadi]);
+    }
+  }
+
+  ParallelFor_threadMain(&chunks[0]);
+
+  for ( int threadi = 1; threadi < numThreads; threadi++ ) {
+    if (isRunning[threadi]) {
+      pthread_join(threads[threadi], NULL);
+    }
+  }
+
+  return numThreads;
+}
+
+#endif // _parallel_for_h
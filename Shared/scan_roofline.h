@@ -0,0 +1,828 @@
+//
+//  scan_roofline.h
+//
+//  MIT Licensed
+//
+//  Memory traffic and operation counts for each level of the reduce and
+//  down sweep schedule that MetalPrefixSumRenderContext renders, along
+//  with the same schedule run on the CPU with prefix_sum.h and each CPU
+//  scan strategy. Counts are compared against measured timings and a
+//  measured memory bandwidth ceiling to print a roofline table, so that
+//  levels far below the roof (pass overhead, scattered reads) can be
+//  fused or dropped.
+//
+//  The GPU counts come from running the coordinate math of each shader
+//  for every fragment. The shaders flatten a fragment to an offset and
+//  then offset_to_coords() turns the offset back into (X,Y) in the input
+//  texture width, so neighboring fragments can read texels in different
+//  rows. A read is counted as scattered when it is not in the same row
+//  and within 2 texels of the previous read from the same texture in
+//  raster order. Traffic assumes fragments are shaded in 8x8 tiles that
+//  each fetch every 8x8 input texel tile they touch once, with no reuse
+//  between output tiles.
+
+#ifndef _scan_roofline_h
+#define _scan_roofline_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "prefix_sum.h"
+#include "scan_strategy.h"
+#include "block_size_select.h"
+
+#define SCAN_ROOFLINE_MAX_LEVELS 48
+#define SCAN_ROOFLINE_MAX_BUFFERS 24
+
+// Buffers a schedule reads and writes, each reduce level adds a
+// reduce buffer and a sweep buffer of the same dimensions.
+
+#define SCAN_ROOFLINE_BUFFER_INPUT 0
+#define SCAN_ROOFLINE_BUFFER_OUTPUT 1
+#define SCAN_ROOFLINE_BUFFER_ZERO 2
+
+#define SCAN_ROOFLINE_KIND_REDUCE 0
+#define SCAN_ROOFLINE_KIND_SWEEP 1
+#define SCAN_ROOFLINE_KIND_INCLUSIVE_SWEEP 2
+// Whole frame CPU scan strategy, not a level of the schedule
+#define SCAN_ROOFLINE_KIND_SCAN 3
+
+// Fragments are shaded and input texels are fetched in square tiles,
+// 8x8 R8 texels is one 64 byte fetch.
+#define SCAN_ROOFLINE_TILE_DIM 8
+
+// ALU ops per fragment for calc_gid_from_frag_norm_coord(), the flat
+// offset, and the output conversion, and ops for each texture read:
+// offset_to_coords(), uint8_from_half() and the add.
+#define SCAN_ROOFLINE_OPS_PER_FRAGMENT 9
+#define SCAN_ROOFLINE_OPS_PER_READ 5
+
+// A level is reported as latency bound when it reaches less than
+// this fraction of its roof.
+#define SCAN_ROOFLINE_LATENCY_FRACTION 0.1
+
+typedef struct {
+  char name[32];
+  int kind;
+  int level;
+  // Buffer ids, in2Buffer is -1 for a reduce
+  int inBuffer;
+  int in2Buffer;
+  int outBuffer;
+
+  int64_t numFragments;
+  int64_t numReads;
+  int64_t numScatteredReads;
+  // Bytes the pass needs to read and write
+  int64_t bytesRead;
+  int64_t bytesWritten;
+  // Bytes moved once tile fetches are counted
+  int64_t trafficBytes;
+  int64_t numOps;
+
+  // Zero until timed
+  double measuredNs;
+} ScanRooflineLevel;
+
+typedef struct {
+  int width;
+  int height;
+  int blockSize;
+  int numBlocksInWidth;
+  int numBlocksInHeight;
+
+  int numBuffers;
+  int bufferWidth[SCAN_ROOFLINE_MAX_BUFFERS];
+  int bufferHeight[SCAN_ROOFLINE_MAX_BUFFERS];
+
+  int numLevels;
+  ScanRooflineLevel levels[SCAN_ROOFLINE_MAX_LEVELS];
+} ScanRooflineSchedule;
+
+// A texel read by one fragment
+
+typedef struct {
+  int buffer;
+  int x;
+  int y;
+} ScanRooflineRead;
+
+static inline
+int ScanRoofline_log2(int value)
+{
+  int log2 = 0;
+  while ((1 << log2) < value) {
+    log2 += 1;
+  }
+  return log2;
+}
+
+static inline
+int ScanRoofline_addBuffer(ScanRooflineSchedule *schedule, int width, int height)
+{
+  int bufferi = schedule->numBuffers++;
+#if defined(DEBUG)
+  assert(bufferi < SCAN_ROOFLINE_MAX_BUFFERS);
+#endif // DEBUG
+  schedule->bufferWidth[bufferi] = width;
+  schedule->bufferHeight[bufferi] = height;
+  return bufferi;
+}
+
+static inline
+ScanRooflineLevel* ScanRoofline_addLevel(ScanRooflineSchedule *schedule,
+                                         const char *name,
+                                         int kind,
+                                         int level,
+                                         int inBuffer,
+                                         int in2Buffer,
+                                         int outBuffer)
+{
+#if defined(DEBUG)
+  assert(schedule->numLevels < SCAN_ROOFLINE_MAX_LEVELS);
+#endif // DEBUG
+
+  ScanRooflineLevel *rl = &schedule->levels[schedule->numLevels++];
+  memset(rl, 0, sizeof(ScanRooflineLevel));
+  snprintf(rl->name, sizeof(rl->name), "%s", name);
+  rl->kind = kind;
+  rl->level = level;
+  rl->inBuffer = inBuffer;
+  rl->in2Buffer = in2Buffer;
+  rl->outBuffer = outBuffer;
+  return rl;
+}
+
+// Texels read by the fragment at (x,y) of a level, this is the same
+// math as the reduce, down sweep and inclusive down sweep shaders.
+// Returns the number of reads, at most 3.
+
+static inline
+int ScanRoofline_fragmentReads(const ScanRooflineSchedule *schedule,
+                               const ScanRooflineLevel *rl,
+                               int x,
+                               int y,
+                               ScanRooflineRead *reads)
+{
+  const int outWidth = schedule->bufferWidth[rl->outBuffer];
+  const int inWidth = schedule->bufferWidth[rl->inBuffer];
+  const int blockDim = schedule->blockSize * schedule->blockSize;
+
+  uint32_t offset = (uint32_t) ((y * outWidth) + x);
+  int numReads = 0;
+
+  if (rl->kind == SCAN_ROOFLINE_KIND_REDUCE) {
+    offset *= 2;
+
+    for ( int i = 0; i < 2; i++ ) {
+      reads[numReads].buffer = rl->inBuffer;
+      reads[numReads].x = (offset + i) % inWidth;
+      reads[numReads].y = (offset + i) / inWidth;
+      numReads += 1;
+    }
+
+    return numReads;
+  }
+
+  const int in2Width = schedule->bufferWidth[rl->in2Buffer];
+
+  int isLastOne = 0;
+
+  if (rl->kind == SCAN_ROOFLINE_KIND_INCLUSIVE_SWEEP) {
+    offset += 1;
+    isLastOne = ((offset & (blockDim - 1)) == 0);
+    if (isLastOne) {
+      offset -= 1;
+    }
+  }
+
+  const uint32_t t1Offset = offset / 2;
+
+  reads[numReads].buffer = rl->inBuffer;
+  reads[numReads].x = t1Offset % inWidth;
+  reads[numReads].y = t1Offset / inWidth;
+  numReads += 1;
+
+  if ((offset & 0x1) != 0) {
+    reads[numReads].buffer = rl->in2Buffer;
+    reads[numReads].x = (offset - 1) % in2Width;
+    reads[numReads].y = (offset - 1) / in2Width;
+    numReads += 1;
+  }
+
+  if (isLastOne) {
+    reads[numReads].buffer = rl->in2Buffer;
+    reads[numReads].x = x;
+    reads[numReads].y = y;
+    numReads += 1;
+  }
+
+  return numReads;
+}
+
+// Count reads, scattered reads, tile traffic and ops for a GPU level
+
+static inline
+void ScanRoofline_countGPULevel(const ScanRooflineSchedule *schedule, ScanRooflineLevel *rl)
+{
+  const int outWidth = schedule->bufferWidth[rl->outBuffer];
+  const int outHeight = schedule->bufferHeight[rl->outBuffer];
+
+  ScanRooflineRead reads[3];
+
+  rl->numFragments = (int64_t) outWidth * outHeight;
+  rl->numReads = 0;
+  rl->numScatteredReads = 0;
+
+  // Raster order pass for the read count and scattered reads
+
+  for ( int y = 0; y < outHeight; y++ ) {
+    int lastX[SCAN_ROOFLINE_MAX_BUFFERS];
+    int lastY[SCAN_ROOFLINE_MAX_BUFFERS];
+
+    for ( int i = 0; i < schedule->numBuffers; i++ ) {
+      lastY[i] = -1;
+    }
+
+    for ( int x = 0; x < outWidth; x++ ) {
+      const int numReads = ScanRoofline_fragmentReads(schedule, rl, x, y, reads);
+
+      for ( int i = 0; i < numReads; i++ ) {
+        const ScanRooflineRead *read = &reads[i];
+
+        if (lastY[read->buffer] != -1) {
+          const int dx = read->x - lastX[read->buffer];
+
+          if (read->y != lastY[read->buffer] || dx > 2 || dx < -2) {
+            rl->numScatteredReads += 1;
+          }
+        }
+
+        lastX[read->buffer] = read->x;
+        lastY[read->buffer] = read->y;
+      }
+
+      rl->numReads += numReads;
+    }
+  }
+
+  // Tile pass, each output tile fetches the distinct input tiles it reads
+
+  int64_t numTileFetches = 0;
+
+  const int maxDistinct = SCAN_ROOFLINE_TILE_DIM * SCAN_ROOFLINE_TILE_DIM * 3;
+  int64_t distinct[SCAN_ROOFLINE_TILE_DIM * SCAN_ROOFLINE_TILE_DIM * 3];
+
+  for ( int tileY = 0; tileY < outHeight; tileY += SCAN_ROOFLINE_TILE_DIM ) {
+    for ( int tileX = 0; tileX < outWidth; tileX += SCAN_ROOFLINE_TILE_DIM ) {
+      int numDistinct = 0;
+
+      for ( int y = tileY; y < tileY + SCAN_ROOFLINE_TILE_DIM && y < outHeight; y++ ) {
+        for ( int x = tileX; x < tileX + SCAN_ROOFLINE_TILE_DIM && x < outWidth; x++ ) {
+          const int numReads = ScanRoofline_fragmentReads(schedule, rl, x, y, reads);
+
+          for ( int i = 0; i < numReads; i++ ) {
+            const int64_t key = ((int64_t) reads[i].buffer << 48) |
+                                ((int64_t) (reads[i].y / SCAN_ROOFLINE_TILE_DIM) << 24) |
+                                (int64_t) (reads[i].x / SCAN_ROOFLINE_TILE_DIM);
+
+            int found = 0;
+
+            for ( int j = numDistinct - 1; j >= 0; j-- ) {
+              if (distinct[j] == key) {
+                found = 1;
+                break;
+              }
+            }
+
+            if (!found && numDistinct < maxDistinct) {
+              distinct[numDistinct++] = key;
+            }
+          }
+        }
+      }
+
+      numTileFetches += numDistinct;
+    }
+  }
+
+  rl->bytesRead = rl->numReads;
+  rl->bytesWritten = rl->numFragments;
+  rl->trafficBytes = (numTileFetches * SCAN_ROOFLINE_TILE_DIM * SCAN_ROOFLINE_TILE_DIM) + rl->bytesWritten;
+  rl->numOps = (rl->numFragments * SCAN_ROOFLINE_OPS_PER_FRAGMENT) + (rl->numReads * SCAN_ROOFLINE_OPS_PER_READ);
+}
+
+// Counts for the same level run on the CPU with PrefixSum_reduce or
+// PrefixSum_downsweep. Both walk flat arrays in order, so no read is
+// scattered and traffic is just the bytes read and written. Ops are
+// an add and an index shift for each output byte.
+
+static inline
+void ScanRoofline_countCPULevel(const ScanRooflineSchedule *schedule, ScanRooflineLevel *rl)
+{
+  const int64_t numOut = (int64_t) schedule->bufferWidth[rl->outBuffer] * schedule->bufferHeight[rl->outBuffer];
+
+  rl->numFragments = numOut;
+
+  if (rl->kind == SCAN_ROOFLINE_KIND_REDUCE) {
+    rl->numReads = numOut * 2;
+  } else {
+    // t1 for every output and t2 for odd outputs
+    rl->numReads = numOut + (numOut / 2);
+  }
+
+  rl->numScatteredReads = 0;
+  rl->bytesRead = rl->numReads;
+  rl->bytesWritten = numOut;
+  rl->trafficBytes = rl->bytesRead + rl->bytesWritten;
+  rl->numOps = numOut * 2;
+}
+
+// Fill the schedule that setupRenderTextures and renderPrefixSum use
+// for a width x height block order texture of square blocks. Each
+// reduce halves the block width of a square block or the block height
+// of a rect block until the next level would be 1x1 per block. The
+// down sweep then walks back up starting from a zero texture, and a
+// final sweep writes the output. When isGPU is set, counts come from
+// the shader math, otherwise from the CPU loops. Returns 0 on success.
+
+static inline
+int ScanRoofline_buildSchedule(ScanRooflineSchedule *schedule,
+                               int width,
+                               int height,
+                               int blockSize,
+                               int isGPU,
+                               int isExclusive)
+{
+  memset(schedule, 0, sizeof(ScanRooflineSchedule));
+
+  if (blockSize < 2 || (blockSize & (blockSize - 1)) != 0 ||
+      (width % blockSize) != 0 || (height % blockSize) != 0) {
+    fprintf(stderr, "roofline needs a POT block size that divides %d x %d\n", width, height);
+    return -1;
+  }
+
+  schedule->width = width;
+  schedule->height = height;
+  schedule->blockSize = blockSize;
+  schedule->numBlocksInWidth = width / blockSize;
+  schedule->numBlocksInHeight = height / blockSize;
+
+  ScanRoofline_addBuffer(schedule, width, height);
+  ScanRoofline_addBuffer(schedule, width, height);
+  ScanRoofline_addBuffer(schedule, schedule->numBlocksInWidth, schedule->numBlocksInHeight);
+
+  // Reduce levels
+
+  int reducedBlockWidth = blockSize;
+  int reducedBlockHeight = blockSize;
+
+  int inBuffer = SCAN_ROOFLINE_BUFFER_INPUT;
+  int numReduceLevels = 0;
+  int reduceBuffers[SCAN_ROOFLINE_MAX_BUFFERS];
+  int sweepBuffers[SCAN_ROOFLINE_MAX_BUFFERS];
+
+  const char *prefix = isGPU ? "gpu" : "cpu";
+  char name[32];
+
+  while (1) {
+    if (reducedBlockWidth == reducedBlockHeight) {
+      reducedBlockWidth /= 2;
+    } else {
+      reducedBlockHeight /= 2;
+    }
+
+    if (reducedBlockWidth == 1 && reducedBlockHeight == 1) {
+      break;
+    }
+
+    const int levelWidth = reducedBlockWidth * schedule->numBlocksInWidth;
+    const int levelHeight = reducedBlockHeight * schedule->numBlocksInHeight;
+
+    reduceBuffers[numReduceLevels] = ScanRoofline_addBuffer(schedule, levelWidth, levelHeight);
+    sweepBuffers[numReduceLevels] = ScanRoofline_addBuffer(schedule, levelWidth, levelHeight);
+
+    snprintf(name, sizeof(name), "%s reduce %d", prefix, numReduceLevels + 1);
+    ScanRoofline_addLevel(schedule, name, SCAN_ROOFLINE_KIND_REDUCE, numReduceLevels + 1,
+                          inBuffer, -1, reduceBuffers[numReduceLevels]);
+
+    inBuffer = reduceBuffers[numReduceLevels];
+    numReduceLevels += 1;
+  }
+
+  // Down sweep levels, then the final sweep into the output
+
+  int in1Buffer = SCAN_ROOFLINE_BUFFER_ZERO;
+
+  for ( int i = numReduceLevels - 1; i >= 0; i-- ) {
+    snprintf(name, sizeof(name), "%s sweep %d", prefix, i + 1);
+    ScanRoofline_addLevel(schedule, name, SCAN_ROOFLINE_KIND_SWEEP, i + 1,
+                          in1Buffer, reduceBuffers[i], sweepBuffers[i]);
+    in1Buffer = sweepBuffers[i];
+  }
+
+  // The CPU has no inclusive down sweep, PrefixSum_downsweep is exclusive
+
+  const int finalKind = (isExclusive || !isGPU) ? SCAN_ROOFLINE_KIND_SWEEP : SCAN_ROOFLINE_KIND_INCLUSIVE_SWEEP;
+
+  snprintf(name, sizeof(name), "%s sweep 0", prefix);
+  ScanRoofline_addLevel(schedule, name, finalKind, 0,
+                        in1Buffer, SCAN_ROOFLINE_BUFFER_INPUT, SCAN_ROOFLINE_BUFFER_OUTPUT);
+
+  for ( int i = 0; i < schedule->numLevels; i++ ) {
+    if (isGPU) {
+      ScanRoofline_countGPULevel(schedule, &schedule->levels[i]);
+    } else {
+      ScanRoofline_countCPULevel(schedule, &schedule->levels[i]);
+    }
+  }
+
+  return 0;
+}
+
+// Run the CPU schedule on block order bytes numRepeats times and store
+// the best time for each level. The result is the exclusive per block
+// prefix sum, written to outBytes when not NULL. Returns 0 on success.
+
+static inline
+int ScanRoofline_timeCPUSchedule(ScanRooflineSchedule *schedule,
+                                 const uint8_t *inBytes,
+                                 uint8_t *outBytes,
+                                 int numRepeats)
+{
+  uint8_t *buffers[SCAN_ROOFLINE_MAX_BUFFERS];
+  int bufferNumBytes[SCAN_ROOFLINE_MAX_BUFFERS];
+  int status = 0;
+
+  for ( int i = 0; i < schedule->numBuffers; i++ ) {
+    bufferNumBytes[i] = schedule->bufferWidth[i] * schedule->bufferHeight[i];
+    buffers[i] = (uint8_t *) calloc(bufferNumBytes[i], 1);
+    if (buffers[i] == NULL) {
+      status = -1;
+    }
+  }
+
+  if (status == 0) {
+    memcpy(buffers[SCAN_ROOFLINE_BUFFER_INPUT], inBytes, bufferNumBytes[SCAN_ROOFLINE_BUFFER_INPUT]);
+
+    for ( int i = 0; i < schedule->numLevels; i++ ) {
+      schedule->levels[i].measuredNs = 0.0;
+    }
+
+    for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+      for ( int i = 0; i < schedule->numLevels; i++ ) {
+        ScanRooflineLevel *rl = &schedule->levels[i];
+
+        const double startNs = BlockSizeSelect_nowNs();
+
+        if (rl->kind == SCAN_ROOFLINE_KIND_REDUCE) {
+          PrefixSum_reduce(buffers[rl->inBuffer], bufferNumBytes[rl->inBuffer],
+                           buffers[rl->outBuffer], bufferNumBytes[rl->outBuffer]);
+        } else {
+          PrefixSum_downsweep(buffers[rl->inBuffer], bufferNumBytes[rl->inBuffer],
+                              buffers[rl->in2Buffer], bufferNumBytes[rl->in2Buffer],
+                              buffers[rl->outBuffer], bufferNumBytes[rl->outBuffer]);
+        }
+
+        const double elapsedNs = BlockSizeSelect_nowNs() - startNs;
+
+        if (repeati == 0 || elapsedNs < rl->measuredNs) {
+          rl->measuredNs = elapsedNs;
+        }
+      }
+    }
+
+    if (outBytes != NULL) {
+      memcpy(outBytes, buffers[SCAN_ROOFLINE_BUFFER_OUTPUT], bufferNumBytes[SCAN_ROOFLINE_BUFFER_OUTPUT]);
+    }
+  } else {
+    fprintf(stderr, "could not allocate roofline buffers\n");
+  }
+
+  for ( int i = 0; i < schedule->numBuffers; i++ ) {
+    free(buffers[i]);
+  }
+
+  return status;
+}
+
+// Byte adds each scan strategy performs for numBytesInBlock bytes,
+// counting every SIMD lane.
+
+static inline
+int64_t ScanRoofline_scanStrategyOps(int strategy, int numBytesInBlock)
+{
+  const int64_t n = numBytesInBlock;
+
+  switch (strategy) {
+    case SCAN_STRATEGY_SIMD_HORIZONTAL:
+      // 4 log steps over 16 lanes and the carry add
+      return n * 5;
+    case SCAN_STRATEGY_HILLIS_STEELE:
+      return n * ScanRoofline_log2(numBytesInBlock);
+    case SCAN_STRATEGY_BLELLOCH:
+    case SCAN_STRATEGY_REDUCE_THEN_SCAN:
+      return n * 2;
+    default:
+      return n;
+  }
+}
+
+// Append one timed level for each CPU scan strategy. A strategy reads
+// the deltas and writes the sums once, any extra passes stay in cache.
+
+static inline
+int ScanRoofline_timeScanStrategies(ScanRooflineSchedule *schedule,
+                                    const uint8_t *inBytes,
+                                    int numThreads,
+                                    int numRepeats)
+{
+  const int numBytesInBlock = schedule->blockSize * schedule->blockSize;
+  const int numBlocks = schedule->numBlocksInWidth * schedule->numBlocksInHeight;
+  const int64_t numBytes = (int64_t) numBytesInBlock * numBlocks;
+
+  uint8_t *outBytes = (uint8_t *) malloc(numBytes);
+
+  if (outBytes == NULL) {
+    fprintf(stderr, "could not allocate %d byte scan output\n", (int) numBytes);
+    return -1;
+  }
+
+  for ( int strategy = 0; strategy < SCAN_STRATEGY_NUM_STRATEGIES; strategy++ ) {
+    char name[32];
+    snprintf(name, sizeof(name), "cpu %s", ScanStrategy_name(strategy));
+
+    ScanRooflineLevel *rl = ScanRoofline_addLevel(schedule, name, SCAN_ROOFLINE_KIND_SCAN, 0,
+                                                  SCAN_ROOFLINE_BUFFER_INPUT, -1, SCAN_ROOFLINE_BUFFER_OUTPUT);
+
+    rl->numFragments = numBytes;
+    rl->numReads = numBytes;
+    rl->bytesRead = numBytes;
+    rl->bytesWritten = numBytes;
+    rl->trafficBytes = numBytes * 2;
+    rl->numOps = ScanRoofline_scanStrategyOps(strategy, numBytesInBlock) * numBlocks;
+
+    for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+      const double startNs = BlockSizeSelect_nowNs();
+
+      if (ScanStrategy_run(strategy, inBytes, outBytes, numBytesInBlock, numBlocks, numThreads) != 0) {
+        free(outBytes);
+        return -1;
+      }
+
+      const double elapsedNs = BlockSizeSelect_nowNs() - startNs;
+
+      if (repeati == 0 || elapsedNs < rl->measuredNs) {
+        rl->measuredNs = elapsedNs;
+      }
+    }
+  }
+
+  free(outBytes);
+
+  return 0;
+}
+
+// Best of numRepeats memcpy of numBytes between buffers larger than
+// the caches, returns read plus write bytes per ns (GB/s).
+
+static inline
+double ScanRoofline_measureBandwidth(int numBytes, int numRepeats)
+{
+  uint8_t *src = (uint8_t *) malloc(numBytes);
+  uint8_t *dst = (uint8_t *) malloc(numBytes);
+
+  if (src == NULL || dst == NULL) {
+    free(src);
+    free(dst);
+    return 0.0;
+  }
+
+  // Touch every page before timing
+  memset(src, 1, numBytes);
+  memset(dst, 0, numBytes);
+
+  double bestNs = 0.0;
+
+  for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+    const double startNs = BlockSizeSelect_nowNs();
+    memcpy(dst, src, numBytes);
+    const double elapsedNs = BlockSizeSelect_nowNs() - startNs;
+
+    if (repeati == 0 || elapsedNs < bestNs) {
+      bestNs = elapsedNs;
+    }
+  }
+
+  free(src);
+  free(dst);
+
+  return (bestNs > 0.0) ? ((2.0 * numBytes) / bestNs) : 0.0;
+}
+
+#define SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES 4096
+#define SCAN_ROOFLINE_PEAK_OPS_NUM_PASSES 1024
+
+typedef struct {
+  // One L1 sized buffer of values per thread
+  uint8_t *values;
+  uint8_t sums[PARALLEL_FOR_MAX_THREADS][16];
+  // Timed inside each thread so thread start up is not counted
+  double elapsedNs[PARALLEL_FOR_MAX_THREADS];
+} ScanRooflinePeakOps;
+
+// Add every 16 byte vector of a thread's values buffer into 4
+// independent accumulators so that the adds are not latency bound,
+// the same vector add the SIMD scan strategies issue.
+
+static inline
+void ScanRoofline_peakOpsChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) end;
+  ScanRooflinePeakOps *peak = (ScanRooflinePeakOps *) ctx;
+  const uint8_t *values = peak->values + (start * SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES);
+  uint8_t *sums = peak->sums[threadi];
+
+  const double startNs = BlockSizeSelect_nowNs();
+
+#if defined(SCAN_STRATEGY_SSE2) || defined(SCAN_STRATEGY_NEON)
+  ScanStrategyVec acc0 = ScanStrategy_zero();
+  ScanStrategyVec acc1 = ScanStrategy_zero();
+  ScanStrategyVec acc2 = ScanStrategy_zero();
+  ScanStrategyVec acc3 = ScanStrategy_zero();
+
+  for ( int passi = 0; passi < SCAN_ROOFLINE_PEAK_OPS_NUM_PASSES; passi++ ) {
+    for ( int i = 0; i < SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES; i += 64 ) {
+      acc0 = ScanStrategy_add(acc0, ScanStrategy_load(values + i));
+      acc1 = ScanStrategy_add(acc1, ScanStrategy_load(values + i + 16));
+      acc2 = ScanStrategy_add(acc2, ScanStrategy_load(values + i + 32));
+      acc3 = ScanStrategy_add(acc3, ScanStrategy_load(values + i + 48));
+    }
+  }
+
+  ScanStrategy_store(sums, ScanStrategy_add(ScanStrategy_add(acc0, acc1), ScanStrategy_add(acc2, acc3)));
+#else
+  // One byte lane without SIMD
+  uint8_t acc = 0;
+
+  for ( int passi = 0; passi < SCAN_ROOFLINE_PEAK_OPS_NUM_PASSES; passi++ ) {
+    for ( int i = 0; i < SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES; i++ ) {
+      acc += values[i];
+    }
+  }
+
+  sums[0] = acc;
+#endif // SCAN_STRATEGY_SSE2 || SCAN_STRATEGY_NEON
+
+  peak->elapsedNs[threadi] = BlockSizeSelect_nowNs() - startNs;
+}
+
+// Best of numRepeats rate of byte adds with 16 byte vector adds on
+// numThreads threads, each adding its own buffer that stays in L1.
+// Pass the thread count the scan strategies are timed with so that
+// the roof is on the same footing as the multithreaded strategies.
+// Returns byte adds per ns, a 16 byte vector add counts as 16.
+
+static inline
+double ScanRoofline_measurePeakOps(int numThreads, int numRepeats)
+{
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > PARALLEL_FOR_MAX_THREADS) {
+    numThreads = PARALLEL_FOR_MAX_THREADS;
+  }
+
+  ScanRooflinePeakOps peak;
+  memset(&peak, 0, sizeof(peak));
+
+  peak.values = (uint8_t *) malloc((size_t) numThreads * SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES);
+
+  if (peak.values == NULL) {
+    return 0.0;
+  }
+
+  for ( int i = 0; i < (numThreads * SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES); i++ ) {
+    peak.values[i] = (uint8_t) i;
+  }
+
+  double bestNs = 0.0;
+
+  for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+    // One item per thread, so each thread adds exactly one buffer
+    // and the slowest thread bounds the elapsed time.
+    const int numChunks = ParallelFor_run(numThreads, numThreads, ScanRoofline_peakOpsChunk, &peak);
+
+    double elapsedNs = 0.0;
+
+    for ( int threadi = 0; threadi < numChunks; threadi++ ) {
+      if (peak.elapsedNs[threadi] > elapsedNs) {
+        elapsedNs = peak.elapsedNs[threadi];
+      }
+    }
+
+    if (repeati == 0 || elapsedNs < bestNs) {
+      bestNs = elapsedNs;
+    }
+  }
+
+  // Keep the adds from being optimized away
+  volatile uint8_t sink = peak.sums[0][0];
+  (void) sink;
+
+  free(peak.values);
+
+  const double numOps = (double) numThreads * SCAN_ROOFLINE_PEAK_OPS_NUM_BYTES * SCAN_ROOFLINE_PEAK_OPS_NUM_PASSES;
+
+  return (bestNs > 0.0) ? (numOps / bestNs) : 0.0;
+}
+
+// Attainable ops per ns for a level, the lower of the compute roof and
+// the bandwidth times the ops per traffic byte. A peakOpsPerNs of zero
+// means no compute roof is known, as for the GPU.
+
+static inline
+double ScanRoofline_roofOpsPerNs(const ScanRooflineLevel *rl, double bytesPerNs, double peakOpsPerNs)
+{
+  const double intensity = (rl->trafficBytes > 0) ? ((double) rl->numOps / rl->trafficBytes) : 0.0;
+  const double memoryRoof = intensity * bytesPerNs;
+
+  if (peakOpsPerNs > 0.0 && peakOpsPerNs < memoryRoof) {
+    return peakOpsPerNs;
+  }
+
+  return memoryRoof;
+}
+
+// Print one row per level: output size, reads, percent of reads that
+// are scattered, traffic, ops, ops per traffic byte, measured time,
+// achieved GB/s and Gops/s, the roof, percent of the roof reached and
+// whether the level is memory, compute or latency bound.
+
+static inline
+void ScanRoofline_print(FILE *fp,
+                        const ScanRooflineSchedule *schedule,
+                        double bytesPerNs,
+                        double peakOpsPerNs)
+{
+  fprintf(fp, "roofline %d x %d, %d x %d blocks, bandwidth %.2f GB/s", schedule->width, schedule->height,
+          schedule->blockSize, schedule->blockSize, bytesPerNs);
+
+  if (peakOpsPerNs > 0.0) {
+    fprintf(fp, ", peak %.2f Gops/s\n", peakOpsPerNs);
+  } else {
+    fprintf(fp, ", no compute roof\n");
+  }
+
+  fprintf(fp, "%-22s %11s %10s %6s %10s %10s %6s %9s %8s %8s %8s %6s %s\n",
+          "level", "output", "reads", "scat%", "traffic", "ops", "ops/B",
+          "ms", "GB/s", "Gops/s", "roof", "%roof", "bound");
+
+  double totalNs = 0.0;
+  double totalRoofNs = 0.0;
+
+  for ( int i = 0; i < schedule->numLevels; i++ ) {
+    const ScanRooflineLevel *rl = &schedule->levels[i];
+
+    char output[16];
+    snprintf(output, sizeof(output), "%dx%d", schedule->bufferWidth[rl->outBuffer], schedule->bufferHeight[rl->outBuffer]);
+
+    const double scatteredPercent = (rl->numReads > 0) ? (100.0 * rl->numScatteredReads / rl->numReads) : 0.0;
+    const double intensity = (rl->trafficBytes > 0) ? ((double) rl->numOps / rl->trafficBytes) : 0.0;
+    const double roof = ScanRoofline_roofOpsPerNs(rl, bytesPerNs, peakOpsPerNs);
+    const double memoryRoof = intensity * bytesPerNs;
+
+    const char *bound = (peakOpsPerNs > 0.0 && peakOpsPerNs < memoryRoof) ? "compute" : "memory";
+
+    fprintf(fp, "%-22s %11s %10lld %6.1f %10lld %10lld %6.2f ", rl->name, output, (long long) rl->numReads,
+            scatteredPercent, (long long) rl->trafficBytes, (long long) rl->numOps, intensity);
+
+    if (rl->measuredNs > 0.0) {
+      const double achievedBytesPerNs = rl->trafficBytes / rl->measuredNs;
+      const double achievedOpsPerNs = rl->numOps / rl->measuredNs;
+      const double roofFraction = (roof > 0.0) ? (achievedOpsPerNs / roof) : 0.0;
+
+      if (roofFraction < SCAN_ROOFLINE_LATENCY_FRACTION) {
+        bound = "latency";
+      }
+
+      fprintf(fp, "%9.4f %8.2f %8.2f %8.2f %6.1f %s\n", rl->measuredNs / 1.0e6, achievedBytesPerNs,
+              achievedOpsPerNs, roof, 100.0 * roofFraction, bound);
+
+      if (rl->kind != SCAN_ROOFLINE_KIND_SCAN) {
+        totalNs += rl->measuredNs;
+        totalRoofNs += (roof > 0.0) ? (rl->numOps / roof) : 0.0;
+      }
+    } else {
+      fprintf(fp, "%9s %8s %8s %8.2f %6s %s\n", "-", "-", "-", roof, "-", bound);
+    }
+  }
+
+  if (totalNs > 0.0) {
+    fprintf(fp, "schedule %.4f ms, %.4f ms at the roof\n", totalNs / 1.0e6, totalRoofNs / 1.0e6);
+  }
+}
+
+#endif // _scan_roofline_h
@@ -0,0 +1,711 @@
+//
+//  scan_strategy.h
+//
+//  MIT Licensed
+//
+//  Interchangeable CPU implementations of the per block inclusive
+//  prefix sum that decodes block order deltas, and an autotuner that
+//  picks the fastest one for a frame geometry. The best choice depends
+//  on the block size, the number of blocks, and the number of cores.
+//
+//  serial           : one running sum per block
+//  simd horizontal  : 16 byte log step scan in registers (segmented_scan.h)
+//  lane interleaved : 16 blocks transposed into vector registers so one
+//                     vector add advances all 16 running sums
+//  hillis steele    : log2(n) passes of x[i] += x[i-d], double buffered
+//  blelloch         : in place up sweep and down sweep, like the GPU
+//  reduce then scan : tile sums, carry scan, then tile scans so that a
+//                     few large blocks still split across threads
+//
+//  A profile holds the winning strategy for each tuned geometry and
+//  can be saved to and loaded from a text file, so tuning only runs
+//  the first time a geometry is seen on a host.
+
+#ifndef _scan_strategy_h
+#define _scan_strategy_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "parallel_for.h"
+#include "segmented_scan.h"
+#include "block_size_select.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCAN_STRATEGY_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_STRATEGY_SSE2 1
+#endif
+
+#define SCAN_STRATEGY_SERIAL 0
+#define SCAN_STRATEGY_SIMD_HORIZONTAL 1
+#define SCAN_STRATEGY_LANE_INTERLEAVED 2
+#define SCAN_STRATEGY_HILLIS_STEELE 3
+#define SCAN_STRATEGY_BLELLOCH 4
+#define SCAN_STRATEGY_REDUCE_THEN_SCAN 5
+
+#define SCAN_STRATEGY_NUM_STRATEGIES 6
+
+#define SCAN_STRATEGY_NUM_LANES 16
+
+// Largest block the double buffered Hillis-Steele scan handles on the stack
+#define SCAN_STRATEGY_MAX_LOCAL_BYTES (64 * 64)
+
+#define SCAN_STRATEGY_MAX_ENTRIES 64
+
+static inline
+const char* ScanStrategy_name(int strategy)
+{
+  switch (strategy) {
+    case SCAN_STRATEGY_SERIAL:
+      return "serial";
+    case SCAN_STRATEGY_SIMD_HORIZONTAL:
+      return "simd_horizontal";
+    case SCAN_STRATEGY_LANE_INTERLEAVED:
+      return "lane_interleaved";
+    case SCAN_STRATEGY_HILLIS_STEELE:
+      return "hillis_steele";
+    case SCAN_STRATEGY_BLELLOCH:
+      return "blelloch";
+    case SCAN_STRATEGY_REDUCE_THEN_SCAN:
+      return "reduce_then_scan";
+    default:
+      return NULL;
+  }
+}
+
+// Returns the strategy for a name or -1 when the name is not known
+
+static inline
+int ScanStrategy_forName(const char *name)
+{
+  for ( int strategy = 0; strategy < SCAN_STRATEGY_NUM_STRATEGIES; strategy++ ) {
+    if (strcmp(name, ScanStrategy_name(strategy)) == 0) {
+      return strategy;
+    }
+  }
+
+  return -1;
+}
+
+static inline
+void ScanStrategy_serialBlocks(const uint8_t * __restrict inBytes,
+                               uint8_t * __restrict outBytes,
+                               int numBytesInBlock,
+                               int startBlocki,
+                               int endBlocki)
+{
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    const uint8_t * __restrict inPtr = inBytes + (blocki * numBytesInBlock);
+    uint8_t * __restrict outPtr = outBytes + (blocki * numBytesInBlock);
+
+    uint8_t sum = 0;
+
+    for ( int i = 0; i < numBytesInBlock; i++ ) {
+      sum += inPtr[i];
+      outPtr[i] = sum;
+    }
+  }
+}
+
+static inline
+void ScanStrategy_simdHorizontalBlocks(const uint8_t *inBytes,
+                                       uint8_t *outBytes,
+                                       int numBytesInBlock,
+                                       int startBlocki,
+                                       int endBlocki)
+{
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    SegmentedScan_run(inBytes + (blocki * numBytesInBlock), outBytes + (blocki * numBytesInBlock), numBytesInBlock, 0, 0);
+  }
+}
+
+#if defined(SCAN_STRATEGY_SSE2)
+typedef __m128i ScanStrategyVec;
+#define ScanStrategy_load(ptr) _mm_loadu_si128((const __m128i *) (ptr))
+#define ScanStrategy_store(ptr, v) _mm_storeu_si128((__m128i *) (ptr), (v))
+#define ScanStrategy_add(a, b) _mm_add_epi8((a), (b))
+#define ScanStrategy_zero() _mm_setzero_si128()
+#elif defined(SCAN_STRATEGY_NEON)
+typedef uint8x16_t ScanStrategyVec;
+#define ScanStrategy_load(ptr) vld1q_u8(ptr)
+#define ScanStrategy_store(ptr, v) vst1q_u8((ptr), (v))
+#define ScanStrategy_add(a, b) vaddq_u8((a), (b))
+#define ScanStrategy_zero() vdupq_n_u8(0)
+#endif
+
+#if defined(SCAN_STRATEGY_SSE2) || defined(SCAN_STRATEGY_NEON)
+
+// Transpose 16 registers of 16 bytes. Each stage interleaves register
+// k with register k+8, after 4 stages byte j of register i has moved
+// to byte i of register j.
+
+static inline
+void ScanStrategy_transpose16(ScanStrategyVec r[16])
+{
+  ScanStrategyVec t[16];
+
+  for ( int stage = 0; stage < 4; stage++ ) {
+    for ( int k = 0; k < 8; k++ ) {
+#if defined(SCAN_STRATEGY_SSE2)
+      t[2*k] = _mm_unpacklo_epi8(r[k], r[k+8]);
+      t[2*k+1] = _mm_unpackhi_epi8(r[k], r[k+8]);
+#else
+      uint8x16x2_t z = vzipq_u8(r[k], r[k+8]);
+      t[2*k] = z.val[0];
+      t[2*k+1] = z.val[1];
+#endif
+    }
+
+    for ( int k = 0; k < 16; k++ ) {
+      r[k] = t[k];
+    }
+  }
+}
+
+#endif // SCAN_STRATEGY_SSE2 || SCAN_STRATEGY_NEON
+
+// Vertical scan of 16 blocks at a time. For each 16 byte column of the
+// blocks, the same 16 bytes of each of the 16 blocks are transposed so
+// that one register holds one offset from every block, the registers
+// are scanned with one vector add each, and the sums are transposed
+// back. Blocks smaller than 16 bytes and the last few blocks use the
+// serial scan, as do builds without SSE2 or NEON.
+
+static inline
+void ScanStrategy_laneInterleavedBlocks(const uint8_t * __restrict inBytes,
+                                        uint8_t * __restrict outBytes,
+                                        int numBytesInBlock,
+                                        int startBlocki,
+                                        int endBlocki)
+{
+  int blocki = startBlocki;
+
+#if defined(SCAN_STRATEGY_SSE2) || defined(SCAN_STRATEGY_NEON)
+  if ((numBytesInBlock % 16) == 0) {
+    ScanStrategyVec r[16];
+
+    for ( ; (blocki + SCAN_STRATEGY_NUM_LANES) <= endBlocki; blocki += SCAN_STRATEGY_NUM_LANES ) {
+      const uint8_t * __restrict inPtr = inBytes + (blocki * numBytesInBlock);
+      uint8_t * __restrict outPtr = outBytes + (blocki * numBytesInBlock);
+
+      ScanStrategyVec sums = ScanStrategy_zero();
+
+      for ( int i = 0; i < numBytesInBlock; i += 16 ) {
+        for ( int lanei = 0; lanei < SCAN_STRATEGY_NUM_LANES; lanei++ ) {
+          r[lanei] = ScanStrategy_load(inPtr + (lanei * numBytesInBlock) + i);
+        }
+
+        ScanStrategy_transpose16(r);
+
+        for ( int j = 0; j < 16; j++ ) {
+          sums = ScanStrategy_add(sums, r[j]);
+          r[j] = sums;
+        }
+
+        ScanStrategy_transpose16(r);
+
+        for ( int lanei = 0; lanei < SCAN_STRATEGY_NUM_LANES; lanei++ ) {
+          ScanStrategy_store(outPtr + (lanei * numBytesInBlock) + i, r[lanei]);
+        }
+      }
+    }
+  }
+#endif // SCAN_STRATEGY_SSE2 || SCAN_STRATEGY_NEON
+
+  ScanStrategy_serialBlocks(inBytes, outBytes, numBytesInBlock, blocki, endBlocki);
+}
+
+// Each pass adds the value d elements back, d doubles each pass.
+// Does O(n log n) adds but every pass is a simple vector loop.
+
+static inline
+void ScanStrategy_hillisSteeleBlocks(const uint8_t *inBytes,
+                                     uint8_t *outBytes,
+                                     int numBytesInBlock,
+                                     int startBlocki,
+                                     int endBlocki)
+{
+  if (numBytesInBlock > SCAN_STRATEGY_MAX_LOCAL_BYTES) {
+    ScanStrategy_serialBlocks(inBytes, outBytes, numBytesInBlock, startBlocki, endBlocki);
+    return;
+  }
+
+  uint8_t tmpBytes[SCAN_STRATEGY_MAX_LOCAL_BYTES];
+
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    const uint8_t *inPtr = inBytes + (blocki * numBytesInBlock);
+    uint8_t *outPtr = outBytes + (blocki * numBytesInBlock);
+
+    const uint8_t * __restrict src = inPtr;
+    uint8_t * __restrict dst = tmpBytes;
+
+    for ( int d = 1; d < numBytesInBlock; d <<= 1 ) {
+      for ( int i = 0; i < d; i++ ) {
+        dst[i] = src[i];
+      }
+      for ( int i = d; i < numBytesInBlock; i++ ) {
+        dst[i] = (uint8_t) (src[i] + src[i-d]);
+      }
+
+      // Alternate between tmpBytes and outPtr
+      src = dst;
+      dst = (dst == tmpBytes) ? outPtr : tmpBytes;
+    }
+
+    if (src != outPtr) {
+      memcpy(outPtr, src, numBytesInBlock);
+    }
+  }
+}
+
+// Up sweep builds partial sums at power of 2 strides, then the down
+// sweep fills in the remaining elements. Same work efficient tree as
+// the reduce and sweep render passes. Requires a POT block length.
+
+static inline
+void ScanStrategy_blellochBlocks(const uint8_t *inBytes,
+                                 uint8_t *outBytes,
+                                 int numBytesInBlock,
+                                 int startBlocki,
+                                 int endBlocki)
+{
+  if ((numBytesInBlock & (numBytesInBlock - 1)) != 0) {
+    ScanStrategy_serialBlocks(inBytes, outBytes, numBytesInBlock, startBlocki, endBlocki);
+    return;
+  }
+
+  for ( int blocki = startBlocki; blocki < endBlocki; blocki++ ) {
+    uint8_t *x = outBytes + (blocki * numBytesInBlock);
+
+    if (inBytes != outBytes) {
+      memcpy(x, inBytes + (blocki * numBytesInBlock), numBytesInBlock);
+    }
+
+    for ( int d = 1; d < numBytesInBlock; d <<= 1 ) {
+      for ( int i = (2 * d) - 1; i < numBytesInBlock; i += (2 * d) ) {
+        x[i] += x[i-d];
+      }
+    }
+
+    for ( int d = numBytesInBlock >> 2; d >= 1; d >>= 1 ) {
+      for ( int i = (3 * d) - 1; i < numBytesInBlock; i += (2 * d) ) {
+        x[i] += x[i-d];
+      }
+    }
+  }
+}
+
+typedef void (*ScanStrategyBlocksFunc)(const uint8_t *inBytes,
+                                       uint8_t *outBytes,
+                                       int numBytesInBlock,
+                                       int startBlocki,
+                                       int endBlocki);
+
+typedef struct {
+  ScanStrategyBlocksFunc func;
+  const uint8_t *inBytes;
+  uint8_t *outBytes;
+  int numBytesInBlock;
+  // Reduce then scan state, each block is split into tiles
+  int numBytesInTile;
+  uint8_t *tileSums;
+} ScanStrategyContext;
+
+static inline
+void ScanStrategy_blocksChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  ScanStrategyContext *ssc = (ScanStrategyContext *) ctx;
+  ssc->func(ssc->inBytes, ssc->outBytes, ssc->numBytesInBlock, start, end);
+}
+
+static inline
+void ScanStrategy_reduceTilesChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  ScanStrategyContext *ssc = (ScanStrategyContext *) ctx;
+  const int numBytesInTile = ssc->numBytesInTile;
+
+  for ( int tilei = start; tilei < end; tilei++ ) {
+    const uint8_t *inPtr = ssc->inBytes + (tilei * numBytesInTile);
+    uint8_t sum = 0;
+
+    for ( int i = 0; i < numBytesInTile; i++ ) {
+      sum += inPtr[i];
+    }
+
+    ssc->tileSums[tilei] = sum;
+  }
+}
+
+static inline
+void ScanStrategy_scanTilesChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  ScanStrategyContext *ssc = (ScanStrategyContext *) ctx;
+  const int numBytesInTile = ssc->numBytesInTile;
+
+  for ( int tilei = start; tilei < end; tilei++ ) {
+    SegmentedScan_run(ssc->inBytes + (tilei * numBytesInTile), ssc->outBytes + (tilei * numBytesInTile),
+                      numBytesInTile, ssc->tileSums[tilei], 0);
+  }
+}
+
+// Split blocks into POT tiles so there are at least 4 tiles per thread,
+// reduce each tile, scan the tile sums within each block, then scan
+// each tile starting from its carry. Returns 0 on success.
+
+static inline
+int ScanStrategy_reduceThenScan(const uint8_t *inBytes,
+                                uint8_t *outBytes,
+                                int numBytesInBlock,
+                                int numBlocks,
+                                int numThreads)
+{
+  int numBytesInTile = numBytesInBlock;
+
+  if ((numBytesInBlock & (numBytesInBlock - 1)) == 0) {
+    const int minNumTiles = ((numThreads > 1) ? numThreads : 1) * 4;
+
+    while (numBytesInTile > 16 && ((numBytesInBlock / numBytesInTile) * numBlocks) < minNumTiles) {
+      numBytesInTile >>= 1;
+    }
+  }
+
+  const int numTilesInBlock = numBytesInBlock / numBytesInTile;
+  const int numTiles = numTilesInBlock * numBlocks;
+
+  ScanStrategyContext ssc;
+  ssc.func = NULL;
+  ssc.inBytes = inBytes;
+  ssc.outBytes = outBytes;
+  ssc.numBytesInBlock = numBytesInBlock;
+  ssc.numBytesInTile = numBytesInTile;
+  ssc.tileSums = (uint8_t *) malloc(numTiles);
+
+  if (ssc.tileSums == NULL) {
+    fprintf(stderr, "could not allocate %d tile sums\n", numTiles);
+    return -1;
+  }
+
+  ParallelFor_run(numThreads, numTiles, ScanStrategy_reduceTilesChunk, &ssc);
+
+  // Exclusive scan of the tile sums, restarting at each block
+
+  for ( int blocki = 0; blocki < numBlocks; blocki++ ) {
+    uint8_t *sumsPtr = ssc.tileSums + (blocki * numTilesInBlock);
+    uint8_t carry = 0;
+
+    for ( int tilei = 0; tilei < numTilesInBlock; tilei++ ) {
+      const uint8_t tileSum = sumsPtr[tilei];
+      sumsPtr[tilei] = carry;
+      carry += tileSum;
+    }
+  }
+
+  ParallelFor_run(numThreads, numTiles, ScanStrategy_scanTilesChunk, &ssc);
+
+  free(ssc.tileSums);
+
+  return 0;
+}
+
+// Inclusive prefix sum of each block of numBytesInBlock bytes with the
+// given strategy. Returns 0 on success or -1 on error.
+
+static inline
+int ScanStrategy_run(int strategy,
+                     const uint8_t *inBytes,
+                     uint8_t *outBytes,
+                     int numBytesInBlock,
+                     int numBlocks,
+                     int numThreads)
+{
+#if defined(DEBUG)
+  assert(inBytes != outBytes);
+  assert(numBytesInBlock > 0);
+#endif // DEBUG
+
+  ScanStrategyContext ssc;
+  ssc.inBytes = inBytes;
+  ssc.outBytes = outBytes;
+  ssc.numBytesInBlock = numBytesInBlock;
+  ssc.numBytesInTile = 0;
+  ssc.tileSums = NULL;
+
+  switch (strategy) {
+    case SCAN_STRATEGY_SERIAL:
+      ssc.func = ScanStrategy_serialBlocks;
+      break;
+    case SCAN_STRATEGY_SIMD_HORIZONTAL:
+      ssc.func = ScanStrategy_simdHorizontalBlocks;
+      break;
+    case SCAN_STRATEGY_LANE_INTERLEAVED:
+      ssc.func = ScanStrategy_laneInterleavedBlocks;
+      break;
+    case SCAN_STRATEGY_HILLIS_STEELE:
+      ssc.func = ScanStrategy_hillisSteeleBlocks;
+      break;
+    case SCAN_STRATEGY_BLELLOCH:
+      ssc.func = ScanStrategy_blellochBlocks;
+      break;
+    case SCAN_STRATEGY_REDUCE_THEN_SCAN:
+      return ScanStrategy_reduceThenScan(inBytes, outBytes, numBytesInBlock, numBlocks, numThreads);
+    default:
+      fprintf(stderr, "unknown scan strategy %d\n", strategy);
+      return -1;
+  }
+
+  ParallelFor_run(numThreads, numBlocks, ScanStrategy_blocksChunk, &ssc);
+
+  return 0;
+}
+
+typedef struct {
+  int numBytesInBlock;
+  // floor(log2(numBlocks)), frames with a similar block count share an entry
+  int numBlocksLog2;
+  int numThreads;
+  int strategy;
+  double nsPerByte;
+} ScanStrategyEntry;
+
+typedef struct {
+  int numEntries;
+  ScanStrategyEntry entries[SCAN_STRATEGY_MAX_ENTRIES];
+} ScanStrategyProfile;
+
+static inline
+void ScanStrategy_initProfile(ScanStrategyProfile *profile)
+{
+  memset(profile, 0, sizeof(ScanStrategyProfile));
+}
+
+static inline
+int ScanStrategy_numBlocksLog2(int numBlocks)
+{
+  int numBlocksLog2 = 0;
+  while ((2 << numBlocksLog2) <= numBlocks) {
+    numBlocksLog2++;
+  }
+  return numBlocksLog2;
+}
+
+// Returns the tuned entry for a geometry or NULL
+
+static inline
+const ScanStrategyEntry* ScanStrategy_findEntry(const ScanStrategyProfile *profile,
+                                                int numBytesInBlock,
+                                                int numBlocks,
+                                                int numThreads)
+{
+  const int numBlocksLog2 = ScanStrategy_numBlocksLog2(numBlocks);
+
+  for ( int i = 0; i < profile->numEntries; i++ ) {
+    const ScanStrategyEntry *entry = &profile->entries[i];
+
+    if (entry->numBytesInBlock == numBytesInBlock &&
+        entry->numBlocksLog2 == numBlocksLog2 &&
+        entry->numThreads == numThreads) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+// Benchmark every strategy on a synthetic frame with this geometry and
+// return the fastest. The fastest of numRepeats runs is kept for each
+// strategy, and a strategy that does not match the serial output is
+// never picked. When nsPerByte is not NULL, the time for each strategy
+// is written to nsPerByte[strategy]. Returns -1 on allocation failure.
+
+static inline
+int ScanStrategy_tune(int numBytesInBlock,
+                      int numBlocks,
+                      int numThreads,
+                      int numRepeats,
+                      double *nsPerByte)
+{
+  const int numBytes = numBytesInBlock * numBlocks;
+
+  uint8_t *deltas = (uint8_t *) malloc(numBytes);
+  uint8_t *expected = (uint8_t *) malloc(numBytes);
+  uint8_t *decoded = (uint8_t *) malloc(numBytes);
+
+  if (deltas == NULL || expected == NULL || decoded == NULL) {
+    fprintf(stderr, "could not allocate %d bytes for scan strategy tuning\n", numBytes);
+    free(deltas);
+    free(expected);
+    free(decoded);
+    return -1;
+  }
+
+  uint32_t seed = 0x12345678;
+
+  for ( int i = 0; i < numBytes; i++ ) {
+    seed = (seed * 1103515245) + 12345;
+    deltas[i] = (uint8_t) (seed >> 24);
+  }
+
+  ScanStrategy_serialBlocks(deltas, expected, numBytesInBlock, 0, numBlocks);
+
+  int bestStrategy = SCAN_STRATEGY_SERIAL;
+  double bestNs = -1.0;
+
+  for ( int strategy = 0; strategy < SCAN_STRATEGY_NUM_STRATEGIES; strategy++ ) {
+    double minNs = -1.0;
+
+    for ( int repeati = 0; repeati < numRepeats; repeati++ ) {
+      double startNs = BlockSizeSelect_nowNs();
+      ScanStrategy_run(strategy, deltas, decoded, numBytesInBlock, numBlocks, numThreads);
+      double elapsedNs = BlockSizeSelect_nowNs() - startNs;
+
+      if (minNs < 0.0 || elapsedNs < minNs) {
+        minNs = elapsedNs;
+      }
+    }
+
+    const int isValid = (memcmp(decoded, expected, numBytes) == 0);
+
+#if defined(DEBUG)
+    assert(isValid);
+#endif // DEBUG
+
+    if (nsPerByte != NULL) {
+      nsPerByte[strategy] = minNs / numBytes;
+    }
+
+    if (isValid && (bestNs < 0.0 || minNs < bestNs)) {
+      bestNs = minNs;
+      bestStrategy = strategy;
+    }
+  }
+
+  free(deltas);
+  free(expected);
+  free(decoded);
+
+  return bestStrategy;
+}
+
+// Returns the tuned strategy for a geometry, tuning and adding an
+// entry to profile the first time the geometry is seen.
+
+static inline
+int ScanStrategy_select(ScanStrategyProfile *profile,
+                        int numBytesInBlock,
+                        int numBlocks,
+                        int numThreads)
+{
+  const ScanStrategyEntry *found = ScanStrategy_findEntry(profile, numBytesInBlock, numBlocks, numThreads);
+
+  if (found != NULL) {
+    return found->strategy;
+  }
+
+  double nsPerByte[SCAN_STRATEGY_NUM_STRATEGIES];
+  int strategy = ScanStrategy_tune(numBytesInBlock, numBlocks, numThreads, 3, nsPerByte);
+
+  if (strategy < 0) {
+    return SCAN_STRATEGY_SIMD_HORIZONTAL;
+  }
+
+  if (profile->numEntries < SCAN_STRATEGY_MAX_ENTRIES) {
+    ScanStrategyEntry *entry = &profile->entries[profile->numEntries++];
+    entry->numBytesInBlock = numBytesInBlock;
+    entry->numBlocksLog2 = ScanStrategy_numBlocksLog2(numBlocks);
+    entry->numThreads = numThreads;
+    entry->strategy = strategy;
+    entry->nsPerByte = nsPerByte[strategy];
+  }
+
+  return strategy;
+}
+
+// Profile file format, one entry per line after the header line:
+//
+// numBytesInBlock numBlocksLog2 numThreads strategy_name nsPerByte
+
+#define SCAN_STRATEGY_PROFILE_HEADER "# scan strategy profile 1"
+
+static inline
+int ScanStrategy_saveProfile(const ScanStrategyProfile *profile, const char *path)
+{
+  FILE *fp = fopen(path, "w");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not open scan strategy profile \"%s\" for writing\n", path);
+    return -1;
+  }
+
+  fprintf(fp, "%s\n", SCAN_STRATEGY_PROFILE_HEADER);
+
+  for ( int i = 0; i < profile->numEntries; i++ ) {
+    const ScanStrategyEntry *entry = &profile->entries[i];
+    fprintf(fp, "%d %d %d %s %.6f\n", entry->numBytesInBlock, entry->numBlocksLog2, entry->numThreads,
+            ScanStrategy_name(entry->strategy), entry->nsPerByte);
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
+// Load a profile written by ScanStrategy_saveProfile. Returns 0 on
+// success or -1 when the file is missing or not a valid profile, in
+// which case profile is left empty.
+
+static inline
+int ScanStrategy_loadProfile(ScanStrategyProfile *profile, const char *path)
+{
+  ScanStrategy_initProfile(profile);
+
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL) {
+    return -1;
+  }
+
+  char line[256];
+
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strncmp(line, SCAN_STRATEGY_PROFILE_HEADER, strlen(SCAN_STRATEGY_PROFILE_HEADER)) != 0) {
+    fprintf(stderr, "invalid scan strategy profile \"%s\"\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL && profile->numEntries < SCAN_STRATEGY_MAX_ENTRIES) {
+    ScanStrategyEntry entry;
+    char name[64];
+
+    if (sscanf(line, "%d %d %d %63s %lf", &entry.numBytesInBlock, &entry.numBlocksLog2,
+               &entry.numThreads, name, &entry.nsPerByte) != 5) {
+      continue;
+    }
+
+    entry.strategy = ScanStrategy_forName(name);
+
+    if (entry.strategy < 0) {
+      fprintf(stderr, "invalid scan strategy profile \"%s\"\n", path);
+      ScanStrategy_initProfile(profile);
+      fclose(fp);
+      return -1;
+    }
+
+    profile->entries[profile->numEntries++] = entry;
+  }
+
+  fclose(fp);
+
+  return 0;
+}
+
+#endif // _scan_strategy_h
@@ -0,0 +1,616 @@
+//
+//  segmented_scan.h
+//
+//  MIT Licensed
+//
+//  Inline methods that implement segmented inclusive and exclusive
+//  prefix sums on arrays of uint8_t byte values. The sum restarts from
+//  zero at the first byte of each segment. Segments can be described
+//  three ways:
+//
+//  fixed     : every segment is segmentLength bytes (block order data)
+//  offsets   : segment k covers [offsets[k], offsets[k+1])
+//  head flags: a bitmap with bit i set when byte i begins a segment,
+//              bit 0 of byte 0 is element 0 and element 0 always
+//              begins a segment.
+//
+//  A 16 byte vector is scanned in registers with a log step scan that
+//  is masked by the head flags (NEON on ARM, SSE2 on x86), and a scalar
+//  loop is used elsewhere. Each method takes numThreads and splits the
+//  work with parallel_for.h. Head flag scans are split into equal chunks
+//  that are scanned independently, then the carry out of each chunk is
+//  added to the leading partial segment of the next chunk.
+//
+//  An exclusive sum is the inclusive sum minus the input byte, so both
+//  are generated by the same code.
+
+#ifndef _segmented_scan_h
+#define _segmented_scan_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SEGMENTED_SCAN_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SEGMENTED_SCAN_SSE2 1
+#endif
+
+#include "parallel_for.h"
+
+// Return 1 if byte i begins a segment
+
+static inline
+int SegmentedScan_isHead(const uint8_t *headFlags, int i)
+{
+  return (headFlags[i >> 3] >> (i & 0x7)) & 0x1;
+}
+
+#if defined(SEGMENTED_SCAN_SSE2)
+
+// Expand 16 head flag bits starting at a multiple of 8 into byte masks
+
+static inline
+__m128i SegmentedScan_headMask16(const uint8_t *headFlags, int i)
+{
+  const uint8_t b0 = headFlags[i >> 3];
+  const uint8_t b1 = headFlags[(i >> 3) + 1];
+  const __m128i v = _mm_unpacklo_epi64(_mm_set1_epi8((char) b0), _mm_set1_epi8((char) b1));
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 1, 2, 4, 8, 16, 32, 64, (char) 128);
+  return _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+}
+
+// Segmented inclusive scan of 16 bytes in registers. f holds 0xFF for
+// each head byte and is replaced by the prefix OR of the head mask, so
+// that on return f is zero only for bytes before the first head.
+
+static inline
+__m128i SegmentedScan_vector(__m128i x, __m128i *f)
+{
+  __m128i m = *f;
+  x = _mm_add_epi8(x, _mm_andnot_si128(m, _mm_slli_si128(x, 1)));
+  m = _mm_or_si128(m, _mm_slli_si128(m, 1));
+  x = _mm_add_epi8(x, _mm_andnot_si128(m, _mm_slli_si128(x, 2)));
+  m = _mm_or_si128(m, _mm_slli_si128(m, 2));
+  x = _mm_add_epi8(x, _mm_andnot_si128(m, _mm_slli_si128(x, 4)));
+  m = _mm_or_si128(m, _mm_slli_si128(m, 4));
+  x = _mm_add_epi8(x, _mm_andnot_si128(m, _mm_slli_si128(x, 8)));
+  m = _mm_or_si128(m, _mm_slli_si128(m, 8));
+  *f = m;
+  return x;
+}
+
+static inline
+uint8_t SegmentedScan_lastByte(__m128i x)
+{
+  return (uint8_t) (_mm_extract_epi16(x, 7) >> 8);
+}
+
+#elif defined(SEGMENTED_SCAN_NEON)
+
+static inline
+uint8x16_t SegmentedScan_headMask16(const uint8_t *headFlags, int i)
+{
+  static const uint8_t bitsArr[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t v = vcombine_u8(vdup_n_u8(headFlags[i >> 3]), vdup_n_u8(headFlags[(i >> 3) + 1]));
+  return vtstq_u8(v, vld1q_u8(bitsArr));
+}
+
+static inline
+uint8x16_t SegmentedScan_vector(uint8x16_t x, uint8x16_t *f)
+{
+  const uint8x16_t zero = vdupq_n_u8(0);
+  uint8x16_t m = *f;
+  x = vaddq_u8(x, vbicq_u8(vextq_u8(zero, x, 15), m));
+  m = vorrq_u8(m, vextq_u8(zero, m, 15));
+  x = vaddq_u8(x, vbicq_u8(vextq_u8(zero, x, 14), m));
+  m = vorrq_u8(m, vextq_u8(zero, m, 14));
+  x = vaddq_u8(x, vbicq_u8(vextq_u8(zero, x, 12), m));
+  m = vorrq_u8(m, vextq_u8(zero, m, 12));
+  x = vaddq_u8(x, vbicq_u8(vextq_u8(zero, x, 8), m));
+  m = vorrq_u8(m, vextq_u8(zero, m, 8));
+  *f = m;
+  return x;
+}
+
+static inline
+uint8_t SegmentedScan_lastByte(uint8x16_t x)
+{
+  return vgetq_lane_u8(x, 15);
+}
+
+#endif
+
+// Scan one contiguous segment of numBytes bytes, the running sum
+// starts at carryIn. Returns the inclusive sum of the last byte.
+
+static inline
+uint8_t SegmentedScan_run(const uint8_t *inBytes,
+                          uint8_t *outBytes,
+                          int numBytes,
+                          uint8_t carryIn,
+                          int isExclusive)
+{
+  uint8_t byteSum = carryIn;
+  int i = 0;
+
+#if defined(SEGMENTED_SCAN_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+
+  for ( ; (i + 16) <= numBytes; i += 16 ) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (inBytes + i));
+    __m128i f = zero;
+    __m128i s = _mm_add_epi8(SegmentedScan_vector(x, &f), _mm_set1_epi8((char) byteSum));
+    byteSum = SegmentedScan_lastByte(s);
+    if (isExclusive) {
+      s = _mm_sub_epi8(s, x);
+    }
+    _mm_storeu_si128((__m128i *) (outBytes + i), s);
+  }
+#elif defined(SEGMENTED_SCAN_NEON)
+  const uint8x16_t zero = vdupq_n_u8(0);
+
+  for ( ; (i + 16) <= numBytes; i += 16 ) {
+    uint8x16_t x = vld1q_u8(inBytes + i);
+    uint8x16_t f = zero;
+    uint8x16_t s = vaddq_u8(SegmentedScan_vector(x, &f), vdupq_n_u8(byteSum));
+    byteSum = SegmentedScan_lastByte(s);
+    if (isExclusive) {
+      s = vsubq_u8(s, x);
+    }
+    vst1q_u8(outBytes + i, s);
+  }
+#endif
+
+  if (isExclusive) {
+    for ( ; i < numBytes; i++ ) {
+      uint8_t inByte = inBytes[i];
+      outBytes[i] = byteSum;
+      byteSum += inByte;
+    }
+  } else {
+    for ( ; i < numBytes; i++ ) {
+      byteSum += inBytes[i];
+      outBytes[i] = byteSum;
+    }
+  }
+
+  return byteSum;
+}
+
+// Fixed length segments in the range [startSegment, endSegment).
+// Segments shorter than a vector that evenly divide 16 are scanned
+// several at a time with a constant head mask.
+
+static inline
+void SegmentedScan_fixedRange(const uint8_t *inBytes,
+                              uint8_t *outBytes,
+                              int segmentLength,
+                              int startSegment,
+                              int endSegment,
+                              int isExclusive)
+{
+  int segmenti = startSegment;
+
+#if defined(SEGMENTED_SCAN_SSE2) || defined(SEGMENTED_SCAN_NEON)
+  if (segmentLength < 16 && (16 % segmentLength) == 0) {
+    uint8_t maskArr[16];
+    for ( int i = 0; i < 16; i++ ) {
+      maskArr[i] = ((i % segmentLength) == 0) ? 0xFF : 0;
+    }
+
+    const int numSegmentsInVector = 16 / segmentLength;
+
+# if defined(SEGMENTED_SCAN_SSE2)
+    const __m128i heads = _mm_loadu_si128((const __m128i *) maskArr);
+# else
+    const uint8x16_t heads = vld1q_u8(maskArr);
+# endif
+
+    for ( ; (segmenti + numSegmentsInVector) <= endSegment; segmenti += numSegmentsInVector ) {
+      const int offset = segmenti * segmentLength;
+# if defined(SEGMENTED_SCAN_SSE2)
+      __m128i x = _mm_loadu_si128((const __m128i *) (inBytes + offset));
+      __m128i f = heads;
+      __m128i s = SegmentedScan_vector(x, &f);
+      if (isExclusive) {
+        s = _mm_sub_epi8(s, x);
+      }
+      _mm_storeu_si128((__m128i *) (outBytes + offset), s);
+# else
+      uint8x16_t x = vld1q_u8(inBytes + offset);
+      uint8x16_t f = heads;
+      uint8x16_t s = SegmentedScan_vector(x, &f);
+      if (isExclusive) {
+        s = vsubq_u8(s, x);
+      }
+      vst1q_u8(outBytes + offset, s);
+# endif
+    }
+  }
+#endif
+
+  for ( ; segmenti < endSegment; segmenti++ ) {
+    const int offset = segmenti * segmentLength;
+    SegmentedScan_run(inBytes + offset, outBytes + offset, segmentLength, 0, isExclusive);
+  }
+}
+
+// Segments given by offsets in the range [startSegment, endSegment)
+
+static inline
+void SegmentedScan_offsetsRange(const uint8_t *inBytes,
+                                uint8_t *outBytes,
+                                const int *segmentOffsets,
+                                int startSegment,
+                                int endSegment,
+                                int isExclusive)
+{
+  for ( int segmenti = startSegment; segmenti < endSegment; segmenti++ ) {
+    const int offset = segmentOffsets[segmenti];
+    const int len = segmentOffsets[segmenti+1] - offset;
+    SegmentedScan_run(inBytes + offset, outBytes + offset, len, 0, isExclusive);
+  }
+}
+
+// Head flag segmented scan of the range [start, end) with a zero carry
+// in. start must be a multiple of 16 when vectors are enabled. The
+// offset of the first head at or after start, or end if there is no
+// head in the range, is written to firstHeadPtr. Returns the inclusive
+// sum of the last byte in the range.
+
+static inline
+uint8_t SegmentedScan_headFlagsRange(const uint8_t *inBytes,
+                                     uint8_t *outBytes,
+                                     const uint8_t *headFlags,
+                                     int start,
+                                     int end,
+                                     int isExclusive,
+                                     int *firstHeadPtr)
+{
+  uint8_t byteSum = 0;
+  int firstHead = end;
+  int i = start;
+
+#if defined(SEGMENTED_SCAN_SSE2) || defined(SEGMENTED_SCAN_NEON)
+# if defined(DEBUG)
+  assert((start % 16) == 0);
+# endif // DEBUG
+
+  for ( ; (i + 16) <= end; i += 16 ) {
+# if defined(SEGMENTED_SCAN_SSE2)
+    __m128i x = _mm_loadu_si128((const __m128i *) (inBytes + i));
+    __m128i f = SegmentedScan_headMask16(headFlags, i);
+    const int headBits = _mm_movemask_epi8(f);
+    __m128i s = SegmentedScan_vector(x, &f);
+    // Carry only reaches bytes before the first head
+    s = _mm_add_epi8(s, _mm_andnot_si128(f, _mm_set1_epi8((char) byteSum)));
+    byteSum = SegmentedScan_lastByte(s);
+    if (isExclusive) {
+      s = _mm_sub_epi8(s, x);
+    }
+    _mm_storeu_si128((__m128i *) (outBytes + i), s);
+# else
+    uint8x16_t x = vld1q_u8(inBytes + i);
+    uint8x16_t f = SegmentedScan_headMask16(headFlags, i);
+    const int headBits = (headFlags[i >> 3] | headFlags[(i >> 3) + 1]) != 0;
+    uint8x16_t s = SegmentedScan_vector(x, &f);
+    s = vaddq_u8(s, vbicq_u8(vdupq_n_u8(byteSum), f));
+    byteSum = SegmentedScan_lastByte(s);
+    if (isExclusive) {
+      s = vsubq_u8(s, x);
+    }
+    vst1q_u8(outBytes + i, s);
+# endif
+
+    if (firstHead == end && headBits != 0) {
+      for ( int j = i; j < (i + 16); j++ ) {
+        if (SegmentedScan_isHead(headFlags, j)) {
+          firstHead = j;
+          break;
+        }
+      }
+    }
+  }
+#endif
+
+  for ( ; i < end; i++ ) {
+    if (i == 0 || SegmentedScan_isHead(headFlags, i)) {
+      byteSum = 0;
+      if (firstHead == end) {
+        firstHead = i;
+      }
+    }
+
+    uint8_t inByte = inBytes[i];
+    byteSum += inByte;
+    outBytes[i] = isExclusive ? (uint8_t) (byteSum - inByte) : byteSum;
+  }
+
+  // Element 0 always begins a segment even when its flag is not set
+
+  if (start == 0) {
+    firstHead = 0;
+  }
+
+  *firstHeadPtr = firstHead;
+  return byteSum;
+}
+
+typedef struct {
+  const uint8_t *inBytes;
+  uint8_t *outBytes;
+  int numBytes;
+  int isExclusive;
+  int segmentLength;
+  const int *segmentOffsets;
+  int numSegments;
+  const uint8_t *headFlags;
+  int chunkLength;
+  int numChunks;
+  int firstHeads[PARALLEL_FOR_MAX_THREADS];
+  uint8_t carryOuts[PARALLEL_FOR_MAX_THREADS];
+  uint8_t carryIns[PARALLEL_FOR_MAX_THREADS];
+} SegmentedScanContext;
+
+static inline
+void SegmentedScan_fixedChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  SegmentedScanContext *ssc = (SegmentedScanContext *) ctx;
+  SegmentedScan_fixedRange(ssc->inBytes, ssc->outBytes, ssc->segmentLength, start, end, ssc->isExclusive);
+}
+
+// Find the first segment that begins at or after byteOffset
+
+static inline
+int SegmentedScan_segmentForByte(const int *segmentOffsets, int numSegments, int byteOffset)
+{
+  int lo = 0;
+  int hi = numSegments;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (segmentOffsets[mid] < byteOffset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// Each chunk is one thread, segments are split so that each
+// thread processes about the same number of bytes.
+
+static inline
+void SegmentedScan_offsetsChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  SegmentedScanContext *ssc = (SegmentedScanContext *) ctx;
+
+  const int numChunks = ssc->numChunks;
+
+  for ( int chunki = start; chunki < end; chunki++ ) {
+    const int startByte = (int) (((int64_t) ssc->numBytes * chunki) / numChunks);
+    const int endByte = (int) (((int64_t) ssc->numBytes * (chunki + 1)) / numChunks);
+
+    const int startSegment = SegmentedScan_segmentForByte(ssc->segmentOffsets, ssc->numSegments, startByte);
+    const int endSegment = SegmentedScan_segmentForByte(ssc->segmentOffsets, ssc->numSegments, endByte);
+
+    SegmentedScan_offsetsRange(ssc->inBytes, ssc->outBytes, ssc->segmentOffsets,
+                               startSegment, (chunki == (numChunks - 1)) ? ssc->numSegments : endSegment,
+                               ssc->isExclusive);
+  }
+}
+
+static inline
+void SegmentedScan_headFlagsScanChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  SegmentedScanContext *ssc = (SegmentedScanContext *) ctx;
+
+  for ( int chunki = start; chunki < end; chunki++ ) {
+    const int startByte = chunki * ssc->chunkLength;
+    int endByte = startByte + ssc->chunkLength;
+    if (endByte > ssc->numBytes) {
+      endByte = ssc->numBytes;
+    }
+
+    ssc->carryOuts[chunki] = SegmentedScan_headFlagsRange(ssc->inBytes, ssc->outBytes, ssc->headFlags,
+                                                          startByte, endByte, ssc->isExclusive,
+                                                          &ssc->firstHeads[chunki]);
+  }
+}
+
+// Add the carry from previous chunks to the bytes that come before
+// the first head in each chunk.
+
+static inline
+void SegmentedScan_headFlagsFixupChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  SegmentedScanContext *ssc = (SegmentedScanContext *) ctx;
+
+  for ( int chunki = start; chunki < end; chunki++ ) {
+    const uint8_t carry = ssc->carryIns[chunki];
+
+    if (carry == 0) {
+      continue;
+    }
+
+    const int startByte = chunki * ssc->chunkLength;
+    const int endByte = ssc->firstHeads[chunki];
+
+    for ( int i = startByte; i < endByte; i++ ) {
+      ssc->outBytes[i] += carry;
+    }
+  }
+}
+
+// Scan numBytes bytes made up of segments of segmentLength bytes
+
+static inline
+void SegmentedScan_fixed(const uint8_t *inBytes,
+                         uint8_t *outBytes,
+                         int numBytes,
+                         int segmentLength,
+                         int isExclusive,
+                         int numThreads)
+{
+#if defined(DEBUG)
+  assert(segmentLength > 0);
+  assert((numBytes % segmentLength) == 0);
+#endif // DEBUG
+
+  SegmentedScanContext ssc;
+  ssc.inBytes = inBytes;
+  ssc.outBytes = outBytes;
+  ssc.numBytes = numBytes;
+  ssc.isExclusive = isExclusive;
+  ssc.segmentLength = segmentLength;
+
+  ParallelFor_run(numThreads, numBytes / segmentLength, SegmentedScan_fixedChunk, &ssc);
+}
+
+// Scan numSegments segments, segmentOffsets holds (numSegments + 1)
+// increasing offsets with segmentOffsets[0] == 0 and the last equal to
+// the total number of bytes. When every segment has the same length
+// the fixed length path is used.
+
+static inline
+void SegmentedScan_offsets(const uint8_t *inBytes,
+                           uint8_t *outBytes,
+                           const int *segmentOffsets,
+                           int numSegments,
+                           int isExclusive,
+                           int numThreads)
+{
+  if (numSegments <= 0) {
+    return;
+  }
+
+  const int numBytes = segmentOffsets[numSegments];
+  const int segmentLength = segmentOffsets[1] - segmentOffsets[0];
+
+#if defined(DEBUG)
+  assert(segmentOffsets[0] == 0);
+#endif // DEBUG
+
+  int isFixed = (segmentLength > 0);
+
+  for ( int segmenti = 1; isFixed && segmenti < numSegments; segmenti++ ) {
+    if ((segmentOffsets[segmenti+1] - segmentOffsets[segmenti]) != segmentLength) {
+      isFixed = 0;
+    }
+  }
+
+  if (isFixed) {
+    SegmentedScan_fixed(inBytes, outBytes, numBytes, segmentLength, isExclusive, numThreads);
+    return;
+  }
+
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > PARALLEL_FOR_MAX_THREADS) {
+    numThreads = PARALLEL_FOR_MAX_THREADS;
+  }
+
+  SegmentedScanContext ssc;
+  ssc.inBytes = inBytes;
+  ssc.outBytes = outBytes;
+  ssc.numBytes = numBytes;
+  ssc.isExclusive = isExclusive;
+  ssc.segmentOffsets = segmentOffsets;
+  ssc.numSegments = numSegments;
+  ssc.numChunks = numThreads;
+
+  ParallelFor_run(numThreads, numThreads, SegmentedScan_offsetsChunk, &ssc);
+}
+
+// Scan numBytes bytes with segments marked in the headFlags bitmap,
+// which must hold at least ((numBytes + 7) / 8) bytes.
+
+static inline
+void SegmentedScan_headFlags(const uint8_t *inBytes,
+                             uint8_t *outBytes,
+                             const uint8_t *headFlags,
+                             int numBytes,
+                             int isExclusive,
+                             int numThreads)
+{
+  if (numBytes <= 0) {
+    return;
+  }
+
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > PARALLEL_FOR_MAX_THREADS) {
+    numThreads = PARALLEL_FOR_MAX_THREADS;
+  }
+
+  SegmentedScanContext ssc;
+  ssc.inBytes = inBytes;
+  ssc.outBytes = outBytes;
+  ssc.numBytes = numBytes;
+  ssc.isExclusive = isExclusive;
+  ssc.headFlags = headFlags;
+
+  // Chunks are a multiple of 16 bytes so that each begins on a vector
+  int chunkLength = (numBytes + numThreads - 1) / numThreads;
+  chunkLength = (chunkLength + 15) & ~15;
+  const int numChunks = (numBytes + chunkLength - 1) / chunkLength;
+
+  ssc.chunkLength = chunkLength;
+  ssc.numChunks = numChunks;
+
+  ParallelFor_run(numThreads, numChunks, SegmentedScan_headFlagsScanChunk, &ssc);
+
+  if (numChunks == 1) {
+    return;
+  }
+
+  // Serial scan of the carry out from each chunk, a chunk that
+  // contains a head passes on its own carry out.
+
+  uint8_t carry = 0;
+
+  for ( int chunki = 0; chunki < numChunks; chunki++ ) {
+    const int startByte = chunki * chunkLength;
+    const int endByte = (startByte + chunkLength) < numBytes ? (startByte + chunkLength) : numBytes;
+
+    ssc.carryIns[chunki] = carry;
+
+    if (ssc.firstHeads[chunki] < endByte) {
+      carry = ssc.carryOuts[chunki];
+    } else {
+      carry += ssc.carryOuts[chunki];
+    }
+  }
+
+  ParallelFor_run(numThreads, numChunks, SegmentedScan_headFlagsFixupChunk, &ssc);
+}
+
+// Convert segment offsets into a head flags bitmap of numFlagBytes bytes
+
+static inline
+void SegmentedScan_offsetsToHeadFlags(const int *segmentOffsets,
+                                      int numSegments,
+                                      uint8_t *headFlags,
+                                      int numFlagBytes)
+{
+  memset(headFlags, 0, numFlagBytes);
+
+  for ( int segmenti = 0; segmenti < numSegments; segmenti++ ) {
+    const int offset = segmentOffsets[segmenti];
+    headFlags[offset >> 3] |= (uint8_t) (1 << (offset & 0x7));
+  }
+}
+
+#endif // _segmented_scan_h
@@ -0,0 +1,546 @@
+//
+//  stripe_driver.h
+//
+//  MIT Licensed
+//
+//  Inline methods that process an image of any size as horizontal bands
+//  of whole block rows. Two band buffers are allocated up front. While
+//  the caller processes band K in one buffer, a reader thread streams
+//  band K+1 from the ImageStream into the other buffer, so file reads
+//  and grayscale conversion overlap with the scan. Memory use depends
+//  only on the image width and the working set limit, not on the image
+//  height, and a full frame is never held in memory.
+//
+//  StripeEncoder is a band callback that delta encodes each band with
+//  one CRC32C per block row and writes the result to a FILE. The file
+//  starts with a FrameHeader that has the striped and block row checksum
+//  flags set, followed by the number of block rows in a band as a little
+//  endian uint32. Each band is then written as the band deltas followed
+//  by one little endian uint32 checksum for each block row in the band.
+//
+//  StripeDecoder reads that file back one band at a time, so decoding
+//  also only holds one band of deltas and one band of decoded bytes.
+//
+//  The working set limit passed to StripeDriver_init covers every band
+//  sized buffer of an encode: the two input bands and the band of
+//  deltas StripeEncoder holds. Decoding the same file holds two bands,
+//  so it stays under the same limit.
+
+#ifndef _stripe_driver_h
+#define _stripe_driver_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "image_stream.h"
+#include "frame_encoder.h"
+#include "frame_header.h"
+
+// Band sized buffers held during an encode, two input bands that the
+// reader thread double buffers and one band of StripeEncoder deltas
+
+#define STRIPE_DRIVER_NUM_BAND_BUFFERS 3
+
+// Default limit for all band buffers together
+
+#define STRIPE_DRIVER_DEFAULT_WORKING_SET_BYTES (8 * 1024 * 1024)
+
+// Invoked once for each band in order. bandBytes holds numBlockRows
+// rows of blocks in block order. Return 0 to continue or -1 to stop.
+
+typedef int (*StripeDriverBandFunc)(void *ctx,
+                                    int bandi,
+                                    int firstBlockRowi,
+                                    int numBlockRows,
+                                    const uint8_t *bandBytes,
+                                    int numBandBytes);
+
+typedef struct {
+  ImageStream *stream;
+  int blockSize;
+  uint8_t zeroValue;
+
+  int numBlocksInWidth;
+  int numBlocksInHeight;
+  int numBlockRowBytes;
+
+  int numBlockRowsInBand;
+  int numBands;
+
+  uint8_t *bandBuffers[2];
+} StripeDriver;
+
+typedef struct {
+  StripeDriver *driver;
+  int bandi;
+  uint8_t *bandBytes;
+  int status;
+} StripeDriverRead;
+
+// Open a driver for an already opened stream. Bands are sized so that
+// STRIPE_DRIVER_NUM_BAND_BUFFERS bands fit in maxWorkingSetBytes, a band
+// is always at least one row of blocks. Returns 0 on success.
+
+static inline
+int StripeDriver_init(StripeDriver *driver,
+                      ImageStream *stream,
+                      int blockSize,
+                      int maxWorkingSetBytes,
+                      uint8_t zeroValue)
+{
+  memset(driver, 0, sizeof(StripeDriver));
+
+  driver->stream = stream;
+  driver->blockSize = blockSize;
+  driver->zeroValue = zeroValue;
+
+  if (stream->width <= 0 || stream->height <= 0 || blockSize <= 0) {
+    fprintf(stderr, "invalid stripe dimensions %d x %d\n", stream->width, stream->height);
+    return -1;
+  }
+
+  driver->numBlocksInWidth = (stream->width + blockSize - 1) / blockSize;
+  driver->numBlocksInHeight = (stream->height + blockSize - 1) / blockSize;
+
+  // A band is at least one row of blocks and is passed to the band
+  // function with an int byte count.
+  const int64_t numBlockRowBytes = (int64_t) blockSize * blockSize * driver->numBlocksInWidth;
+
+  if (numBlockRowBytes > INT_MAX) {
+    fprintf(stderr, "a row of blocks %d pixels wide is too large\n", stream->width);
+    return -1;
+  }
+
+  driver->numBlockRowBytes = (int) numBlockRowBytes;
+
+  int numBlockRowsInBand = (int) (maxWorkingSetBytes / ((int64_t) STRIPE_DRIVER_NUM_BAND_BUFFERS * driver->numBlockRowBytes));
+
+  if (numBlockRowsInBand < 1) {
+    numBlockRowsInBand = 1;
+  } else if (numBlockRowsInBand > driver->numBlocksInHeight) {
+    numBlockRowsInBand = driver->numBlocksInHeight;
+  }
+
+  driver->numBlockRowsInBand = numBlockRowsInBand;
+  driver->numBands = (driver->numBlocksInHeight + numBlockRowsInBand - 1) / numBlockRowsInBand;
+
+  const size_t numBandBytes = (size_t) numBlockRowsInBand * driver->numBlockRowBytes;
+
+  for ( int i = 0; i < 2; i++ ) {
+    driver->bandBuffers[i] = (uint8_t *) malloc(numBandBytes);
+
+    if (driver->bandBuffers[i] == NULL) {
+      fprintf(stderr, "could not allocate %zu byte band buffer\n", numBandBytes);
+      free(driver->bandBuffers[0]);
+      driver->bandBuffers[0] = NULL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static inline
+void StripeDriver_free(StripeDriver *driver)
+{
+  free(driver->bandBuffers[0]);
+  free(driver->bandBuffers[1]);
+  driver->bandBuffers[0] = NULL;
+  driver->bandBuffers[1] = NULL;
+}
+
+// Number of block rows in band bandi, the last band may be short
+
+static inline
+int StripeDriver_numBlockRowsInBand(const StripeDriver *driver, int bandi)
+{
+  const int firstBlockRowi = bandi * driver->numBlockRowsInBand;
+  int numBlockRows = driver->numBlocksInHeight - firstBlockRowi;
+
+  if (numBlockRows > driver->numBlockRowsInBand) {
+    numBlockRows = driver->numBlockRowsInBand;
+  }
+
+  return numBlockRows;
+}
+
+// Read every block row in band bandi into bandBytes
+
+static inline
+int StripeDriver_readBand(StripeDriver *driver, int bandi, uint8_t *bandBytes)
+{
+  const int firstBlockRowi = bandi * driver->numBlockRowsInBand;
+  const int numBlockRows = StripeDriver_numBlockRowsInBand(driver, bandi);
+
+  for ( int i = 0; i < numBlockRows; i++ ) {
+    uint8_t *blockRowBytes = bandBytes + ((size_t) i * driver->numBlockRowBytes);
+
+    if (ImageStream_readBlockRow(driver->stream, driver->blockSize, firstBlockRowi + i,
+                                 blockRowBytes, driver->zeroValue) != 0) {
+      fprintf(stderr, "could not read block row %d\n", firstBlockRowi + i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static inline
+void* StripeDriver_readThreadMain(void *arg)
+{
+  StripeDriverRead *read = (StripeDriverRead *) arg;
+  read->status = StripeDriver_readBand(read->driver, read->bandi, read->bandBytes);
+  return NULL;
+}
+
+// Process every band in order, reading band K+1 on a second thread
+// while func processes band K. Returns 0 on success or -1 if a read
+// failed or func returned an error.
+
+static inline
+int StripeDriver_run(StripeDriver *driver, StripeDriverBandFunc func, void *ctx)
+{
+  if (driver->numBands == 0) {
+    return 0;
+  }
+
+  if (StripeDriver_readBand(driver, 0, driver->bandBuffers[0]) != 0) {
+    return -1;
+  }
+
+  int status = 0;
+
+  for ( int bandi = 0; bandi < driver->numBands; bandi++ ) {
+    uint8_t *bandBytes = driver->bandBuffers[bandi & 0x1];
+
+    StripeDriverRead nextRead;
+    pthread_t readThread;
+    int isReading = 0;
+
+    const int hasNext = (bandi + 1) < driver->numBands;
+
+    if (hasNext) {
+      nextRead.driver = driver;
+      nextRead.bandi = bandi + 1;
+      nextRead.bandBytes = driver->bandBuffers[(bandi + 1) & 0x1];
+      nextRead.status = 0;
+
+      isReading = (pthread_create(&readThread, NULL, StripeDriver_readThreadMain, &nextRead) == 0);
+    }
+
+    const int numBlockRows = StripeDriver_numBlockRowsInBand(driver, bandi);
+
+    status = func(ctx, bandi, bandi * driver->numBlockRowsInBand, numBlockRows,
+                  bandBytes, numBlockRows * driver->numBlockRowBytes);
+
+    if (isReading) {
+      pthread_join(readThread, NULL);
+    } else if (hasNext && status == 0) {
+      // Could not create a thread, read on the caller
+      StripeDriver_readThreadMain(&nextRead);
+    }
+
+    if (status != 0) {
+      return -1;
+    }
+
+    if (hasNext && nextRead.status != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+typedef struct {
+  FILE *outFile;
+  int numThreads;
+  int numBytesInBlock;
+  int numBlocksInWidth;
+
+  // Scratch space for one band, allocated once
+  uint8_t *deltas;
+  uint32_t *checksums;
+  uint8_t *checksumBytes;
+} StripeEncoder;
+
+static inline
+void StripeEncoder_free(StripeEncoder *encoder)
+{
+  free(encoder->deltas);
+  free(encoder->checksums);
+  free(encoder->checksumBytes);
+  encoder->deltas = NULL;
+  encoder->checksums = NULL;
+  encoder->checksumBytes = NULL;
+}
+
+// Allocate band buffers and write the stripe file header to outFile
+
+static inline
+int StripeEncoder_init(StripeEncoder *encoder, const StripeDriver *driver, FILE *outFile, int numThreads)
+{
+  memset(encoder, 0, sizeof(StripeEncoder));
+
+  encoder->outFile = outFile;
+  encoder->numThreads = numThreads;
+  encoder->numBytesInBlock = driver->blockSize * driver->blockSize;
+  encoder->numBlocksInWidth = driver->numBlocksInWidth;
+
+  FrameHeader header;
+  header.width = driver->stream->width;
+  header.height = driver->stream->height;
+  header.blockSize = driver->blockSize;
+  header.flags = FRAME_HEADER_FLAG_STRIPED | FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS;
+
+  // FrameHeader_read rejects frames that do not fit in an int, so do
+  // not write a frame that could never be decoded.
+  if (FrameHeader_numBlockBytes(&header) > INT_MAX) {
+    fprintf(stderr, "%d x %d is too large for a striped frame\n", driver->stream->width, driver->stream->height);
+    return -1;
+  }
+
+  const size_t numBandBytes = (size_t) driver->numBlockRowsInBand * driver->numBlockRowBytes;
+  const size_t numChecksumBytes = (size_t) driver->numBlockRowsInBand * sizeof(uint32_t);
+
+  encoder->deltas = (uint8_t *) malloc(numBandBytes);
+  encoder->checksums = (uint32_t *) malloc(numChecksumBytes);
+  encoder->checksumBytes = (uint8_t *) malloc(numChecksumBytes);
+
+  if (encoder->deltas == NULL || encoder->checksums == NULL || encoder->checksumBytes == NULL) {
+    fprintf(stderr, "could not allocate stripe encoder buffers\n");
+    StripeEncoder_free(encoder);
+    return -1;
+  }
+
+  uint8_t headerBytes[FRAME_HEADER_NUM_BYTES + sizeof(uint32_t)];
+  FrameHeader_write(&header, headerBytes);
+  FrameHeader_writeUInt32(headerBytes + FRAME_HEADER_NUM_BYTES, driver->numBlockRowsInBand);
+
+  if (fwrite(headerBytes, 1, sizeof(headerBytes), outFile) != sizeof(headerBytes)) {
+    fprintf(stderr, "could not write stripe header\n");
+    StripeEncoder_free(encoder);
+    return -1;
+  }
+
+  return 0;
+}
+
+// StripeDriverBandFunc that encodes a band and writes it to outFile
+
+static inline
+int StripeEncoder_encodeBand(void *ctx,
+                             int bandi,
+                             int firstBlockRowi,
+                             int numBlockRows,
+                             const uint8_t *bandBytes,
+                             int numBandBytes)
+{
+  (void) firstBlockRowi;
+  StripeEncoder *encoder = (StripeEncoder *) ctx;
+
+  const int numBlocks = numBlockRows * encoder->numBlocksInWidth;
+
+  FrameEncoder_encodeDeltasWithChecksums(bandBytes, encoder->deltas,
+                                         encoder->numBytesInBlock, numBlocks, NULL,
+                                         encoder->numBlocksInWidth, encoder->checksums,
+                                         encoder->numThreads);
+
+  for ( int i = 0; i < numBlockRows; i++ ) {
+    FrameHeader_writeUInt32(encoder->checksumBytes + (i * sizeof(uint32_t)), encoder->checksums[i]);
+  }
+
+  if (fwrite(encoder->deltas, 1, numBandBytes, encoder->outFile) != (size_t) numBandBytes) {
+    fprintf(stderr, "could not write band %d\n", bandi);
+    return -1;
+  }
+
+  const size_t numChecksumBytes = numBlockRows * sizeof(uint32_t);
+
+  if (fwrite(encoder->checksumBytes, 1, numChecksumBytes, encoder->outFile) != numChecksumBytes) {
+    fprintf(stderr, "could not write band %d checksums\n", bandi);
+    return -1;
+  }
+
+  return 0;
+}
+
+typedef struct {
+  FILE *inFile;
+  int numThreads;
+  FrameHeader header;
+
+  int numBytesInBlock;
+  int numBlocksInWidth;
+  int numBlocksInHeight;
+  int numBlockRowBytes;
+  int numBlockRowsInBand;
+  int numBands;
+
+  // Next band to decode
+  int bandi;
+
+  uint8_t *deltas;
+  uint8_t *bandBytes;
+  uint32_t *checksums;
+  uint8_t *checksumBytes;
+} StripeDecoder;
+
+static inline
+void StripeDecoder_free(StripeDecoder *decoder)
+{
+  free(decoder->deltas);
+  free(decoder->bandBytes);
+  free(decoder->checksums);
+  free(decoder->checksumBytes);
+  decoder->deltas = NULL;
+  decoder->bandBytes = NULL;
+  decoder->checksums = NULL;
+  decoder->checksumBytes = NULL;
+}
+
+// Read the stripe file header from inFile and allocate buffers for
+// one band. Returns 0 on success or -1 if inFile is not a stripe file.
+
+static inline
+int StripeDecoder_init(StripeDecoder *decoder, FILE *inFile, int numThreads)
+{
+  memset(decoder, 0, sizeof(StripeDecoder));
+
+  decoder->inFile = inFile;
+  decoder->numThreads = numThreads;
+
+  uint8_t headerBytes[FRAME_HEADER_NUM_BYTES + sizeof(uint32_t)];
+
+  if (fread(headerBytes, 1, sizeof(headerBytes), inFile) != sizeof(headerBytes) ||
+      FrameHeader_read(headerBytes, FRAME_HEADER_NUM_BYTES, &decoder->header) != 0) {
+    fprintf(stderr, "could not read stripe header\n");
+    return -1;
+  }
+
+  const uint32_t requiredFlags = FRAME_HEADER_FLAG_STRIPED | FRAME_HEADER_FLAG_BLOCK_ROW_CHECKSUMS;
+
+  if ((decoder->header.flags & requiredFlags) != requiredFlags) {
+    fprintf(stderr, "frame is not striped\n");
+    return -1;
+  }
+
+  decoder->numBytesInBlock = decoder->header.blockSize * decoder->header.blockSize;
+  decoder->numBlocksInWidth = FrameHeader_numBlocksInWidth(&decoder->header);
+  decoder->numBlocksInHeight = FrameHeader_numBlocksInHeight(&decoder->header);
+  decoder->numBlockRowBytes = BlockSplit_blockRowNumBytes(decoder->header.blockSize, decoder->numBlocksInWidth);
+
+  // The band row count is untrusted, a band can not be taller than
+  // the frame. FrameHeader_read checked that the whole frame of block
+  // bytes fits in an int, so a band of block bytes does as well.
+
+  const uint32_t numBlockRowsInBand = FrameHeader_readUInt32(headerBytes + FRAME_HEADER_NUM_BYTES);
+
+  if (numBlockRowsInBand < 1 || numBlockRowsInBand > (uint32_t) decoder->numBlocksInHeight) {
+    fprintf(stderr, "invalid stripe band of %u block rows for %d rows of blocks\n",
+            numBlockRowsInBand, decoder->numBlocksInHeight);
+    return -1;
+  }
+
+  decoder->numBlockRowsInBand = (int) numBlockRowsInBand;
+  decoder->numBands = (decoder->numBlocksInHeight + decoder->numBlockRowsInBand - 1) / decoder->numBlockRowsInBand;
+
+  const size_t numBandBytes = (size_t) decoder->numBlockRowsInBand * decoder->numBlockRowBytes;
+  const size_t numChecksumBytes = (size_t) decoder->numBlockRowsInBand * sizeof(uint32_t);
+
+  // When reading a regular file, the file must hold every band before
+  // band buffers are allocated.
+
+  struct stat st;
+
+  if (fstat(fileno(inFile), &st) == 0 && S_ISREG(st.st_mode)) {
+    const int64_t numFileBytes = (int64_t) sizeof(headerBytes) +
+                                 FrameHeader_numBlockBytes(&decoder->header) +
+                                 ((int64_t) decoder->numBlocksInHeight * sizeof(uint32_t));
+
+    if ((int64_t) st.st_size < numFileBytes) {
+      fprintf(stderr, "striped frame is truncated\n");
+      return -1;
+    }
+  }
+
+  decoder->deltas = (uint8_t *) malloc(numBandBytes);
+  decoder->bandBytes = (uint8_t *) malloc(numBandBytes);
+  decoder->checksums = (uint32_t *) malloc(numChecksumBytes);
+  decoder->checksumBytes = (uint8_t *) malloc(numChecksumBytes);
+
+  if (decoder->deltas == NULL || decoder->bandBytes == NULL ||
+      decoder->checksums == NULL || decoder->checksumBytes == NULL) {
+    fprintf(stderr, "could not allocate stripe decoder buffers\n");
+    StripeDecoder_free(decoder);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Read and decode the next band and verify its block row checksums.
+// Sets bandBytes to the decoded block order bytes, which stay valid
+// until the next call, and the first block row and number of block
+// rows in the band. Returns 1 when a band was decoded, 0 once every
+// band has been decoded, or -1 on a read or checksum failure.
+
+static inline
+int StripeDecoder_decodeBand(StripeDecoder *decoder,
+                             const uint8_t **bandBytesPtr,
+                             int *firstBlockRowiPtr,
+                             int *numBlockRowsPtr)
+{
+  if (decoder->bandi >= decoder->numBands) {
+    return 0;
+  }
+
+  const int bandi = decoder->bandi;
+  const int firstBlockRowi = bandi * decoder->numBlockRowsInBand;
+
+  int numBlockRows = decoder->numBlocksInHeight - firstBlockRowi;
+  if (numBlockRows > decoder->numBlockRowsInBand) {
+    numBlockRows = decoder->numBlockRowsInBand;
+  }
+
+  const size_t numBandBytes = (size_t) numBlockRows * decoder->numBlockRowBytes;
+  const size_t numChecksumBytes = (size_t) numBlockRows * sizeof(uint32_t);
+
+  if (fread(decoder->deltas, 1, numBandBytes, decoder->inFile) != numBandBytes ||
+      fread(decoder->checksumBytes, 1, numChecksumBytes, decoder->inFile) != numChecksumBytes) {
+    fprintf(stderr, "band %d is truncated\n", bandi);
+    return -1;
+  }
+
+  for ( int i = 0; i < numBlockRows; i++ ) {
+    decoder->checksums[i] = FrameHeader_readUInt32(decoder->checksumBytes + (i * sizeof(uint32_t)));
+  }
+
+  int numFailed = FrameEncoder_decodeDeltasVerified(decoder->deltas, decoder->bandBytes,
+                                                    decoder->numBytesInBlock,
+                                                    numBlockRows * decoder->numBlocksInWidth,
+                                                    NULL, NULL,
+                                                    decoder->numBlocksInWidth, decoder->checksums,
+                                                    decoder->numThreads);
+
+  if (numFailed != 0) {
+    fprintf(stderr, "%d block rows in band %d failed checksum verification\n", numFailed, bandi);
+    return -1;
+  }
+
+  decoder->bandi += 1;
+
+  *bandBytesPtr = decoder->bandBytes;
+  *firstBlockRowiPtr = firstBlockRowi;
+  *numBlockRowsPtr = numBlockRows;
+
+  return 1;
+}
+
+#endif // _stripe_driver_h
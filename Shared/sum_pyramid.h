@@ -0,0 +1,324 @@
+//
+//  sum_pyramid.h
+//
+//  MIT Licensed
+//
+//  Inline methods that build a multi-resolution pyramid of sums from
+//  decoded block order bytes. Level L holds the total of each square
+//  (2^L x 2^L) sub-block, stored in image order so that a level can be
+//  used directly as a thumbnail. The top level holds one total per
+//  block.
+//
+//  Blocks on the right and bottom edge of an image that is not a
+//  multiple of the block size are zero padded, so their totals include
+//  the padding bytes. With the default zeroValue of 0 the padding adds
+//  nothing to a total, and SumPyramid_mean divides by the number of
+//  image pixels the square covers instead of 2^L x 2^L, so edge means
+//  are not darkened. Call SumPyramid_setImageSize to set the image
+//  dimensions, otherwise every square is treated as fully inside the
+//  image and a mean is the total shifted right by 2*L.
+//
+//  The GPU reduce textures sum pairs of deltas, so their partial sums
+//  are mod 256 differences and not pixel aggregates. This pyramid is
+//  instead built from each decoded block while it is still in L1, so
+//  the decoder produces it without another pass over the frame. Zero
+//  and constant blocks fill their totals without reading any bytes.
+
+#ifndef _sum_pyramid_h
+#define _sum_pyramid_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "parallel_for.h"
+
+// Levels 1 to 7 cover blocks up to 128x128
+
+#define SUM_PYRAMID_MAX_LEVELS 8
+
+typedef struct {
+  int blockSize;
+  int numBlocksInWidth;
+  int numBlocksInHeight;
+
+  // Image dimensions in pixels, edge squares past these are padding
+  int width;
+  int height;
+
+  // log2(blockSize), level numLevels has one value per block
+  int numLevels;
+
+  int levelWidth[SUM_PYRAMID_MAX_LEVELS];
+  int levelHeight[SUM_PYRAMID_MAX_LEVELS];
+
+  // levels[0] is not used, level 0 is the decoded bytes
+  uint32_t *levels[SUM_PYRAMID_MAX_LEVELS];
+} SumPyramid;
+
+// Allocate a pyramid for numBlocksInWidth x numBlocksInHeight blocks,
+// blockSize must be a POT. Returns 0 on success.
+
+static inline
+int SumPyramid_init(SumPyramid *pyramid, int blockSize, int numBlocksInWidth, int numBlocksInHeight)
+{
+  memset(pyramid, 0, sizeof(SumPyramid));
+
+  pyramid->blockSize = blockSize;
+  pyramid->numBlocksInWidth = numBlocksInWidth;
+  pyramid->numBlocksInHeight = numBlocksInHeight;
+  pyramid->width = numBlocksInWidth * blockSize;
+  pyramid->height = numBlocksInHeight * blockSize;
+
+  int numLevels = 0;
+  while ((1 << numLevels) < blockSize) {
+    numLevels++;
+  }
+
+  if ((1 << numLevels) != blockSize || numLevels >= SUM_PYRAMID_MAX_LEVELS) {
+    fprintf(stderr, "unsupported sum pyramid block size %d\n", blockSize);
+    return -1;
+  }
+
+  pyramid->numLevels = numLevels;
+
+  for ( int level = 1; level <= numLevels; level++ ) {
+    const int levelWidth = numBlocksInWidth * (blockSize >> level);
+    const int levelHeight = numBlocksInHeight * (blockSize >> level);
+
+    pyramid->levelWidth[level] = levelWidth;
+    pyramid->levelHeight[level] = levelHeight;
+    pyramid->levels[level] = (uint32_t *) malloc((size_t) levelWidth * levelHeight * sizeof(uint32_t));
+
+    if (pyramid->levels[level] == NULL) {
+      fprintf(stderr, "could not allocate sum pyramid level %d\n", level);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static inline
+void SumPyramid_free(SumPyramid *pyramid)
+{
+  for ( int level = 1; level <= pyramid->numLevels; level++ ) {
+    free(pyramid->levels[level]);
+    pyramid->levels[level] = NULL;
+  }
+}
+
+// Total of the (2^level x 2^level) square at (x, y) in level coordinates
+
+static inline
+uint32_t SumPyramid_total(const SumPyramid *pyramid, int level, int x, int y)
+{
+#if defined(DEBUG)
+  assert(level >= 1 && level <= pyramid->numLevels);
+  assert(x >= 0 && x < pyramid->levelWidth[level]);
+  assert(y >= 0 && y < pyramid->levelHeight[level]);
+#endif // DEBUG
+
+  return pyramid->levels[level][(y * pyramid->levelWidth[level]) + x];
+}
+
+// Set the image dimensions so that edge means only count image pixels
+
+static inline
+void SumPyramid_setImageSize(SumPyramid *pyramid, int width, int height)
+{
+#if defined(DEBUG)
+  assert(width > 0 && width <= (pyramid->numBlocksInWidth * pyramid->blockSize));
+  assert(height > 0 && height <= (pyramid->numBlocksInHeight * pyramid->blockSize));
+#endif // DEBUG
+
+  pyramid->width = width;
+  pyramid->height = height;
+}
+
+// Number of image pixels the square at level coordinate x covers in
+// one dimension of size pixels, zero when the square is all padding.
+
+static inline
+int SumPyramid_numCovered(int level, int x, int size)
+{
+  const int side = 1 << level;
+  int numCovered = size - (x * side);
+
+  if (numCovered > side) {
+    numCovered = side;
+  } else if (numCovered < 0) {
+    numCovered = 0;
+  }
+
+  return numCovered;
+}
+
+// Mean of the image pixels in the square at (x, y), a square that is
+// entirely padding has a mean of zero.
+
+static inline
+uint8_t SumPyramid_mean(const SumPyramid *pyramid, int level, int x, int y)
+{
+  const uint32_t total = SumPyramid_total(pyramid, level, x, y);
+  const int numPixels = SumPyramid_numCovered(level, x, pyramid->width) * SumPyramid_numCovered(level, y, pyramid->height);
+
+  if (numPixels == (1 << (2 * level))) {
+    return (uint8_t) (total >> (2 * level));
+  } else if (numPixels == 0) {
+    return 0;
+  } else {
+    return (uint8_t) (total / numPixels);
+  }
+}
+
+// Total of every byte in block blocki
+
+static inline
+uint32_t SumPyramid_blockTotal(const SumPyramid *pyramid, int blocki)
+{
+  return pyramid->levels[pyramid->numLevels][blocki];
+}
+
+// Add one decoded block of blockSize x blockSize bytes
+
+static inline
+void SumPyramid_addBlock(SumPyramid *pyramid, int blocki, const uint8_t *blockBytes)
+{
+  const int blockSize = pyramid->blockSize;
+  const int blockX = blocki % pyramid->numBlocksInWidth;
+  const int blockY = blocki / pyramid->numBlocksInWidth;
+
+  // Level 1 is the sum of each 2x2 square of bytes
+
+  {
+    const int side = blockSize >> 1;
+    const int levelWidth = pyramid->levelWidth[1];
+    uint32_t *outPtr = pyramid->levels[1] + ((blockY * side) * levelWidth) + (blockX * side);
+
+    for ( int y = 0; y < side; y++ ) {
+      const uint8_t *row0 = blockBytes + ((y * 2) * blockSize);
+      const uint8_t *row1 = row0 + blockSize;
+
+      for ( int x = 0; x < side; x++ ) {
+        outPtr[x] = row0[x*2] + row0[(x*2)+1] + row1[x*2] + row1[(x*2)+1];
+      }
+
+      outPtr += levelWidth;
+    }
+  }
+
+  for ( int level = 2; level <= pyramid->numLevels; level++ ) {
+    const int side = blockSize >> level;
+    const int prevWidth = pyramid->levelWidth[level-1];
+    const int levelWidth = pyramid->levelWidth[level];
+
+    const uint32_t *inPtr = pyramid->levels[level-1] + ((blockY * side * 2) * prevWidth) + (blockX * side * 2);
+    uint32_t *outPtr = pyramid->levels[level] + ((blockY * side) * levelWidth) + (blockX * side);
+
+    for ( int y = 0; y < side; y++ ) {
+      const uint32_t *row0 = inPtr + ((y * 2) * prevWidth);
+      const uint32_t *row1 = row0 + prevWidth;
+
+      for ( int x = 0; x < side; x++ ) {
+        outPtr[x] = row0[x*2] + row0[(x*2)+1] + row1[x*2] + row1[(x*2)+1];
+      }
+
+      outPtr += levelWidth;
+    }
+  }
+}
+
+// Add a block where every byte is value without reading the bytes
+
+static inline
+void SumPyramid_addConstantBlock(SumPyramid *pyramid, int blocki, uint8_t value)
+{
+  const int blockSize = pyramid->blockSize;
+  const int blockX = blocki % pyramid->numBlocksInWidth;
+  const int blockY = blocki / pyramid->numBlocksInWidth;
+
+  for ( int level = 1; level <= pyramid->numLevels; level++ ) {
+    const int side = blockSize >> level;
+    const int levelWidth = pyramid->levelWidth[level];
+    const uint32_t total = ((uint32_t) value) << (2 * level);
+
+    uint32_t *outPtr = pyramid->levels[level] + ((blockY * side) * levelWidth) + (blockX * side);
+
+    for ( int y = 0; y < side; y++ ) {
+      for ( int x = 0; x < side; x++ ) {
+        outPtr[x] = total;
+      }
+      outPtr += levelWidth;
+    }
+  }
+}
+
+// Write the mean of each square at level as an image order thumbnail
+// of levelWidth x levelHeight bytes. Only squares on the right and
+// bottom edge can cover padding, so interior squares use the shift.
+
+static inline
+void SumPyramid_meanImage(const SumPyramid *pyramid, int level, uint8_t *outBytes)
+{
+  const int levelWidth = pyramid->levelWidth[level];
+  const int levelHeight = pyramid->levelHeight[level];
+  const int shift = 2 * level;
+
+  // Squares before these are fully inside the image
+  const int numFullInWidth = pyramid->width >> level;
+  const int numFullInHeight = pyramid->height >> level;
+
+  for ( int y = 0; y < levelHeight; y++ ) {
+    const uint32_t *inPtr = pyramid->levels[level] + (y * levelWidth);
+    uint8_t *outPtr = outBytes + (y * levelWidth);
+
+    if (y >= numFullInHeight) {
+      for ( int x = 0; x < levelWidth; x++ ) {
+        outPtr[x] = SumPyramid_mean(pyramid, level, x, y);
+      }
+      continue;
+    }
+
+    for ( int x = 0; x < numFullInWidth; x++ ) {
+      outPtr[x] = (uint8_t) (inPtr[x] >> shift);
+    }
+
+    for ( int x = numFullInWidth; x < levelWidth; x++ ) {
+      outPtr[x] = SumPyramid_mean(pyramid, level, x, y);
+    }
+  }
+}
+
+typedef struct {
+  SumPyramid *pyramid;
+  const uint8_t *blockBytes;
+} SumPyramidContext;
+
+static inline
+void SumPyramid_addChunk(void *ctx, int threadi, int start, int end)
+{
+  (void) threadi;
+  SumPyramidContext *spc = (SumPyramidContext *) ctx;
+  const int numBytesInBlock = spc->pyramid->blockSize * spc->pyramid->blockSize;
+
+  for ( int blocki = start; blocki < end; blocki++ ) {
+    SumPyramid_addBlock(spc->pyramid, blocki, spc->blockBytes + (blocki * numBytesInBlock));
+  }
+}
+
+// Build every level from a frame of already decoded block order bytes
+
+static inline
+void SumPyramid_addFrame(SumPyramid *pyramid, const uint8_t *blockBytes, int numThreads)
+{
+  SumPyramidContext spc;
+  spc.pyramid = pyramid;
+  spc.blockBytes = blockBytes;
+
+  ParallelFor_run(numThreads, pyramid->numBlocksInWidth * pyramid->numBlocksInHeight, SumPyramid_addChunk, &spc);
+}
+
+#endif // _sum_pyramid_h